@@ -0,0 +1,400 @@
+// gb-batch: runs many short headless emulation jobs on all cores
+//
+//   gb-batch [--threads <count>] [--pin] <manifest> <results>
+//
+// Each manifest line is a job: `<rom-path> <frames> [<input-script-path>]`.
+// Jobs are spread over per-worker queues; idle workers steal from the others.
+// Results are written in manifest order, one line per job:
+//
+//   <job> <status> <framebuffer-hash> <t-cycles> <wall-ms> <rom-path>
+//
+// <t-cycles> is the emulated time in 4.194304 MHz clock cycles, 70224 per frame.
+//
+// A job which fails an assertion in the emulator only fails itself.
+// Jobs neither load nor write savegames.
+
+#define _GNU_SOURCE
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <setjmp.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "gameboy_context.h"
+#include "input_script.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+typedef enum {
+  JOB_PENDING,
+  JOB_OK,
+  JOB_FAILED,
+  JOB_MISSING
+} JobStatus;
+
+static const char* job_status_names[] = {
+  [JOB_PENDING] = "pending",
+  [JOB_OK] = "ok",
+  [JOB_FAILED] = "failed",
+  [JOB_MISSING] = "missing"
+};
+
+typedef struct {
+  char* rom_path;
+  char* input_script_path;
+  unsigned int frames;
+
+  // Results
+  JobStatus status;
+  uint64_t framebuffer_hash;
+  uint64_t cycles; // Clock cycles (T-cycles)
+  double wall_ms;
+  char failure[256];
+} Job;
+
+// Work-stealing queue: the owner takes from the bottom, thieves from the top.
+// Jobs take milliseconds, so a lock per queue is cheap enough.
+typedef struct {
+  pthread_mutex_t lock;
+  size_t* jobs;
+  size_t top;
+  size_t bottom;
+} JobQueue;
+
+typedef struct {
+  unsigned int index;
+  pthread_t thread;
+  int cpu; // -1 if not pinned
+  unsigned int steals;
+} Worker;
+
+static Job* jobs = NULL;
+static size_t job_count = 0;
+
+static JobQueue* queues = NULL;
+static Worker* workers = NULL;
+static unsigned int worker_count = 0;
+
+
+// Set while a job is running on this thread, so assertions can abandon it
+static __thread sigjmp_buf* job_abort = NULL;
+static __thread Job* job_current = NULL;
+
+// Replaces the libc handler for the emulator's assert(): the failing job is
+// abandoned instead of aborting every other job in the process
+void __assert_fail(const char* assertion, const char* file, unsigned int line, const char* function) {
+  if (job_abort == NULL) {
+    fprintf(stderr, "%s:%u: %s: Assertion `%s' failed.\n", file, line, function, assertion);
+    abort();
+  }
+  snprintf(job_current->failure, sizeof(job_current->failure), "%s:%u: %s: Assertion `%s' failed.", file, line, function, assertion);
+  siglongjmp(*job_abort, 1);
+}
+
+static double now_ms() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+// FNV-1a
+static uint64_t hash_framebuffer(const uint8_t* framebuffer) {
+  uint64_t hash = 0xCBF29CE484222325;
+  for(unsigned int i = 0; i < GAMEBOY_SCREEN_WIDTH * GAMEBOY_SCREEN_HEIGHT; i++) {
+    hash ^= framebuffer[i];
+    hash *= 0x100000001B3;
+  }
+  return hash;
+}
+
+static void run_job(Job* job) {
+  double start = now_ms();
+
+  if (access(job->rom_path, R_OK) != 0) {
+    job->status = JOB_MISSING;
+    snprintf(job->failure, sizeof(job->failure), "Could not read ROM");
+    return;
+  }
+
+  InputScript script = { 0 };
+  if ((job->input_script_path != NULL) && !input_script_load(&script, job->input_script_path)) {
+    job->status = JOB_MISSING;
+    snprintf(job->failure, sizeof(job->failure), "Could not load input script");
+    return;
+  }
+
+  // Assertions while loading the ROM count as failures of this job, too
+  sigjmp_buf abort_point;
+  GameboyContext* volatile context = NULL;
+  job_current = job;
+  if (sigsetjmp(abort_point, 0) == 0) {
+    job_abort = &abort_point;
+
+    // Jobs don't share savegames, so each result only depends on its own job
+    context = gameboy_context_init(job->rom_path, GAMEBOY_CONTEXT_NO_SAVE);
+    if (context == NULL) {
+      job->status = JOB_FAILED;
+      snprintf(job->failure, sizeof(job->failure), "Could not create context");
+    } else {
+      // Only the last frame is hashed, so the others aren't drawn
+      gameboy_context_render_policy(context, GAMEBOY_RENDER_ON_REQUEST, 0);
+      size_t cursor = 0;
+      for(unsigned int frame = 0; frame < job->frames; frame++) {
+        GameboyInput input = input_script_input(&script, &cursor, frame);
+        gameboy_context_input(context, &input);
+        if (frame + 1 == job->frames) {
+          gameboy_context_request_frame(context);
+        }
+        gameboy_context_step(context);
+      }
+      job->status = JOB_OK;
+    }
+  } else {
+    job->status = JOB_FAILED;
+  }
+  job_abort = NULL;
+  job_current = NULL;
+
+  if (context != NULL) {
+    job->framebuffer_hash = hash_framebuffer(gameboy_context_framebuffer(context));
+    job->cycles = gameboy_context_cycles(context);
+    gameboy_context_destroy(context);
+  }
+  input_script_free(&script);
+
+  job->wall_ms = now_ms() - start;
+}
+
+static bool take_job(JobQueue* queue, size_t* job_index) {
+  bool found = false;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->top < queue->bottom) {
+    *job_index = queue->jobs[--queue->bottom];
+    found = true;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+static bool steal_job(JobQueue* queue, size_t* job_index) {
+  bool found = false;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->top < queue->bottom) {
+    *job_index = queue->jobs[queue->top++];
+    found = true;
+  }
+  pthread_mutex_unlock(&queue->lock);
+  return found;
+}
+
+static void* worker_main(void* argument) {
+  Worker* worker = argument;
+
+  if (worker->cpu >= 0) {
+    cpu_set_t cpus;
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->cpu, &cpus);
+    int error = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    if (error != 0) {
+      fprintf(stderr, "Could not pin worker %u to CPU %d\n", worker->index, worker->cpu);
+    }
+  }
+
+  // No jobs are added once the workers run, so a full pass over all queues
+  // without finding work means everything has been handed out
+  while(true) {
+    size_t job_index;
+    bool found = take_job(&queues[worker->index], &job_index);
+    for(unsigned int i = 1; !found && (i < worker_count); i++) {
+      found = steal_job(&queues[(worker->index + i) % worker_count], &job_index);
+      worker->steals += found;
+    }
+    if (!found) {
+      break;
+    }
+    run_job(&jobs[job_index]);
+  }
+
+  return NULL;
+}
+
+static bool load_manifest(const char* path) {
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Could not open manifest '%s'\n", path);
+    return false;
+  }
+
+  size_t capacity = 0;
+  unsigned int line_number = 0;
+  char line[4096];
+  while(fgets(line, sizeof(line), f) != NULL) {
+    line_number++;
+
+    // Strip comments
+    char* comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+
+    const char* separators = " \t\r\n";
+    char* saveptr;
+    char* rom_path = strtok_r(line, separators, &saveptr);
+    if (rom_path == NULL) {
+      continue;
+    }
+    char* frames = strtok_r(NULL, separators, &saveptr);
+    char* input_script_path = strtok_r(NULL, separators, &saveptr);
+    char* end = NULL;
+    if (frames != NULL) {
+      strtoul(frames, &end, 0);
+    }
+    if ((end == NULL) || (*end != '\0') || (strtok_r(NULL, separators, &saveptr) != NULL)) {
+      fprintf(stderr, "%s:%u: Expected <rom-path> <frames> [<input-script-path>]\n", path, line_number);
+      fclose(f);
+      return false;
+    }
+
+    if (job_count == capacity) {
+      capacity = capacity ? capacity * 2 : 256;
+      jobs = realloc(jobs, capacity * sizeof(Job));
+      assert(jobs != NULL);
+    }
+    Job* job = &jobs[job_count++];
+    memset(job, 0x00, sizeof(Job));
+    job->rom_path = strdup(rom_path);
+    job->input_script_path = input_script_path ? strdup(input_script_path) : NULL;
+    job->frames = strtoul(frames, NULL, 0);
+    job->status = JOB_PENDING;
+  }
+
+  fclose(f);
+  return true;
+}
+
+static bool write_results(const char* path) {
+  FILE* f = fopen(path, "w");
+  if (f == NULL) {
+    fprintf(stderr, "Could not open results '%s'\n", path);
+    return false;
+  }
+
+  fprintf(f, "# job status framebuffer-hash t-cycles wall-ms rom-path\n");
+  for(size_t i = 0; i < job_count; i++) {
+    Job* job = &jobs[i];
+    fprintf(f, "%zu %s %016lX %lu %.3f %s\n",
+            i, job_status_names[job->status], job->framebuffer_hash,
+            job->cycles, job->wall_ms, job->rom_path);
+    if (job->failure[0] != '\0') {
+      fprintf(f, "#   %s\n", job->failure);
+    }
+  }
+
+  fclose(f);
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+
+  // Check for arguments
+  unsigned int thread_count = 0;
+  bool pin = false;
+  int argi = 1;
+  while((argi < argc) && (argv[argi][0] == '-')) {
+    if (!strcmp(argv[argi], "--threads") && (argi + 1 < argc)) {
+      thread_count = strtoul(argv[argi + 1], NULL, 0);
+      argi += 2;
+    } else if (!strcmp(argv[argi], "--pin")) {
+      pin = true;
+      argi += 1;
+    } else {
+      break;
+    }
+  }
+  if (argc - argi != 2) {
+    assert(argc >= 1);
+    fprintf(stderr, "Usage: %s [--threads <count>] [--pin] <manifest> <results>\n", argv[0]);
+    return 1;
+  }
+  const char* manifest_path = argv[argi + 0];
+  const char* results_path = argv[argi + 1];
+
+  if (!load_manifest(manifest_path)) {
+    return 1;
+  }
+
+  // One worker per available CPU by default
+  cpu_set_t available;
+  CPU_ZERO(&available);
+  sched_getaffinity(0, sizeof(available), &available);
+  int cpus[CPU_SETSIZE];
+  unsigned int cpu_count = 0;
+  for(int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &available)) {
+      cpus[cpu_count++] = cpu;
+    }
+  }
+  if (cpu_count == 0) {
+    cpus[cpu_count++] = 0;
+  }
+  worker_count = thread_count ? thread_count : cpu_count;
+
+  // Deal the jobs out in contiguous runs; stealing balances the rest
+  queues = calloc(worker_count, sizeof(JobQueue));
+  workers = calloc(worker_count, sizeof(Worker));
+  assert((queues != NULL) && (workers != NULL));
+  for(unsigned int i = 0; i < worker_count; i++) {
+    JobQueue* queue = &queues[i];
+    pthread_mutex_init(&queue->lock, NULL);
+    size_t first = job_count * i / worker_count;
+    size_t last = job_count * (i + 1) / worker_count;
+    queue->jobs = malloc((last - first + 1) * sizeof(size_t));
+    assert(queue->jobs != NULL);
+
+    // Owner pops from the bottom, so push in reverse to run in manifest order
+    for(size_t j = last; j > first; j--) {
+      queue->jobs[queue->bottom++] = j - 1;
+    }
+  }
+
+  printf("Running %zu jobs on %u workers\n", job_count, worker_count);
+  double start = now_ms();
+
+  for(unsigned int i = 0; i < worker_count; i++) {
+    Worker* worker = &workers[i];
+    worker->index = i;
+    worker->cpu = pin ? cpus[i % cpu_count] : -1;
+    int error = pthread_create(&worker->thread, NULL, worker_main, worker);
+    assert(error == 0);
+  }
+
+  unsigned int steals = 0;
+  for(unsigned int i = 0; i < worker_count; i++) {
+    pthread_join(workers[i].thread, NULL);
+    steals += workers[i].steals;
+  }
+
+  double elapsed_ms = now_ms() - start;
+
+  // Summary
+  size_t status_counts[ARRAY_SIZE(job_status_names)] = { 0 };
+  for(size_t i = 0; i < job_count; i++) {
+    status_counts[jobs[i].status]++;
+  }
+  printf("Done in %.3f s (%u steals): %zu ok, %zu failed, %zu missing\n",
+         elapsed_ms / 1000.0, steals,
+         status_counts[JOB_OK], status_counts[JOB_FAILED], status_counts[JOB_MISSING]);
+
+  if (!write_results(results_path)) {
+    return 1;
+  }
+
+  return (status_counts[JOB_OK] == job_count) ? 0 : 2;
+}
@@ -11,14 +11,313 @@
 #include <string.h>
 #include <assert.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sched.h>
+#include <unistd.h>
 
 #include "gameboy.h"
+#include "gameboy_context.h"
 
 GameboyInput gameboy_input;
 uint8_t gameboy_framebuffer[GAMEBOY_SCREEN_WIDTH * GAMEBOY_SCREEN_HEIGHT];
 
-size_t cartridge_rom_size = 0;
-uint8_t* cartridge_rom_memory = NULL;
+// Emulator state
+//
+// Everything which belongs to one emulated Game Boy lives in GameboyContext,
+// so several can run in one process. The context being emulated by the
+// current thread is selected through `gb`.
+
+#define CARTRIDGE_RAM_BANKS 16
+#define TILE_COUNT 384
+#define RTC_SAVE_SIZE 48
+
+typedef struct {
+
+  // 3-0  -     -   -    Not used (always zero)
+  uint8_t zero:4; // mask: 0x1 | 0x02 | 0x04 | 0x08
+
+  // 4    cy    C   NC   Carry Flag
+  uint8_t cy:1;   // mask: 0x10
+
+  // 5    h     -   -    Half Carry Flag (BCD)
+  uint8_t h:1;    // mask: 0x20
+
+  // 6    n     -   -    Add/Sub-Flag (BCD)
+  uint8_t n:1; // 0x40
+
+  // 7    zf    Z   NZ   Zero Flag
+  uint8_t zf:1;   // mask: 0x80
+
+} Flags;
+
+typedef struct {
+  union { uint16_t af; struct { Flags f; uint8_t a; }; };
+  union { uint16_t bc; struct { uint8_t c; uint8_t b; }; };
+  union { uint16_t de; struct { uint8_t e; uint8_t d; }; };
+  union { uint16_t hl; struct { uint8_t l; uint8_t h; }; };
+  uint16_t sp;
+  uint16_t pc;
+} Registers;
+
+// Lazy flag state, see materialize_flags()
+typedef enum {
+  FLAGS_MATERIALIZED, // cpu.f is up to date
+  FLAGS_ADD,          // add8 (a + b)
+  FLAGS_ADD_KEEP_CY,  // add8 without carry update (inc)
+  FLAGS_SUB,          // sub8 (a - b)
+  FLAGS_SUB_KEEP_CY,  // sub8 without carry update (dec)
+  FLAGS_AND,          // and8
+  FLAGS_LOGIC,        // or8, xor8, swap
+  FLAGS_SHIFT,        // Rotates and shifts, carry holds the shifted out bit
+  FLAGS_SHIFT_A,      // rla, rra, rlca, rrca (zero flag always cleared)
+  FLAGS_ADD16,        // add16, zero holds the previous zero flag
+  FLAGS_BIT           // cb bit, result holds the tested bit
+} FlagsOperation;
+
+typedef struct {
+  FlagsOperation operation;
+  int a;
+  int b;
+  int result;
+  bool carry; // Carry flag which is not derived from the operands
+  bool zero;  // Zero flag which is not derived from the operands
+} LazyFlags;
+
+typedef struct {
+  unsigned int length;
+  unsigned int(*emulate)(uint8_t*); // unsigned int func(uint8_t*) {}
+  void(*disassemble)(uint8_t*, char*); // void func(uint8_t*, char*) {}
+} InstructionHandler;
+
+// Memory bank controller, see get_mapper()
+typedef struct {
+  const char* name;
+  void(*write_register)(uint16_t address, uint8_t v); // 0000-7FFF
+  uint8_t(*read_ram)(uint16_t address); // A000-BFFF while not ram_mapped, NULL reads FFh
+  void(*write_ram)(uint16_t address, uint8_t v); // A000-BFFF while not ram_mapped, NULL ignores the write
+} Mapper;
+
+#define IDLE_LOOP_COUNT 64
+
+typedef struct {
+  unsigned int bank;
+  uint16_t address;
+  unsigned long detections;
+  unsigned long skipped_cycles;
+} IdleLoop;
+
+#if defined(__x86_64__) && defined(__unix__)
+#define JIT 1
+#else
+#define JIT 0
+#endif
+
+#define DECODED_BLOCK_COUNT 1024
+#define DECODED_BLOCK_LENGTH 32
+
+typedef struct {
+  const InstructionHandler* handler;
+  uint16_t pc;
+  uint8_t code[3];
+} DecodedInstruction;
+
+typedef int(*JitFunction)(Registers*, int); // int func(Registers* registers, int mcycles) {}
+
+typedef struct {
+  bool valid;
+  unsigned int bank;
+  uint16_t pc;
+  uint16_t end; // Address after the last instruction
+  unsigned int count;
+  DecodedInstruction instructions[DECODED_BLOCK_LENGTH];
+
+  // Recompiler state
+  unsigned int executions;
+  bool jit_failed;
+  JitFunction jit;
+} DecodedBlock;
+
+typedef enum {
+  EVENT_LCD_MODE2,   // Start of line (Mode 2, or Mode 1 in V-Blank)
+  EVENT_LCD_MODE3,
+  EVENT_LCD_MODE0,
+  EVENT_LCD_LINE_END,
+  EVENT_DMA_END
+} EventType;
+
+typedef struct {
+  uint64_t cycle;
+  unsigned int sequence; // Events for the same cycle are handled in order
+  EventType type;
+} Event;
+
+#define EVENT_QUEUE_SIZE 16
+
+// VRAM and OAM, with what the renderer derives from them. The render thread
+// keeps a copy of its own, see run_render_thread().
+typedef struct {
+  uint8_t vram_memory[8 * 1024];
+  uint8_t tile_pixels[2][TILE_COUNT][8][8]; // Tile data decoded by [flip_x][tile][row][x], see get_tile_row()
+  uint8_t oam_memory[0xA0];
+  bool oam_index_valid; // Cleared by writes to OAM, see scan_oam_line()
+  uint64_t oam_buckets[0x100 / 8]; // OAM entries by Y coordinate / 8, one bit each
+} VideoMemory;
+
+struct GameboyContext {
+  GameboyInput input;
+  uint8_t framebuffer[GAMEBOY_SCREEN_WIDTH * GAMEBOY_SCREEN_HEIGHT];
+
+  // Cartridge
+  size_t cartridge_rom_size;
+  uint8_t* cartridge_rom_memory; // Read-only
+  bool cartridge_rom_mapped; // mmap()ed rather than allocated
+
+  // Mapper (MBC), see update_cartridge_banks()
+  const Mapper* mapper;
+  size_t cartridge_ram_size; // From the header
+  bool ram_enable; // 0000-1FFF - RAM Enable (Write Only)
+  uint16_t mbc_rom_bank; // ROM Bank Number as written
+  uint8_t mbc_ram_bank; // RAM Bank Number as written (MBC1: or upper bits of the ROM Bank Number, MBC3: or RTC register)
+  bool mbc_mode; // MBC1: ROM/RAM Mode Select
+  unsigned int rom_bank_low; // Mapped at 0000-3FFF
+  unsigned int rom_bank_high; // Mapped at 4000-7FFF
+  unsigned int ram_bank; // Mapped at A000-BFFF
+  bool ram_mapped; // The RAM bank is accessed without the mapper
+
+  // MBC3 real time clock, see update_rtc()
+  bool rtc_present;
+  uint8_t rtc[5]; // Seconds, minutes, hours, day counter low, day counter high
+  uint8_t rtc_latched[5]; // What the game reads
+  uint8_t rtc_latch; // Last write to 6000-7FFF
+  uint64_t rtc_cycle; // Time up to which the clock was advanced
+
+  // Battery-backed cartridge RAM, see update_save()
+  char* save_path;
+  size_t save_size; // RAM from the header plus RTC_SAVE_SIZE with a clock; 0 without battery
+  uint16_t cartridge_ram_dirty; // One bit per bank written since the last hand-off
+  unsigned int save_frames; // Since the last hand-off
+  uint8_t save_image[8 * 1024 * CARTRIDGE_RAM_BANKS + RTC_SAVE_SIZE]; // For the writer, guarded by save_lock
+  bool save_pending;
+  bool save_stop;
+  bool save_thread_started;
+  pthread_t save_thread;
+  pthread_mutex_t save_lock;
+  pthread_cond_t save_wake;
+
+  // Memory
+  uint8_t io_ports[0x80];
+  uint8_t palette_shades[3][4]; // Intensity of each color of BGP, OBP0 and OBP1, see write_palette()
+  VideoMemory video;
+  uint8_t cartridge_ram_memory[8 * 1024 * CARTRIDGE_RAM_BANKS];
+  uint8_t wram0_memory[4 * 1024];
+  uint8_t wram1_memory[4 * 1024];
+  uint8_t hram_memory[0x80];
+
+  // Memory map: host memory of each 256 byte page of the address space.
+  // NULL pages are handled by read_memory_slow() / write_memory_slow().
+  uint8_t* read_pages[0x100];
+  uint8_t* write_pages[0x100];
+
+  // CPU
+  Registers cpu;
+  LazyFlags lazy_flags;
+  uint8_t ie;
+  bool ime;
+  bool halted;
+  unsigned long halt_skipped_cycles;
+
+  // Idle loop detection
+  bool idle_memory_written; // Set by every write
+  IdleLoop idle_loops[IDLE_LOOP_COUNT];
+  unsigned int idle_loop_count;
+  IdleLoop* idle_loop; // Loop being skipped
+  bool idle_loop_valid; // State at the last backward branch
+  Registers idle_loop_cpu;
+  bool idle_loop_ime;
+
+  // Decoded block cache
+  unsigned int decoded_block_epoch;
+  uint8_t decoded_code_bitmap[(0x2000 + 0x80) / 8];
+  DecodedBlock decoded_blocks[DECODED_BLOCK_COUNT];
+  DecodedBlock* decoded_block; // Current block of cpu_step_cached()
+  unsigned int decoded_block_index;
+  unsigned int decoded_block_current_epoch;
+  unsigned long decoded_block_hits;
+  unsigned long decoded_block_misses;
+  unsigned long decoded_block_invalidations;
+  unsigned long decoded_block_uncached;
+
+#if JIT
+  // Recompiler
+  uint8_t* jit_code;
+  size_t jit_code_used;
+  unsigned long jit_compiled_blocks;
+  unsigned long jit_failed_blocks;
+  unsigned long jit_executions;
+  unsigned long jit_bailouts;
+  unsigned long jit_divergences;
+#endif
+
+  // Scheduler
+  uint64_t cycle_counter; // Time since power-on, in the units of cpu_step()
+  uint64_t step_end; // Cycle count at which the budget of the current cpu_step() call runs out
+  int step_mcycles; // Budget left when the current instruction started
+  Event event_queue[EVENT_QUEUE_SIZE]; // Binary heap
+  unsigned int event_count;
+  unsigned int event_sequence;
+
+  // LCD
+  uint8_t lcd_ly;
+  uint8_t lcd_window_line; // Next line of the window map
+  bool frame_done;
+
+  // Frame skipping, see should_render_frame()
+  GameboyRenderPolicy render_policy;
+  unsigned int render_interval;
+  bool render_frame; // Lines of the current frame are drawn
+  bool render_requested;
+  unsigned int render_skipped; // Frames since the last one drawn
+  double realtime_start; // Host time at which realtime_start_cycle was reached
+  uint64_t realtime_start_cycle;
+
+  // Render thread, see run_render_thread()
+  bool render_thread_started;
+  pthread_t render_thread;
+  pthread_mutex_t render_lock; // Only taken to sleep or to wake the other side
+  pthread_cond_t render_wake; // For the render thread: lines were queued, the emulator waits or the thread stops
+  pthread_cond_t render_done; // For the emulator: a line was drawn
+  atomic_bool render_thread_running;
+  atomic_bool render_thread_waiting;
+  atomic_bool render_emulator_waiting;
+  struct LcdRegisters* lcd_lines; // Ring buffer, the emulator only writes head, the render thread only writes tail
+  atomic_size_t lcd_lines_head;
+  atomic_size_t lcd_lines_tail;
+  struct VideoSnapshot* video_snapshots; // Ring buffer like lcd_lines, its head is the version of VRAM and OAM
+  atomic_size_t video_snapshots_head;
+  atomic_size_t video_snapshots_tail;
+  uint16_t vram_dirty_start; // VRAM offsets written since the last snapshot
+  uint16_t vram_dirty_end;
+  bool oam_dirty;
+  VideoMemory* render_video; // Only used by the render thread
+  uint8_t render_window_line;
+
+  // OAM DMA
+  bool dma_active;
+  uint64_t dma_end_cycle;
+
+  bool fast_mode;
+
+#if DEBUG
+  bool trace_enabled; // Instructions go to the trace, see start_trace()
+#endif
+};
+
+static __thread GameboyContext* gb = NULL;
+
+// Context used by the single-instance API (gameboy.h)
+static GameboyContext* gameboy = NULL;
+
 
 
 // Declare IO ports
@@ -58,381 +357,1160 @@ uint8_t* cartridge_rom_memory = NULL;
 #define WY   0xFF4A
 #define WX   0xFF4B
 
-static uint8_t io_ports[0x80];
-static uint8_t ie;
-static bool ime;
 
-static uint8_t read_io8(uint16_t address) {
-  assert((address >= 0xFF00) && (address <= 0xFF7F));
-  int offset = address - 0xFF00;
-  uint8_t v = io_ports[offset];
+// I/O registers with side effects, see io_read_handlers / io_write_handlers
+
+static uint8_t read_joyp(uint16_t address) {
+  uint8_t v = gb->io_ports[address - 0xFF00];
+
+  // Clear inputs (1=not-pressed)
+  v |= 0xF;
+
+  // The eight gameboy buttons/direction keys are arranged in form of a 2x4 matrix.
+  // Select either button or direction keys by writing to this register, then read-out bit 0-3.
   
-  if (address == JOYP) {
-      
-    // Clear inputs (1=not-pressed)
-    v |= 0xF;
   
-    // The eight gameboy buttons/direction keys are arranged in form of a 2x4 matrix.
-    // Select either button or direction keys by writing to this register, then read-out bit 0-3.
-    
-    
-    // Bit 5 - Select Button Keys      (0=Select)
-    bool button_mode = !(v & (1 << 5));
- 
-    //  Bit 4 - Select Direction Keys   (0=Select)
-    bool direction_mode = !(v & (1 << 4));
-    
-    // Check for mode conflicts
-    
-    assert(button_mode != direction_mode);     
-
-    if (button_mode) {
-      // Bit 3 - Start    (0=Pressed) (Read Only)
-      if (gameboy_input.start) { v &= ~(1 << 3); }
-      // Bit 2 - Select   (0=Pressed) (Read Only)
-      if (gameboy_input.select) { v &= ~(1 << 2); }
-      // Bit 1 - Button B (0=Pressed) (Read Only)
-      if (gameboy_input.b) { v &= ~(1 << 1); }
-      // Bit 0 - Button A (0=Pressed) (Read Only)
-      if (gameboy_input.a) { v &= ~(1 << 0); }
-    }
-    
-    if (direction_mode) {
-      // Bit 3 - Input Down  (0=Pressed) (Read Only)
-      if (gameboy_input.down) { v &= ~(1 << 3); }
-      // Bit 2 - Input Up    (0=Pressed) (Read Only)
-      if (gameboy_input.up) { v &= ~(1 << 2); }
-      // Bit 1 - Input Left  (0=Pressed) (Read Only)
-      if (gameboy_input.left) { v &= ~(1 << 1); }
-      // Bit 0 - Input Right (0=Pressed) (Read Only)
-      if (gameboy_input.right) { v &= ~(1 << 0); }
-    }
-    return v;
-  }
-
-  return v;
-}
+  // Bit 5 - Select Button Keys      (0=Select)
+  bool button_mode = !(v & (1 << 5));
 
-static uint8_t read_memory8(uint16_t address);
-static void write_memory8(uint16_t address, uint8_t v);
-static void write_io8(uint16_t address, uint8_t v) {
-  assert((address >= 0xFF00) && (address <= 0xFF7F));
-  int offset = address - 0xFF00;
-  io_ports[offset] = v;
+  //  Bit 4 - Select Direction Keys   (0=Select)
+  bool direction_mode = !(v & (1 << 4));
   
-  if (address == DMA) {
+  // Check for mode conflicts
   
-    //timing - From pan docs
-    // It takes 160 microseconds until the transfer has completed (80 microseconds in CGB Double Speed Mode), during this time the CPU can access only HRAM (memory at FF80-FFFE).
-    // For this reason, the programmer must copy a short procedure into HRAM, and use this procedure to start the transfer from inside HRAM, and wait until the transfer has finished.
+  assert(button_mode != direction_mode);     
+
+  if (button_mode) {
+    // Bit 3 - Start    (0=Pressed) (Read Only)
+    if (gb->input.start) { v &= ~(1 << 3); }
+    // Bit 2 - Select   (0=Pressed) (Read Only)
+    if (gb->input.select) { v &= ~(1 << 2); }
+    // Bit 1 - Button B (0=Pressed) (Read Only)
+    if (gb->input.b) { v &= ~(1 << 1); }
+    // Bit 0 - Button A (0=Pressed) (Read Only)
+    if (gb->input.a) { v &= ~(1 << 0); }
+  }
   
-    // Source:      XX00-XX9F   ;XX in range from 00-F1h
-    // Destination: FE00-FE9F
-    uint16_t source = v * 0x100;
-    uint16_t destination = 0xFE00;
-    unsigned int size = 0xA0;
-    while(size--) {
-      uint8_t byte = read_memory8(source++);
-      write_memory8(destination++, byte);
-    }
-    
+  if (direction_mode) {
+    // Bit 3 - Input Down  (0=Pressed) (Read Only)
+    if (gb->input.down) { v &= ~(1 << 3); }
+    // Bit 2 - Input Up    (0=Pressed) (Read Only)
+    if (gb->input.up) { v &= ~(1 << 2); }
+    // Bit 1 - Input Left  (0=Pressed) (Read Only)
+    if (gb->input.left) { v &= ~(1 << 1); }
+    // Bit 0 - Input Right (0=Pressed) (Read Only)
+    if (gb->input.right) { v &= ~(1 << 0); }
   }
 
+  return v;
 }
 
-#define CARTRIDGE_RAM_BANKS 4
+static void start_dma(uint8_t source_page);
+static void write_dma(uint16_t address, uint8_t v) {
+  gb->io_ports[address - 0xFF00] = v;
+  start_dma(v);
+}
 
-static uint8_t vram_memory[8 * 1024];
-static uint8_t cartridge_ram_memory[8 * 1024 * CARTRIDGE_RAM_BANKS];
-static uint8_t wram0_memory[4 * 1024];
-static uint8_t wram1_memory[4 * 1024];
-static uint8_t echo_memory[0x1E00];
-static uint8_t oam_memory[0xA0];
-static uint8_t hram_memory[0x80];
+static uint8_t u2_to_u8(unsigned int v) { 
+  // ab => abababab
+  // 00 => 00000000 = 0%
+  // 01 => 01010101 = 33%
+  // 10 => 10101010 = 66%
+  // 11 => 11111111 = 100%
+  assert(v <= 3);
+  return (v << 6) | (v << 4) | (v << 2) | v;
+}
 
+// The renderer looks colors up in palette_shades[], so it is rebuilt here.
+// Each line is drawn when mode 3 ends, so changes made during H-Blank show up from the next line.
+static void write_palette(uint16_t address, uint8_t v) {
+  gb->io_ports[address - 0xFF00] = v;
 
+  // Bit 7-6 - Shade for Color Number 3
+  // Bit 5-4 - Shade for Color Number 2
+  // Bit 3-2 - Shade for Color Number 1
+  // Bit 1-0 - Shade for Color Number 0
+  uint8_t* shades = gb->palette_shades[address - BGP];
+  for(unsigned int i = 0; i < 4; i++) {
+    uint8_t palette_color = (v >> (2 * i)) & 0x3;
 
-// MBC1
-static bool ram_enable; // 0000-1FFF - RAM Enable (Write Only)
-static uint8_t rom_bank_number; // 2000-3FFF - ROM Bank Number (Write Only)
-static uint8_t rom_ram_bank_number; // 4000-5FFF - RAM Bank Number - or - Upper Bits of ROM Bank Number (Write Only)
-static bool rom_ram_mode_select; // 6000-7FFF - ROM/RAM Mode Select (Write Only)
+    // Remap color (0 = white, 3 = black)
+    shades[i] = u2_to_u8(3 - palette_color);
+  }
+}
 
-//FIXME: Should be MBC1
-static unsigned int get_rom_bank_number(unsigned address) {
+// Registers without a handler are plain storage in io_ports[].
+// Write handlers are responsible for storing the value.
+typedef uint8_t(*IoReadHandler)(uint16_t address);
+typedef void(*IoWriteHandler)(uint16_t address, uint8_t v);
 
-  if ((address >= 0x4000) && (address <= 0x7FFF)) {
+static const IoReadHandler io_read_handlers[0x80] = {
+  [JOYP - 0xFF00] = read_joyp,
+};
 
-    int bank_number;
-    if (!rom_ram_mode_select) { // 00h = ROM Banking Mode (up to 8KByte RAM, 2MByte ROM) (default)
-      // 7 bit ROM bank number
-      return (rom_ram_bank_number << 5) | rom_bank_number;
-    }
+static const IoWriteHandler io_write_handlers[0x80] = {
+  [DMA - 0xFF00] = write_dma,
+  [BGP - 0xFF00] = write_palette,
+  [OBP0 - 0xFF00] = write_palette,
+  [OBP1 - 0xFF00] = write_palette,
+};
 
-    // 01h = RAM Banking Mode (up to 32KByte RAM, 512KByte ROM)
-    // 5 bit ROM bank number
-    return rom_bank_number;
+static uint8_t read_io8(uint16_t address) {
+  assert((address >= 0xFF00) && (address <= 0xFF7F));
+  int offset = address - 0xFF00;
+  IoReadHandler handler = io_read_handlers[offset];
+  if (handler != NULL) {
+    return handler(address);
+  }
+  return gb->io_ports[offset];
+}
 
+static void write_io8(uint16_t address, uint8_t v) {
+  assert((address >= 0xFF00) && (address <= 0xFF7F));
+  int offset = address - 0xFF00;
+  IoWriteHandler handler = io_write_handlers[offset];
+  if (handler != NULL) {
+    handler(address, v);
+    return;
   }
+  gb->io_ports[offset] = v;
+}
 
+// ROM bank visible at `address`, to tell code from different banks apart
+static unsigned int get_rom_bank_number(unsigned address) {
+  if (address <= 0x3FFF) {
+    return gb->rom_bank_low;
+  } else if (address <= 0x7FFF) {
+    return gb->rom_bank_high;
+  }
   return 0x00;
 }
 
-
-//FIXME: Should be MBC1
-static unsigned int get_ram_bank_number() {
-
-  int bank_number;
-  if (!rom_ram_mode_select) { // 00h = ROM Banking Mode (up to 8KByte RAM, 2MByte ROM) (default)
-    return 0x00;
+// Points `size` bytes of the address space at `memory` (or the slow path if NULL)
+static void map_pages(uint8_t** pages, uint16_t address, unsigned int size, uint8_t* memory) {
+  assert((address % 0x100 == 0) && (size % 0x100 == 0));
+  for(unsigned int offset = 0; offset < size; offset += 0x100) {
+    pages[(address + offset) >> 8] = (memory != NULL) ? &memory[offset] : NULL;
   }
-
-  // 01h = RAM Banking Mode (up to 32KByte RAM, 512KByte ROM)
-  return rom_ram_bank_number;
 }
 
-// Implements memory maps (except I/O ports)
-static uint8_t* map_memory(uint16_t address) {
-
-  // 0000-3FFF   16KB ROM Bank 00     (in cartridge, fixed at bank 00)
-  if ((address >= 0x0000) && (address <= 0x3FFF)) {
-    int offset = address - 0x0000;
-    return &cartridge_rom_memory[offset];
+// Maps the banks selected by the mapper; called whenever they change
+static void map_cartridge_banks() {
 
+  // 0000-3FFF   16KB ROM Bank 00     (in cartridge, fixed at bank 00, except for MBC1 mode 1)
   // 4000-7FFF   16KB ROM Bank 01..NN (in cartridge, switchable bank number)
-  } else if ((address >= 0x4000) && (address <= 0x7FFF)) {
-    int offset = address - 0x4000;
-    int bank_base = get_rom_bank_number(address) * 0x4000;
-    return &cartridge_rom_memory[bank_base + offset];
+  map_pages(gb->read_pages, 0x0000, 0x4000, &gb->cartridge_rom_memory[gb->rom_bank_low * 0x4000]);
+  map_pages(gb->read_pages, 0x4000, 0x4000, &gb->cartridge_rom_memory[gb->rom_bank_high * 0x4000]);
 
-  // 8000-9FFF   8KB Video RAM (VRAM) (switchable bank 0-1 in CGB Mode)
-  } else if ((address >= 0x8000) && (address <= 0x9FFF)) {
-    int offset = address - 0x8000;
+  // A000-BFFF   8KB External RAM     (in cartridge, switchable bank, if any)
+  // Writes to banks which aren't dirty yet take the slow path, to mark them
+  uint8_t* ram_bank = gb->ram_mapped ? &gb->cartridge_ram_memory[gb->ram_bank * 0x2000] : NULL;
+  bool dirty = (gb->save_size == 0) || (gb->cartridge_ram_dirty & (1 << gb->ram_bank));
+  map_pages(gb->read_pages, 0xA000, 0x2000, ram_bank);
+  map_pages(gb->write_pages, 0xA000, 0x2000, dirty ? ram_bank : NULL);
+}
 
-    
-    //assert(false); // this is possibly only for game boy color -> have to double check
-   //possibly come back to this part
-    return &vram_memory[offset];
+static void initialize_memory_map() {
+  memset(gb->read_pages, 0x00, sizeof(gb->read_pages));
+  memset(gb->write_pages, 0x00, sizeof(gb->write_pages));
 
-  // A000-BFFF   8KB External RAM     (in cartridge, switchable bank, if any)
-  } else if ((address >= 0xA000) && (address <= 0xBFFF)) {
-    int offset = address - 0xA000;
-    int bank_base = get_ram_bank_number() * 0x2000;
-    return &cartridge_ram_memory[bank_base + offset];
+  // 8000-9FFF   8KB Video RAM (VRAM) (switchable bank 0-1 in CGB Mode)
+  // Writes to the tile data take the slow path, to update the tile cache, and
+  // with the render thread so do writes to the maps, to snapshot them
+  map_pages(gb->read_pages, 0x8000, 0x2000, gb->video.vram_memory);
+  if (!gb->render_thread_started) {
+    map_pages(gb->write_pages, 0x9800, 0x0800, &gb->video.vram_memory[0x1800]);
+  }
 
   // C000-CFFF   4KB Work RAM Bank 0 (WRAM)
-  } else if ((address >= 0xC000) && (address <= 0xCFFF)) {
-    int offset = address - 0xC000;
-    return &wram0_memory[offset];
-
   // D000-DFFF   4KB Work RAM Bank 1 (WRAM)  (switchable bank 1-7 in CGB Mode)
-  } else if ((address >= 0xD000) && (address <= 0xDFFF)) {
-    int offset = address - 0xD000;
-
-    
-    //assert(false); // possibly come back to this
-
-    return &wram1_memory[offset];
-
   // E000-FDFF   Same as C000-DDFF (ECHO)    (typically not used)
-  } else if ((address >= 0xE000) && (address <= 0xFDFF)) {
-    int offset = address - 0xE000;
-    return &echo_memory[offset];
-
-  // FE00-FE9F   Sprite Attribute Table (OAM)
-  } else if ((address >= 0xFE00) && (address <= 0xFE9F)) {
-    int offset = address - 0xFE00;
-    return &oam_memory[offset];
+  map_pages(gb->read_pages, 0xC000, 0x1000, gb->wram0_memory);
+  map_pages(gb->write_pages, 0xC000, 0x1000, gb->wram0_memory);
+  map_pages(gb->read_pages, 0xD000, 0x1000, gb->wram1_memory);
+  map_pages(gb->write_pages, 0xD000, 0x1000, gb->wram1_memory);
+  map_pages(gb->read_pages, 0xE000, 0x1000, gb->wram0_memory);
+  map_pages(gb->write_pages, 0xE000, 0x1000, gb->wram0_memory);
+  map_pages(gb->read_pages, 0xF000, 0x0E00, gb->wram1_memory);
+  map_pages(gb->write_pages, 0xF000, 0x0E00, gb->wram1_memory);
+
+  // FE00-FFFF   OAM, unusable area, I/O ports, HRAM and IE share pages,
+  //             so they always take the slow path
+
+  // Cartridge ROM and RAM; writes to 0000-7FFF go to the mapper
+  map_cartridge_banks();
+}
+
+// Pixel kernels
+//
+// Tile decoding and palette application work on many pixels at once. Every
+// kernel has a scalar version and, on x86-64, SSE2 and AVX2 versions. The
+// best one the CPU supports is picked at runtime (GB_SIMD=scalar|sse2|avx2
+// overrides it). All of them produce identical output; F10 benchmarks them.
+
+#if defined(__x86_64__)
+#define SIMD 1
+#else
+#define SIMD 0
+#endif
 
-  // FEA0-FEFF   Not Usable
-  } else if ((address >= 0xFEA0) && (address <= 0xFEFF)) {
-    // Already handled in read_/write_memory.
-    assert(false);
+#if SIMD
+#include <immintrin.h>
+#endif
 
-  // FF00-FF7F   I/O Ports
-  } else if ((address >= 0xFF00) && (address <= 0xFF7F)) {
-    // Already handled in read_/write_memory.
-    assert(false);
+// Converts `count` tile rows (low and high bitplane byte each) to 8 palette indices
+// per row, left to right and mirrored
+typedef void(*DecodeTileRows)(const uint8_t* planes, uint8_t* pixels, uint8_t* flipped_pixels, size_t count);
+
+// Writes the shades for `count` palette indices; if `transparent`, color 0 keeps the image pixel
+typedef void(*ComposePixels)(uint8_t* image, const uint8_t* indices, size_t count, const uint8_t* shades, bool transparent);
+
+static void decode_tile_rows_scalar(const uint8_t* planes, uint8_t* pixels, uint8_t* flipped_pixels, size_t count) {
+  for(size_t i = 0; i < count; i++) {
+    uint8_t low_byte = planes[i * 2 + 0];
+    uint8_t high_byte = planes[i * 2 + 1];
+    for(unsigned int x = 0; x < 8; x++) {
+      unsigned int low_bit = (low_byte >> (7 - x)) & 1;
+      unsigned int high_bit = (high_byte >> (7 - x)) & 1;
+      uint8_t palette_index = (high_bit << 1) | low_bit;
+      pixels[i * 8 + x] = palette_index;
+      flipped_pixels[i * 8 + (7 - x)] = palette_index;
+    }
+  }
+}
 
-  // FF80-FFFE   High RAM (HRAM)
-  } else if ((address >= 0xFF80) && (address <= 0xFFFE)) {
-    int offset = address - 0xFF80;
-    return &hram_memory[offset];
+static void compose_pixels_scalar(uint8_t* image, const uint8_t* indices, size_t count, const uint8_t* shades, bool transparent) {
+  for(size_t i = 0; i < count; i++) {
 
-  // FFFF        Interrupt Enable Register
-  } else if (address == 0xFFFF) {
-     return &ie;
+    // Skip color 0:  
+    // - For background: already drawn
+    // - For sprites: transparent
+    if (transparent && (indices[i] == 0)) {
+      continue;
+    }
+    image[i] = shades[indices[i]];
+  }
+}
 
-  } else {
-    fprintf(stderr, "Unmapped memory address: 0x%04X\n", address);
-    assert(false);
+#if SIMD
+
+// Bytes 80h, 40h, .. 01h (left to right) and 01h, 02h, .. 80h (mirrored)
+#define TILE_BITS 0x0102040810204080ULL
+#define TILE_BITS_FLIPPED 0x8040201008040201ULL
+
+// 0xFF in each byte which has the bit of `bits` set
+static inline __m128i expand_bits_sse2(__m128i bytes, __m128i bits) {
+  return _mm_cmpeq_epi8(_mm_and_si128(bytes, bits), bits);
+}
+
+// Repeats each of the lower 8 bytes 8 times, 2 rows per register
+static inline void spread_rows_sse2(__m128i bytes, __m128i* rows) {
+  __m128i x2 = _mm_unpacklo_epi8(bytes, bytes);
+  __m128i x4_low = _mm_unpacklo_epi16(x2, x2);
+  __m128i x4_high = _mm_unpackhi_epi16(x2, x2);
+  rows[0] = _mm_unpacklo_epi32(x4_low, x4_low);
+  rows[1] = _mm_unpackhi_epi32(x4_low, x4_low);
+  rows[2] = _mm_unpacklo_epi32(x4_high, x4_high);
+  rows[3] = _mm_unpackhi_epi32(x4_high, x4_high);
+}
+
+static void decode_tile_rows_sse2(const uint8_t* planes, uint8_t* pixels, uint8_t* flipped_pixels, size_t count) {
+  const __m128i bits = _mm_set1_epi64x(TILE_BITS);
+  const __m128i flipped_bits = _mm_set1_epi64x(TILE_BITS_FLIPPED);
+  const __m128i ones = _mm_set1_epi8(1);
+  const __m128i twos = _mm_set1_epi8(2);
+
+  // 8 rows at a time
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m128i planes_x8 = _mm_loadu_si128((const __m128i*)&planes[i * 2]);
+    __m128i low_bytes = _mm_packus_epi16(_mm_and_si128(planes_x8, _mm_set1_epi16(0x00FF)), planes_x8);
+    __m128i high_bytes = _mm_packus_epi16(_mm_srli_epi16(planes_x8, 8), planes_x8);
+    __m128i lows[4];
+    __m128i highs[4];
+    spread_rows_sse2(low_bytes, lows);
+    spread_rows_sse2(high_bytes, highs);
+
+    for(unsigned int j = 0; j < 4; j++) {
+      __m128i index = _mm_or_si128(_mm_and_si128(expand_bits_sse2(lows[j], bits), ones),
+                                   _mm_and_si128(expand_bits_sse2(highs[j], bits), twos));
+      __m128i flipped_index = _mm_or_si128(_mm_and_si128(expand_bits_sse2(lows[j], flipped_bits), ones),
+                                           _mm_and_si128(expand_bits_sse2(highs[j], flipped_bits), twos));
+      _mm_storeu_si128((__m128i*)&pixels[(i + j * 2) * 8], index);
+      _mm_storeu_si128((__m128i*)&flipped_pixels[(i + j * 2) * 8], flipped_index);
+    }
   }
-  return NULL;
+  decode_tile_rows_scalar(&planes[i * 2], &pixels[i * 8], &flipped_pixels[i * 8], count - i);
 }
 
-static uint8_t read_memory8(uint16_t address) {  
-  if ((address >= 0xFEA0) && (address <= 0xFEFF)) {
-    // this memory range is unused, if this comes up it is wrong
-    return 0xFF;
-  } else if ((address >= 0xFF00) && (address <= 0xFF7F)) {
-    return read_io8(address);
-  } else {
-    uint8_t* memory = map_memory(address);
-    return *memory;
+// SSE2 has no byte shuffle, so each shade is selected with a compare
+static inline __m128i compose_sse2(__m128i indices, __m128i old, const __m128i* shades, bool transparent) {
+  __m128i color = _mm_setzero_si128();
+  for(int i = 0; i < 4; i++) {
+    __m128i mask = _mm_cmpeq_epi8(indices, _mm_set1_epi8(i));
+    color = _mm_or_si128(color, _mm_and_si128(mask, shades[i]));
   }
+  if (transparent) {
+    __m128i mask = _mm_cmpeq_epi8(indices, _mm_setzero_si128());
+    color = _mm_or_si128(_mm_and_si128(mask, old), _mm_andnot_si128(mask, color));
+  }
+  return color;
 }
 
-static void write_memory8(uint16_t address, uint8_t v) {
+static void compose_pixels_sse2(uint8_t* image, const uint8_t* indices, size_t count, const uint8_t* shades, bool transparent) {
+  __m128i shade_vectors[4];
+  for(int i = 0; i < 4; i++) {
+    shade_vectors[i] = _mm_set1_epi8(shades[i]);
+  }
 
-  if ((address >= 0x0000) && (address <= 0x1FFF)) { // MBC1: RAM Enable (Write Only)
-    // From Pandocs:
-    // Practically any value with 0Ah in the lower 4 bits enables RAM, and any other value disables RAM.
-    ram_enable = ((v & 0xF) == 0xA);
-  } else if ((address >= 0x2000) && (address <= 0x3FFF)) { // MBC1: ROM Bank Number (Write Only)
-    // From Pandocs:
-    // Writing to this address space selects the lower 5 bits of the ROM Bank Number (in range 01-1Fh).
-    // When 00h is written, the MBC translates that to bank 01h [...].
-    // The same happens for Bank 20h, 40h, and 60h. Any attempt to address these ROM Banks will select Bank 21h, 41h, and 61h instead.
-    if (v == 0x00) { v == 0x01; }
-    if (v == 0x20) { v == 0x21; }
-    if (v == 0x40) { v == 0x41; }
-    if (v == 0x60) { v == 0x61; }
-    assert(v <= 0x1F);
-    rom_bank_number = v;
-  } else if ((address >= 0x4000) && (address <= 0x5FFF)) { // MBC1: RAM Bank Number - or - Upper Bits of ROM Bank Number (Write Only)
-    assert(v <= 0x3); //a bit confused here, possibly come back to this 
-    rom_ram_bank_number = v;
-  } else if ((address >= 0x6000) && (address <= 0x7FFF)) { // MBC1: 6000-7FFF - ROM/RAM Mode Select (Write Only)
-    assert((v == 0x00) || (v == 0x01));
-    rom_ram_mode_select = v;
-  } else if ((address >= 0xFEA0) && (address <= 0xFEFF)) {
-    // unused memory range
-  } else if ((address >= 0xFF00) && (address <= 0xFF7F)) { // IO Ports
-    return write_io8(address, v);
-  } else {
-    uint8_t* memory = map_memory(address);
-    *memory = v;
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16) {
+    __m128i old = _mm_loadu_si128((const __m128i*)&image[i]);
+    __m128i index = _mm_loadu_si128((const __m128i*)&indices[i]);
+    _mm_storeu_si128((__m128i*)&image[i], compose_sse2(index, old, shade_vectors, transparent));
   }
 
+  // A single tile row
+  if (i + 8 <= count) {
+    __m128i old = _mm_loadl_epi64((const __m128i*)&image[i]);
+    __m128i index = _mm_loadl_epi64((const __m128i*)&indices[i]);
+    _mm_storel_epi64((__m128i*)&image[i], compose_sse2(index, old, shade_vectors, transparent));
+    i += 8;
+  }
+  compose_pixels_scalar(&image[i], &indices[i], count - i, shades, transparent);
+}
+
+__attribute__((target("avx2")))
+static void decode_tile_rows_avx2(const uint8_t* planes, uint8_t* pixels, uint8_t* flipped_pixels, size_t count) {
+  const __m256i bits = _mm256_set1_epi64x(TILE_BITS);
+  const __m256i flipped_bits = _mm256_set1_epi64x(TILE_BITS_FLIPPED);
+  const __m256i ones = _mm256_set1_epi8(1);
+  const __m256i twos = _mm256_set1_epi8(2);
+
+  // Gathers the low bytes in the lower half and the high bytes in the upper half
+  const __m128i separate = _mm_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+
+  // Repeats bytes 0-3 / 4-7 eight times each, 4 rows per register
+  const __m256i spread[2] = {
+    _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                     2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3),
+    _mm256_setr_epi8(4, 4, 4, 4, 4, 4, 4, 4, 5, 5, 5, 5, 5, 5, 5, 5,
+                     6, 6, 6, 6, 6, 6, 6, 6, 7, 7, 7, 7, 7, 7, 7, 7)
+  };
+
+  // 8 rows at a time
+  size_t i = 0;
+  for(; i + 8 <= count; i += 8) {
+    __m128i planes_x8 = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)&planes[i * 2]), separate);
+    __m256i low_bytes = _mm256_broadcastq_epi64(planes_x8);
+    __m256i high_bytes = _mm256_broadcastq_epi64(_mm_unpackhi_epi64(planes_x8, planes_x8));
+
+    for(unsigned int j = 0; j < 2; j++) {
+      __m256i lows = _mm256_shuffle_epi8(low_bytes, spread[j]);
+      __m256i highs = _mm256_shuffle_epi8(high_bytes, spread[j]);
+      __m256i index = _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lows, bits), bits), ones),
+                                      _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(highs, bits), bits), twos));
+      __m256i flipped_index = _mm256_or_si256(_mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(lows, flipped_bits), flipped_bits), ones),
+                                              _mm256_and_si256(_mm256_cmpeq_epi8(_mm256_and_si256(highs, flipped_bits), flipped_bits), twos));
+      _mm256_storeu_si256((__m256i*)&pixels[(i + j * 4) * 8], index);
+      _mm256_storeu_si256((__m256i*)&flipped_pixels[(i + j * 4) * 8], flipped_index);
+    }
+  }
+  _mm256_zeroupper();
+  decode_tile_rows_scalar(&planes[i * 2], &pixels[i * 8], &flipped_pixels[i * 8], count - i);
+}
+
+// The palette indices select the shade with a byte shuffle, color 0 is blended away
+__attribute__((target("avx2")))
+static void compose_pixels_avx2(uint8_t* image, const uint8_t* indices, size_t count, const uint8_t* shades, bool transparent) {
+  uint32_t shades_x4 = shades[0] | (shades[1] << 8) | (shades[2] << 16) | ((uint32_t)shades[3] << 24);
+  const __m256i palette = _mm256_broadcastsi128_si256(_mm_cvtsi32_si128(shades_x4));
+
+  size_t i = 0;
+  for(; i + 32 <= count; i += 32) {
+    __m256i index = _mm256_loadu_si256((const __m256i*)&indices[i]);
+    __m256i color = _mm256_shuffle_epi8(palette, index);
+    if (transparent) {
+      __m256i old = _mm256_loadu_si256((const __m256i*)&image[i]);
+      color = _mm256_blendv_epi8(color, old, _mm256_cmpeq_epi8(index, _mm256_setzero_si256()));
+    }
+    _mm256_storeu_si256((__m256i*)&image[i], color);
+  }
 
+  // The rest stays in AVX code: switching to SSE code with the upper halves in use is slow
+  const __m128i palette_x16 = _mm256_castsi256_si128(palette);
+  for(; i + 8 <= count; i += 8) {
+    __m128i index = _mm_loadl_epi64((const __m128i*)&indices[i]);
+    __m128i color = _mm_shuffle_epi8(palette_x16, index);
+    if (transparent) {
+      __m128i old = _mm_loadl_epi64((const __m128i*)&image[i]);
+      color = _mm_blendv_epi8(color, old, _mm_cmpeq_epi8(index, _mm_setzero_si128()));
+    }
+    _mm_storel_epi64((__m128i*)&image[i], color);
+  }
+  for(; i < count; i++) {
+    if (!transparent || (indices[i] != 0)) {
+      image[i] = shades[indices[i]];
+    }
+  }
 }
 
-static void write_memory16(uint16_t address, uint16_t value) {
-  // Little endian: 0x1234 becomes (0x34, 0x12)  remember to re-study up on this
-  write_memory8(address + 0, (value >> 0) & 0xFF);
-  write_memory8(address + 1, (value >> 8) & 0xFF);
-}
+#endif
 
-static uint16_t read_memory16(uint16_t address) {
-  uint16_t value = 0x0000;
-  value |= read_memory8(address + 0) << 0;
-  value |= read_memory8(address + 1) << 8;
-  return value;
+typedef struct {
+  const char* name;
+  DecodeTileRows decode_tile_rows;
+  ComposePixels compose_pixels;
+  bool avx2;
+} PixelKernels;
+
+static const PixelKernels pixel_kernels[] = {
+  { "scalar", decode_tile_rows_scalar, compose_pixels_scalar, false },
+#if SIMD
+  { "sse2", decode_tile_rows_sse2, compose_pixels_sse2, false },
+  { "avx2", decode_tile_rows_avx2, compose_pixels_avx2, true },
+#endif
+};
+
+static DecodeTileRows decode_tile_rows = decode_tile_rows_scalar;
+static ComposePixels compose_pixels = compose_pixels_scalar;
+
+static bool is_pixel_kernel_supported(const PixelKernels* kernels) {
+#if SIMD
+  if (kernels->avx2) {
+    return __builtin_cpu_supports("avx2");
+  }
+#endif
+  return true;
 }
 
+static void select_pixel_kernels() {
+  const PixelKernels* selected = &pixel_kernels[0];
+  for(unsigned int i = 0; i < ARRAY_SIZE(pixel_kernels); i++) {
+    if (is_pixel_kernel_supported(&pixel_kernels[i])) {
+      selected = &pixel_kernels[i];
+    }
+  }
 
+  const char* name = getenv("GB_SIMD");
+  if (name != NULL) {
+    const PixelKernels* requested = NULL;
+    for(unsigned int i = 0; i < ARRAY_SIZE(pixel_kernels); i++) {
+      if (!strcmp(pixel_kernels[i].name, name)) {
+        requested = &pixel_kernels[i];
+      }
+    }
+    if (requested == NULL) {
+      fprintf(stderr, "Unknown pixel kernels '%s'\n", name);
+    } else if (!is_pixel_kernel_supported(requested)) {
+      fprintf(stderr, "Pixel kernels '%s' are not supported by this CPU\n", name);
+    } else {
+      selected = requested;
+      printf("Using %s pixel kernels\n", name);
+    }
+  }
 
-typedef struct {
+  decode_tile_rows = selected->decode_tile_rows;
+  compose_pixels = selected->compose_pixels;
+}
 
-  // 3-0  -     -   -    Not used (always zero)
-  uint8_t zero:4; // mask: 0x1 | 0x02 | 0x04 | 0x08
+// Tile cache
+//
+// The 384 tiles at 8000-97FF are kept decoded to one palette index (0-3) per
+// pixel, also mirrored horizontally for sprites. Each write to the tile data
+// decodes the row it changed, so drawing a line never looks at bitplanes.
 
-  // 4    cy    C   NC   Carry Flag
-  uint8_t cy:1;   // mask: 0x10
+// A single row isn't worth the vector setup
+static void decode_tile_row(VideoMemory* video, unsigned int tile, unsigned int row) {
+  unsigned int offset = tile * 0x10 + row * 2;
+  decode_tile_rows_scalar(&video->vram_memory[offset], video->tile_pixels[0][tile][row], video->tile_pixels[1][tile][row], 1);
+}
 
-  // 5    h     -   -    Half Carry Flag (BCD)
-  uint8_t h:1;    // mask: 0x20
+// For when the VRAM offsets `start` to `end` were replaced as a whole
+static void decode_tiles(VideoMemory* video, unsigned int start, unsigned int end) {
+  unsigned int first_row = start / 2;
+  unsigned int end_row = (end + 1) / 2;
+  if (end_row > TILE_COUNT * 8) {
+    end_row = TILE_COUNT * 8;
+  }
+  if (first_row < end_row) {
+    decode_tile_rows(&video->vram_memory[first_row * 2], &video->tile_pixels[0][0][0][0] + first_row * 8,
+                     &video->tile_pixels[1][0][0][0] + first_row * 8, end_row - first_row);
+  }
+}
 
-  // 6    n     -   -    Add/Sub-Flag (BCD)
-  uint8_t n:1; // 0x40
+// Extends the VRAM offsets which the next snapshot copies, see draw_lcd_line()
+static void mark_vram_dirty(unsigned int start, unsigned int end) {
+  if (gb->vram_dirty_start >= gb->vram_dirty_end) {
+    gb->vram_dirty_start = start;
+    gb->vram_dirty_end = end;
+    return;
+  }
+  if (start < gb->vram_dirty_start) {
+    gb->vram_dirty_start = start;
+  }
+  if (end > gb->vram_dirty_end) {
+    gb->vram_dirty_end = end;
+  }
+}
 
-  // 7    zf    Z   NZ   Zero Flag
-  uint8_t zf:1;   // mask: 0x80
+// Tile data and maps at 8000-9FFF; map writes only get here with the render thread
+static void write_video_memory(uint16_t address, uint8_t v) {
+  assert((address >= 0x8000) && (address <= 0x9FFF));
+  unsigned int offset = address - 0x8000;
+  gb->video.vram_memory[offset] = v;
+  if (offset < TILE_COUNT * 0x10) {
+    decode_tile_row(&gb->video, offset / 0x10, (offset % 0x10) / 2);
+  }
+  mark_vram_dirty(offset, offset + 1);
+}
 
-} Flags;
+// 8 palette indices of the tile at `address` (8000-97FF)
+static const uint8_t* get_tile_row(const VideoMemory* video, uint16_t address, unsigned int row, bool flip_x) {
+  assert((address >= 0x8000) && (address <= 0x97FF) && (row < 8));
+  return video->tile_pixels[flip_x][(address - 0x8000) / 0x10][row];
+}
 
-typedef struct {
-  union { uint16_t af; struct { Flags f; uint8_t a; }; };
-  union { uint16_t bc; struct { uint8_t c; uint8_t b; }; };
-  union { uint16_t de; struct { uint8_t e; uint8_t d; }; };
-  union { uint16_t hl; struct { uint8_t l; uint8_t h; }; };
-  uint16_t sp;
-  uint16_t pc;
-} Registers;
+// Cartridge mappers
+//
+// The memory bank controller is picked from 0147 - Cartridge Type. Its
+// register writes only compute bank numbers; update_cartridge_banks() then
+// points the memory map at them, so reads never go through the mapper.
+// Cartridge RAM which can't be mapped as plain memory (disabled RAM, the
+// 4 bit RAM of MBC2, the MBC3 clock) takes the slow path into the mapper.
 
-static Registers cpu;
+static uint64_t get_current_cycle();
 
+// Called by the mappers after their registers were written
+static void update_cartridge_banks(unsigned int rom_bank_low, unsigned int rom_bank_high, unsigned int ram_bank, bool ram_mapped) {
 
-//                             0         1        2       3        4       5       6      7
-uint16_t* registers16[4] = { &cpu.bc, &cpu.de, &cpu.hl, &cpu.sp };
-uint8_t* registers8[8]   = { &cpu.b,  &cpu.c,  &cpu.d,  &cpu.e,  &cpu.h,  &cpu.l, NULL,  &cpu.a };
+  // Banks past the end of the ROM or RAM wrap around
+  size_t rom_bank_count = gb->cartridge_rom_size / 0x4000;
+  size_t ram_bank_count = (gb->cartridge_ram_size + 0x1FFF) / 0x2000;
+  rom_bank_low %= rom_bank_count;
+  rom_bank_high %= rom_bank_count;
+  ram_bank = (ram_bank_count > 0) ? (ram_bank % ram_bank_count) : 0;
 
-static uint16_t read_x16(uint8_t reg_index) {
-  if (reg_index >= ARRAY_SIZE(registers16))  {
-    assert(false);
-    return 0x0000;
+  // Blocks stay cached per bank, but the running one may be gone
+  if ((rom_bank_low != gb->rom_bank_low) || (rom_bank_high != gb->rom_bank_high)) {
+    gb->decoded_block_epoch++;
   }
-  return *(registers16[reg_index]);
+
+  gb->rom_bank_low = rom_bank_low;
+  gb->rom_bank_high = rom_bank_high;
+  gb->ram_bank = ram_bank;
+  gb->ram_mapped = ram_mapped && (ram_bank_count > 0);
+  map_cartridge_banks();
 }
 
-static void write_x16(uint8_t reg_index, uint16_t value) {
-  if (reg_index >= ARRAY_SIZE(registers16))  {
-    assert(false);
-    return;
-  }
-  *(registers16[reg_index]) = value;
+static bool is_ram_enable(uint8_t v) {
+  // From Pandocs:
+  // Practically any value with 0Ah in the lower 4 bits enables RAM, and any other value disables RAM.
+  return (v & 0xF) == 0xA;
 }
 
-static uint8_t read_x8(uint8_t reg_index) {
+// Cartridges without MBC (32KB ROM, optionally 8KB RAM)
+static void write_rom_only_register(uint16_t address, uint8_t v) {
+}
 
-  // Handle (HL)
-  if (reg_index == 6) {
-    return read_memory8(cpu.hl);
+// MBC1 (max 2MByte ROM and/or 32KByte RAM)
+static void write_mbc1_register(uint16_t address, uint8_t v) {
+  if (address <= 0x1FFF) { // 0000-1FFF - RAM Enable (Write Only)
+    gb->ram_enable = is_ram_enable(v);
+  } else if (address <= 0x3FFF) { // 2000-3FFF - ROM Bank Number (Write Only)
+    // Lower 5 bits; 00h selects 01h, also for banks 20h, 40h and 60h
+    gb->mbc_rom_bank = v & 0x1F;
+  } else if (address <= 0x5FFF) { // 4000-5FFF - RAM Bank Number - or - Upper Bits of ROM Bank Number (Write Only)
+    gb->mbc_ram_bank = v & 0x03;
+  } else { // 6000-7FFF - ROM/RAM Mode Select (Write Only)
+    gb->mbc_mode = v & 0x01;
   }
 
-  if (reg_index >= ARRAY_SIZE(registers8))  {
-    assert(false);
-    return 0x00;
-  }
-  return *(registers8[reg_index]);
+  // The 2 bit register always selects the upper ROM bits for 4000-7FFF. In mode 1 it also
+  // selects the RAM bank and the upper ROM bits for 0000-3FFF. Small ROMs and RAMs ignore
+  // the bits, which the wrap-around takes care of.
+  unsigned int upper = gb->mbc_ram_bank;
+  unsigned int lower = (gb->mbc_rom_bank != 0) ? gb->mbc_rom_bank : 1;
+  update_cartridge_banks(gb->mbc_mode ? (upper << 5) : 0, (upper << 5) | lower, gb->mbc_mode ? upper : 0, gb->ram_enable);
 }
 
-static void write_x8(uint8_t reg_index, uint8_t value) {
+// MBC2 (max 256KByte ROM and 512x4 bits RAM)
+static void write_mbc2_register(uint16_t address, uint8_t v) {
 
-  // Handle (HL)
-  if (reg_index == 6) {
-    write_memory8(cpu.hl, value);
+  // Only 0000-3FFF; bit 8 of the address selects the register
+  if (address > 0x3FFF) {
     return;
   }
-
-  if (reg_index >= ARRAY_SIZE(registers8))  {
-    assert(false);
-    return;
+  if (address & 0x100) { // ROM Bank Number
+    gb->mbc_rom_bank = v & 0x0F;
+  } else { // RAM Enable
+    gb->ram_enable = is_ram_enable(v);
   }
-  *(registers8[reg_index]) = value;
+  update_cartridge_banks(0, (gb->mbc_rom_bank != 0) ? gb->mbc_rom_bank : 1, 0, false);
 }
 
+// A000-A1FF repeats through A000-BFFF, the upper 4 bits read as 1
+static uint8_t read_mbc2_ram(uint16_t address) {
+  if (!gb->ram_enable) {
+    return 0xFF;
+  }
+  return 0xF0 | gb->cartridge_ram_memory[address & 0x1FF];
+}
 
+static void write_mbc2_ram(uint16_t address, uint8_t v) {
+  if (!gb->ram_enable) {
+    return;
+  }
+  gb->cartridge_ram_dirty |= 1 << 0;
+  gb->cartridge_ram_memory[address & 0x1FF] = v & 0x0F;
+}
+
+// MBC3 (max 2MByte ROM and/or 32KByte RAM and Timer)
+//
+// The clock runs on emulated time, so runs are repeatable. Time which passes
+// while the emulator isn't running is added when the savegame is loaded.
+
+#include <time.h>
+
+// Host time in seconds, for measuring durations
+static double get_monotonic_time() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+#define RTC_CYCLES_PER_SECOND 4194304
+
+#define RTC_S  0 // Seconds   0-59 (0-3Bh)
+#define RTC_M  1 // Minutes   0-59 (0-3Bh)
+#define RTC_H  2 // Hours     0-23 (0-17h)
+#define RTC_DL 3 // Lower 8 bits of Day Counter (0-FFh)
+#define RTC_DH 4 // Bit 0 Day Counter MSB, Bit 6 Halt, Bit 7 Day Counter Carry
+
+static void add_rtc_seconds(uint8_t* rtc, uint64_t seconds) {
+  uint64_t days = ((rtc[RTC_DH] & 0x01) << 8) | rtc[RTC_DL];
+  uint64_t time = rtc[RTC_S] + 60 * (rtc[RTC_M] + 60 * (rtc[RTC_H] + 24 * days)) + seconds;
+  rtc[RTC_S] = time % 60;
+  time /= 60;
+  rtc[RTC_M] = time % 60;
+  time /= 60;
+  rtc[RTC_H] = time % 24;
+  days = time / 24;
+
+  // The carry stays set until the game clears it
+  if (days > 0x1FF) {
+    rtc[RTC_DH] |= 0x80;
+    days %= 0x200;
+  }
+  rtc[RTC_DL] = days & 0xFF;
+  rtc[RTC_DH] = (rtc[RTC_DH] & 0xFE) | (days >> 8);
+}
+
+// Advances the clock to the current time
+static void update_rtc() {
+  uint64_t cycle = get_current_cycle();
+  if (gb->rtc[RTC_DH] & 0x40) { // Halted
+    gb->rtc_cycle = cycle;
+    return;
+  }
+  uint64_t seconds = (cycle - gb->rtc_cycle) / RTC_CYCLES_PER_SECOND;
+  if (seconds > 0) {
+    gb->rtc_cycle += seconds * RTC_CYCLES_PER_SECOND;
+    add_rtc_seconds(gb->rtc, seconds);
+  }
+}
+
+// The clock is saved after the RAM in the format other emulators use: the registers and
+// the latched registers as 32 bit values, then the 64 bit UNIX time of the save
+static void store_rtc(uint8_t* data) {
+  update_rtc();
+  for(unsigned int i = 0; i < 5; i++) {
+    for(unsigned int j = 0; j < 4; j++) {
+      data[i * 4 + j] = (j == 0) ? gb->rtc[i] : 0x00;
+      data[20 + i * 4 + j] = (j == 0) ? gb->rtc_latched[i] : 0x00;
+    }
+  }
+  uint64_t timestamp = time(NULL);
+  for(unsigned int j = 0; j < 8; j++) {
+    data[40 + j] = (timestamp >> (j * 8)) & 0xFF;
+  }
+}
+
+// Also accepts the older variant with a 32 bit time
+static void load_rtc(const uint8_t* data, size_t size) {
+  if (size < RTC_SAVE_SIZE - 4) {
+    return;
+  }
+  for(unsigned int i = 0; i < 5; i++) {
+    gb->rtc[i] = data[i * 4];
+    gb->rtc_latched[i] = data[20 + i * 4];
+  }
+  uint64_t timestamp = 0;
+  for(unsigned int j = 0; j < ((size >= RTC_SAVE_SIZE) ? 8 : 4); j++) {
+    timestamp |= (uint64_t)data[40 + j] << (j * 8);
+  }
+
+  // Catch up with the time the emulator wasn't running
+  uint64_t now = time(NULL);
+  if (!(gb->rtc[RTC_DH] & 0x40) && (now > timestamp)) {
+    add_rtc_seconds(gb->rtc, now - timestamp);
+  }
+}
+
+static bool is_rtc_selected() {
+  return gb->rtc_present && (gb->mbc_ram_bank >= 0x08) && (gb->mbc_ram_bank <= 0x0C);
+}
+
+static void write_mbc3_register(uint16_t address, uint8_t v) {
+  if (address <= 0x1FFF) { // 0000-1FFF - RAM and Timer Enable (Write Only)
+    gb->ram_enable = is_ram_enable(v);
+  } else if (address <= 0x3FFF) { // 2000-3FFF - ROM Bank Number (Write Only)
+    gb->mbc_rom_bank = v & 0x7F;
+  } else if (address <= 0x5FFF) { // 4000-5FFF - RAM Bank Number (00-07h) - or - RTC Register Select (08-0Ch) (Write Only)
+    gb->mbc_ram_bank = v;
+  } else { // 6000-7FFF - Latch Clock Data (Write Only)
+    // Writing 00h, then 01h copies the clock into the registers the game reads
+    if (gb->rtc_present && (gb->rtc_latch == 0x00) && (v == 0x01)) {
+      update_rtc();
+      memcpy(gb->rtc_latched, gb->rtc, sizeof(gb->rtc));
+    }
+    gb->rtc_latch = v;
+  }
+
+  bool ram_selected = (gb->mbc_ram_bank <= 0x07);
+  update_cartridge_banks(0, (gb->mbc_rom_bank != 0) ? gb->mbc_rom_bank : 1, gb->mbc_ram_bank & 0x07, gb->ram_enable && ram_selected);
+}
+
+static uint8_t read_mbc3_ram(uint16_t address) {
+  if (!gb->ram_enable || !is_rtc_selected()) {
+    return 0xFF;
+  }
+  return gb->rtc_latched[gb->mbc_ram_bank - 0x08];
+}
+
+static void write_mbc3_ram(uint16_t address, uint8_t v) {
+  if (!gb->ram_enable || !is_rtc_selected()) {
+    return;
+  }
+  unsigned int index = gb->mbc_ram_bank - 0x08;
+  update_rtc();
+  gb->rtc[index] = v;
+  gb->rtc_latched[index] = v;
+
+  // Writing the seconds restarts the current second
+  if (index == RTC_S) {
+    gb->rtc_cycle = get_current_cycle();
+  }
+}
+
+// MBC5 (max 8MByte ROM and/or 128KByte RAM)
+static void write_mbc5_register(uint16_t address, uint8_t v) {
+  if (address <= 0x1FFF) { // 0000-1FFF - RAM Enable (Write Only)
+    gb->ram_enable = is_ram_enable(v);
+  } else if (address <= 0x2FFF) { // 2000-2FFF - Low 8 bits of ROM Bank Number (Write Only)
+    gb->mbc_rom_bank = (gb->mbc_rom_bank & 0x100) | v;
+  } else if (address <= 0x3FFF) { // 3000-3FFF - High bit of ROM Bank Number (Write Only)
+    gb->mbc_rom_bank = (gb->mbc_rom_bank & 0xFF) | ((v & 0x01) << 8);
+  } else if (address <= 0x5FFF) { // 4000-5FFF - RAM Bank Number (Write Only)
+    gb->mbc_ram_bank = v & 0x0F;
+  }
+
+  // Unlike the other MBCs, bank 00h can be mapped to 4000-7FFF.
+  // On rumble cartridges bit 3 of the RAM bank drives the motor instead.
+  bool rumble = (gb->cartridge_rom_memory[0x147] >= 0x1C);
+  unsigned int ram_bank = gb->mbc_ram_bank & (rumble ? 0x07 : 0x0F);
+  update_cartridge_banks(0, gb->mbc_rom_bank, ram_bank, gb->ram_enable);
+}
+
+static const Mapper rom_only_mapper = { "ROM ONLY", write_rom_only_register, NULL, NULL };
+static const Mapper mbc1_mapper = { "MBC1", write_mbc1_register, NULL, NULL };
+static const Mapper mbc2_mapper = { "MBC2", write_mbc2_register, read_mbc2_ram, write_mbc2_ram };
+static const Mapper mbc3_mapper = { "MBC3", write_mbc3_register, read_mbc3_ram, write_mbc3_ram };
+static const Mapper mbc5_mapper = { "MBC5", write_mbc5_register, NULL, NULL };
+
+// 0147 - Cartridge Type, returns NULL for unsupported types
+static const Mapper* get_mapper(uint8_t type) {
+  switch(type) {
+  case 0x00: case 0x08: case 0x09:
+    return &rom_only_mapper;
+  case 0x01: case 0x02: case 0x03:
+    return &mbc1_mapper;
+  case 0x05: case 0x06:
+    return &mbc2_mapper;
+  case 0x0F: case 0x10: case 0x11: case 0x12: case 0x13:
+    return &mbc3_mapper;
+  case 0x19: case 0x1A: case 0x1B: case 0x1C: case 0x1D: case 0x1E:
+    return &mbc5_mapper;
+  default:
+    return NULL;
+  }
+}
+
+
+// Decoded block cache bookkeeping, see get_decoded_block().
+// Work RAM and HRAM can hold code which is modified at runtime, so the bytes
+// which were decoded are marked and writes to them drop the decoded blocks.
+// The epoch changes whenever decoded blocks become stale.
+
+static int get_decoded_code_index(uint16_t address) {
+  if ((address >= 0xC000) && (address <= 0xDFFF)) {
+    return address - 0xC000;
+  } else if ((address >= 0xFF80) && (address <= 0xFFFE)) {
+    return 0x2000 + (address - 0xFF80);
+  }
+  return -1;
+}
+
+static void invalidate_decoded_blocks(uint16_t address);
+
+// FE00-FFFF, cartridge RAM which isn't mapped, or everything during OAM DMA
+static uint8_t read_memory_slow(uint16_t address) {
+
+  // The DMA transfer owns the buses; the CPU only reaches I/O ports and HRAM
+  if (gb->dma_active && (address < 0xFF00)) {
+    return 0xFF;
+  }
+
+  // A000-BFFF   8KB External RAM     (disabled, or special to the mapper)
+  if ((address >= 0xA000) && (address <= 0xBFFF)) {
+    assert(!gb->ram_mapped);
+    if (gb->mapper->read_ram == NULL) {
+      return 0xFF;
+    }
+    return gb->mapper->read_ram(address);
+  }
+  assert(address >= 0xFE00);
+
+  // FE00-FE9F   Sprite Attribute Table (OAM)
+  if (address <= 0xFE9F) {
+    return gb->video.oam_memory[address - 0xFE00];
+
+  // FEA0-FEFF   Not Usable
+  } else if (address <= 0xFEFF) {
+    // this memory range is unused, if this comes up it is wrong
+    return 0xFF;
+
+  // FF00-FF7F   I/O Ports
+  } else if (address <= 0xFF7F) {
+    return read_io8(address);
+
+  // FF80-FFFE   High RAM (HRAM)
+  } else if (address <= 0xFFFE) {
+    return gb->hram_memory[address - 0xFF80];
+
+  // FFFF        Interrupt Enable Register
+  } else {
+    return gb->ie;
+  }
+}
+
+static uint8_t read_memory8(uint16_t address) {
+  uint8_t* page = gb->read_pages[address >> 8];
+  if (page != NULL) {
+    return page[address & 0xFF];
+  }
+  return read_memory_slow(address);
+}
+
+// Writes to RAM which was decoded as code
+static void write_code_memory(uint16_t address, uint8_t* memory, uint8_t v) {
+  *memory = v;
+
+  // Echo RAM is the same memory as C000-DDFF
+  if ((address >= 0xE000) && (address <= 0xFDFF)) {
+    address -= 0x2000;
+  }
+
+  // Check if this was decoded as code
+  int code_index = get_decoded_code_index(address);
+  if ((code_index >= 0) && (gb->decoded_code_bitmap[code_index / 8] & (1 << (code_index % 8)))) {
+    invalidate_decoded_blocks(address);
+  }
+}
+
+// 0000-7FFF (mapper registers), 8000-97FF (tile data; 9800-9FFF with the render thread), cartridge RAM which isn't
+// mapped or not dirty yet, FE00-FFFF and RAM pages holding decoded code, or everything during OAM DMA
+static void write_memory_slow(uint16_t address, uint8_t v) {
+
+  if (gb->dma_active && (address < 0xFF00)) {
+    // The DMA transfer owns the buses; the CPU only reaches I/O ports and HRAM
+  } else if (address <= 0x7FFF) { // Mapper registers
+    gb->mapper->write_register(address, v);
+  } else if (address <= 0x9FFF) { // VRAM
+    write_video_memory(address, v);
+  } else if ((address >= 0xA000) && (address <= 0xBFFF)) {
+    if (gb->ram_mapped) { // First write to a clean bank, see update_save()
+      gb->cartridge_ram_dirty |= 1 << gb->ram_bank;
+      map_cartridge_banks();
+      gb->cartridge_ram_memory[gb->ram_bank * 0x2000 + (address - 0xA000)] = v;
+    } else if (gb->mapper->write_ram != NULL) {
+      gb->mapper->write_ram(address, v);
+    }
+  } else if (address <= 0xFDFF) { // RAM, see protect_code_page()
+    uint8_t* page = gb->read_pages[address >> 8];
+    assert(page != NULL);
+    write_code_memory(address, &page[address & 0xFF], v);
+  } else if (address <= 0xFE9F) { // OAM
+    gb->video.oam_memory[address - 0xFE00] = v;
+    gb->video.oam_index_valid = false;
+    gb->oam_dirty = true;
+  } else if (address <= 0xFEFF) {
+    // unused memory range
+  } else if (address <= 0xFF7F) { // IO Ports
+    write_io8(address, v);
+  } else if (address <= 0xFFFE) { // HRAM
+    write_code_memory(address, &gb->hram_memory[address - 0xFF80], v);
+  } else {
+    gb->ie = v;
+  }
+}
+
+static void write_memory8(uint16_t address, uint8_t v) {
+  gb->idle_memory_written = true;
+
+  uint8_t* page = gb->write_pages[address >> 8];
+  if (page != NULL) {
+    page[address & 0xFF] = v;
+    return;
+  }
+  write_memory_slow(address, v);
+}
+
+static void protect_code_page(uint16_t address, bool protect);
+static bool has_decoded_code(uint16_t page_address);
+static void schedule_event(EventType type, uint64_t cycle);
+
+// OAM DMA
+//
+// From pan docs:
+// It takes 160 microseconds until the transfer has completed (80 microseconds in CGB Double Speed Mode),
+// during this time the CPU can access only HRAM (memory at FF80-FFFE).
+// For this reason, the programmer must copy a short procedure into HRAM, and use this procedure to start
+// the transfer from inside HRAM, and wait until the transfer has finished.
+//
+// The bytes are copied at once when the transfer starts. For the rest of the transfer, all pages take
+// the slow path, which blocks anything but I/O ports and HRAM, until EVENT_DMA_END.
+
+#define DMA_CYCLES (160 * 4) // One byte per machine cycle
+
+static void end_dma() {
+  gb->dma_active = false;
+  gb->decoded_block_epoch++;
+
+  // Restore the memory map, including the protection of decoded code
+  initialize_memory_map();
+  for(unsigned int address = 0xC000; address <= 0xDFFF; address += 0x100) {
+    if (has_decoded_code(address)) {
+      protect_code_page(address, true);
+    }
+  }
+}
+
+static void start_dma(uint8_t source_page) {
+
+  // A new transfer replaces a running one
+  if (gb->dma_active) {
+    end_dma();
+  }
+
+  // Source:      XX00-XX9F   ;XX in range from 00-F1h
+  // Destination: FE00-FE9F
+  const uint8_t* source = gb->read_pages[source_page];
+  if (source != NULL) {
+    memcpy(gb->video.oam_memory, source, sizeof(gb->video.oam_memory));
+  } else {
+    for(unsigned int i = 0; i < sizeof(gb->video.oam_memory); i++) {
+      gb->video.oam_memory[i] = read_memory_slow(source_page * 0x100 + i);
+    }
+  }
+  gb->video.oam_index_valid = false;
+  gb->oam_dirty = true;
+
+  // Code outside HRAM can't be fetched while the transfer runs
+  gb->dma_active = true;
+  gb->dma_end_cycle = get_current_cycle() + DMA_CYCLES;
+  memset(gb->read_pages, 0x00, sizeof(gb->read_pages));
+  memset(gb->write_pages, 0x00, sizeof(gb->write_pages));
+  gb->decoded_block_epoch++;
+  schedule_event(EVENT_DMA_END, gb->dma_end_cycle);
+}
+
+static void write_memory16(uint16_t address, uint16_t value) {
+  // Little endian: 0x1234 becomes (0x34, 0x12)  remember to re-study up on this
+  write_memory8(address + 0, (value >> 0) & 0xFF);
+  write_memory8(address + 1, (value >> 8) & 0xFF);
+}
+
+static uint16_t read_memory16(uint16_t address) {
+  uint16_t value = 0x0000;
+  value |= read_memory8(address + 0) << 0;
+  value |= read_memory8(address + 1) << 8;
+  return value;
+}
+
+
+
+
+// Lazy flag evaluation
+//
+// ALU operations only record what they did; the flags are computed when
+// something reads them. cpu.f is only valid after materialize_flags().
+
+
+static bool get_carry_flag() {
+  switch(gb->lazy_flags.operation) {
+  case FLAGS_MATERIALIZED:
+    return gb->cpu.f.cy;
+  case FLAGS_ADD:
+    return (gb->lazy_flags.result > 0xFF);
+  case FLAGS_SUB:
+    return (gb->lazy_flags.result < 0x00);
+  case FLAGS_ADD16:
+    return (gb->lazy_flags.result > 0xFFFF);
+  case FLAGS_AND:
+  case FLAGS_LOGIC:
+    return false;
+  default:
+    return gb->lazy_flags.carry;
+  }
+}
+
+static bool get_zero_flag() {
+  switch(gb->lazy_flags.operation) {
+  case FLAGS_MATERIALIZED:
+    return gb->cpu.f.zf;
+  case FLAGS_SHIFT_A:
+    return false;
+  case FLAGS_ADD16:
+    return gb->lazy_flags.zero;
+  case FLAGS_BIT:
+    return gb->lazy_flags.result;
+  default:
+    return ((uint8_t)gb->lazy_flags.result == 0x00);
+  }
+}
+
+static void materialize_flags() {
+  if (gb->lazy_flags.operation == FLAGS_MATERIALIZED) {
+    return;
+  }
+
+  bool n = false;
+  bool h = false;
+  switch(gb->lazy_flags.operation) {
+  case FLAGS_ADD:
+  case FLAGS_ADD_KEEP_CY:
+    h = ((gb->lazy_flags.a & 0xF) + (gb->lazy_flags.b & 0xF)) > 0xF;
+    break;
+  case FLAGS_SUB:
+  case FLAGS_SUB_KEEP_CY:
+    n = true;
+    h = ((gb->lazy_flags.a & 0xF) - (gb->lazy_flags.b & 0xF)) < 0x0;
+    break;
+  case FLAGS_AND:
+  case FLAGS_BIT:
+    h = true;
+    break;
+  default:
+    break;
+  }
+
+  gb->cpu.f.zf = get_zero_flag();
+  gb->cpu.f.n = n;
+  gb->cpu.f.h = h;
+  gb->cpu.f.cy = get_carry_flag();
+  gb->lazy_flags.operation = FLAGS_MATERIALIZED;
+}
+
+static void record_flags(FlagsOperation operation, int a, int b, int result) {
+  gb->lazy_flags.operation = operation;
+  gb->lazy_flags.a = a;
+  gb->lazy_flags.b = b;
+  gb->lazy_flags.result = result;
+}
+
+static void record_shift_flags(uint8_t result, bool carry) {
+  gb->lazy_flags.operation = FLAGS_SHIFT;
+  gb->lazy_flags.result = result;
+  gb->lazy_flags.carry = carry;
+}
+
+
+// Operand accessors used by the generated instruction handlers.
+// The enumerations match the operand encoding in the opcode bits, so they can
+// be used to compute the table index of each generated handler.
+enum { X8_b, X8_c, X8_d, X8_e, X8_h, X8_l, X8_hl, X8_a };
+enum { X16_bc, X16_de, X16_hl, X16_sp };
+enum { CC_nz, CC_z, CC_nc, CC_c };
+
+#define READ_X8_b() gb->cpu.b
+#define READ_X8_c() gb->cpu.c
+#define READ_X8_d() gb->cpu.d
+#define READ_X8_e() gb->cpu.e
+#define READ_X8_h() gb->cpu.h
+#define READ_X8_l() gb->cpu.l
+#define READ_X8_hl() read_memory8(gb->cpu.hl)
+#define READ_X8_a() gb->cpu.a
+
+#define WRITE_X8_b(value) gb->cpu.b = (value)
+#define WRITE_X8_c(value) gb->cpu.c = (value)
+#define WRITE_X8_d(value) gb->cpu.d = (value)
+#define WRITE_X8_e(value) gb->cpu.e = (value)
+#define WRITE_X8_h(value) gb->cpu.h = (value)
+#define WRITE_X8_l(value) gb->cpu.l = (value)
+#define WRITE_X8_hl(value) write_memory8(gb->cpu.hl, (value))
+#define WRITE_X8_a(value) gb->cpu.a = (value)
+
+#define X16_REGISTER_bc gb->cpu.bc
+#define X16_REGISTER_de gb->cpu.de
+#define X16_REGISTER_hl gb->cpu.hl
+#define X16_REGISTER_sp gb->cpu.sp
+
+// Expand a generator once per operand
+#define FOR_EACH_X8(GENERATE) \
+  GENERATE(b) GENERATE(c) GENERATE(d) GENERATE(e) \
+  GENERATE(h) GENERATE(l) GENERATE(hl) GENERATE(a)
+#define FOR_EACH_X8_WITH(GENERATE, arg) \
+  GENERATE(arg, b) GENERATE(arg, c) GENERATE(arg, d) GENERATE(arg, e) \
+  GENERATE(arg, h) GENERATE(arg, l) GENERATE(arg, hl) GENERATE(arg, a)
+#define FOR_EACH_X8_WITH2(GENERATE, arg1, arg2) \
+  GENERATE(arg1, arg2, b) GENERATE(arg1, arg2, c) GENERATE(arg1, arg2, d) GENERATE(arg1, arg2, e) \
+  GENERATE(arg1, arg2, h) GENERATE(arg1, arg2, l) GENERATE(arg1, arg2, hl) GENERATE(arg1, arg2, a)
+#define FOR_EACH_X16(GENERATE) \
+  GENERATE(bc) GENERATE(de) GENERATE(hl) GENERATE(sp)
+#define FOR_EACH_X16_WITH(GENERATE, arg) \
+  GENERATE(arg, bc) GENERATE(arg, de) GENERATE(arg, hl) GENERATE(arg, sp)
+#define FOR_EACH_CC(GENERATE) \
+  GENERATE(nz) GENERATE(z) GENERATE(nc) GENERATE(c)
+#define FOR_EACH_CC_WITH(GENERATE, arg) \
+  GENERATE(arg, nz) GENERATE(arg, z) GENERATE(arg, nc) GENERATE(arg, c)
+#define FOR_EACH_BIT(GENERATE) \
+  FOR_EACH_X8_WITH(GENERATE, 0) FOR_EACH_X8_WITH(GENERATE, 1) \
+  FOR_EACH_X8_WITH(GENERATE, 2) FOR_EACH_X8_WITH(GENERATE, 3) \
+  FOR_EACH_X8_WITH(GENERATE, 4) FOR_EACH_X8_WITH(GENERATE, 5) \
+  FOR_EACH_X8_WITH(GENERATE, 6) FOR_EACH_X8_WITH(GENERATE, 7)
 
 
 static void initialize_cpu() {
 
   // Initialize CPU registers
-  cpu.af = 0x01B0;
-  cpu.bc = 0x0013;
-  cpu.de = 0x00D8;
-  cpu.hl = 0x014D;
-  cpu.sp = 0xFFFE;
-  cpu.pc = 0x0100;
+  gb->lazy_flags.operation = FLAGS_MATERIALIZED;
+  gb->halted = false;
+  gb->cpu.af = 0x01B0;
+  gb->cpu.bc = 0x0013;
+  gb->cpu.de = 0x00D8;
+  gb->cpu.hl = 0x014D;
+  gb->cpu.sp = 0xFFFE;
+  gb->cpu.pc = 0x0100;
 
 #if 1
   // CPU instruction test somehow ends up differently 
-  cpu.af = 0x1180;
-  cpu.bc = 0x0000;
-  cpu.de = 0x0008;
-  cpu.hl = 0x007C;
-  cpu.sp = 0xFFFE;
-  cpu.pc = 0x0100;
+  gb->cpu.af = 0x1180;
+  gb->cpu.bc = 0x0000;
+  gb->cpu.de = 0x0008;
+  gb->cpu.hl = 0x007C;
+  gb->cpu.sp = 0xFFFE;
+  gb->cpu.pc = 0x0100;
 #endif
 
   // Init IO Ports
@@ -466,43 +1544,192 @@ static void initialize_cpu() {
   write_io8(OBP1, 0xFF);
   write_io8(WY, 0x00);
   write_io8(WX, 0x00);
-  ie = 0x00;
+  gb->ie = 0x00;
 
-  ime = false;
+  gb->ime = false;
 }
 
 static void disassemble();
 
-//FIXME: Specific to MBC1
-static void initialize_cartridge(const char* rom_file_path) {
-    
-  ram_enable = false;
-  rom_bank_number = 0x00;
-  rom_ram_bank_number = 0x00;
-  rom_ram_mode_select = false;
-  
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+// Maps the ROM read-only, so instances running the same ROM share the page
+// cache. Falls back to reading it into memory if it can't be mapped.
+static bool load_rom(const char* rom_file_path) {
+  int fd = open(rom_file_path, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "Could not open ROM '%s': %s\n", rom_file_path, strerror(errno));
+    return false;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) != 0) || !S_ISREG(st.st_mode)) {
+    fprintf(stderr, "ROM '%s' is not a file\n", rom_file_path);
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  if (size < 0x8000) {
+    fprintf(stderr, "ROM '%s' is too small (%zu bytes)\n", rom_file_path, size);
+    close(fd);
+    return false;
+  }
+
+  void* memory = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  bool mapped = (memory != MAP_FAILED);
+  if (!mapped) {
+    memory = malloc(size);
+    size_t offset = 0;
+    while((memory != NULL) && (offset < size)) {
+      ssize_t result = read(fd, (uint8_t*)memory + offset, size - offset);
+      if (result <= 0) {
+        fprintf(stderr, "Could not read ROM '%s'\n", rom_file_path);
+        free(memory);
+        memory = NULL;
+        break;
+      }
+      offset += result;
+    }
+  }
+  close(fd);
+  if (memory == NULL) {
+    return false;
+  }
+
+  gb->cartridge_rom_size = size;
+  gb->cartridge_rom_memory = memory;
+  gb->cartridge_rom_mapped = mapped;
+  return true;
+}
+
+static void unload_rom() {
+  if (gb->cartridge_rom_mapped) {
+    munmap(gb->cartridge_rom_memory, gb->cartridge_rom_size);
+  } else {
+    free(gb->cartridge_rom_memory);
+  }
+  gb->cartridge_rom_memory = NULL;
+  gb->cartridge_rom_size = 0;
+}
+
+// 0148 - ROM Size, returns 0 for unknown values
+static size_t get_header_rom_size(uint8_t v) {
+  if (v <= 0x08) {
+    return (size_t)0x8000 << v;
+  }
+  switch(v) {
+  case 0x52: return 72 * 0x4000;
+  case 0x53: return 80 * 0x4000;
+  case 0x54: return 96 * 0x4000;
+  default: return 0;
+  }
+}
+
+// 0149 - RAM Size, MBC2 always has 512x4 bits
+static size_t get_header_ram_size() {
+  if (gb->mapper == &mbc2_mapper) {
+    return 512;
+  }
+
+  size_t size;
+  switch(gb->cartridge_rom_memory[0x149]) {
+  case 0x01: size = 2 * 1024; break;
+  case 0x02: size = 8 * 1024; break;
+  case 0x03: size = 32 * 1024; break;
+  case 0x04: size = 128 * 1024; break;
+  case 0x05: size = 64 * 1024; break;
+  default: size = 0; break;
+  }
+  if (size > sizeof(gb->cartridge_ram_memory)) {
+    printf("Only %zu of %zu bytes of RAM are emulated\n", sizeof(gb->cartridge_ram_memory), size);
+    size = sizeof(gb->cartridge_ram_memory);
+  }
+  return size;
+}
+
+// 0147 - Cartridge Type
+static bool has_battery() {
+  switch(gb->cartridge_rom_memory[0x147]) {
+  case 0x03: case 0x06: case 0x09: case 0x0D: case 0x0F: case 0x10:
+  case 0x13: case 0x1B: case 0x1E: case 0x22: case 0xFF:
+    return true;
+  default:
+    return false;
+  }
+}
+
+static bool initialize_cartridge(const char* rom_file_path, bool persistent) {
+
   // Load ROM
   {
-    FILE* f = fopen(rom_file_path, "rb");
-    fseek(f, 0, SEEK_END);
-    cartridge_rom_size = ftell(f);
-    fseek(f, 0, SEEK_SET);
-    cartridge_rom_memory = malloc(cartridge_rom_size);
-    fread(cartridge_rom_memory, 1, cartridge_rom_size, f);
-    fclose(f);
-    
-    
+    if (!load_rom(rom_file_path)) {
+      return false;
+    }
+
+    // Check the size against the header
+    uint8_t header_size_code = gb->cartridge_rom_memory[0x148];
+    size_t header_size = get_header_rom_size(header_size_code);
+    if (header_size == 0) {
+      fprintf(stderr, "Unknown ROM size 0x%02X in header\n", header_size_code);
+      unload_rom();
+      return false;
+    }
+    if (gb->cartridge_rom_size < header_size) {
+      fprintf(stderr, "ROM is truncated: %zu bytes, but header says %zu bytes\n", gb->cartridge_rom_size, header_size);
+      unload_rom();
+      return false;
+    }
+    if (gb->cartridge_rom_size > header_size) {
+      printf("ROM has %zu bytes, but header says %zu bytes\n", gb->cartridge_rom_size, header_size);
+    }
+  }
+
+  // Pick the mapper
+  uint8_t type = gb->cartridge_rom_memory[0x147];
+  gb->mapper = get_mapper(type);
+  if (gb->mapper == NULL) {
+    printf("Unsupported cartridge type 0x%02X, trying MBC1\n", type);
+    gb->mapper = &mbc1_mapper;
+  }
+  gb->cartridge_ram_size = get_header_ram_size();
+  gb->rtc_present = (type == 0x0F) || (type == 0x10);
+  printf("Cartridge: %s, %zu KB ROM, %zu bytes RAM%s\n", gb->mapper->name, gb->cartridge_rom_size / 1024,
+         gb->cartridge_ram_size, gb->rtc_present ? ", clock" : "");
+
+  // Power-on state; RAM without MBC is always accessible
+  gb->ram_enable = false;
+  gb->mbc_rom_bank = 0x01;
+  gb->mbc_ram_bank = 0x00;
+  gb->mbc_mode = false;
+  gb->rom_bank_low = 0;
+  gb->rom_bank_high = 1;
+  gb->ram_bank = 0;
+  gb->ram_mapped = (gb->mapper == &rom_only_mapper) && (gb->cartridge_ram_size > 0);
+
+  // Point the memory map at the new ROM
+  initialize_memory_map();
+
 #if DISASSEMBLE
-    // Run a disassembler
-    disassemble(); 
-    exit(0);   
+  // Run a disassembler
+  disassemble(); 
+  exit(0);   
 #endif
-    
-  }
 
   // Clear all memory
-  memset(cartridge_ram_memory, 0x00, sizeof(cartridge_ram_memory)); //FIXME: Move into cartridge init
-  
+  memset(gb->cartridge_ram_memory, 0x00, sizeof(gb->cartridge_ram_memory)); //FIXME: Move into cartridge init
+
+  // Only battery-backed RAM and clocks are saved
+  if (persistent && has_battery() && ((gb->cartridge_ram_size > 0) || gb->rtc_present)) {
+    gb->save_size = gb->cartridge_ram_size + (gb->rtc_present ? RTC_SAVE_SIZE : 0);
+  }
+  if (gb->save_size == 0) {
+    printf(persistent ? "No battery-backed RAM\n" : "Savegame disabled\n");
+    return true;
+  }
+
   // Find savegame (RAM file)
   //
   // zelda.hacks.gb => zelda.hacks.sav
@@ -519,70 +1746,268 @@ static void initialize_cartridge(const char* rom_file_path) {
   strcat(ram_file_path, ram_extension);
   printf("Expecting RAM at '%s'\n", ram_file_path);
   
-  // Load RAM
+  // Load RAM, followed by the clock
   {
     FILE* f = fopen(ram_file_path, "rb");
     if (f != NULL) {
-      int load_size = fread(cartridge_ram_memory, 1, sizeof(cartridge_ram_memory), f);
+      size_t load_size = fread(gb->save_image, 1, gb->save_size, f);
       fclose(f);
-      printf("Savegame loaded (%d bytes)\n", load_size);
+      memcpy(gb->cartridge_ram_memory, gb->save_image, gb->cartridge_ram_size);
+      if (gb->rtc_present && (load_size > gb->cartridge_ram_size)) {
+        load_rtc(&gb->save_image[gb->cartridge_ram_size], load_size - gb->cartridge_ram_size);
+      }
+      printf("Savegame loaded (%zu bytes)\n", load_size);
     }
   }
-  free(ram_file_path);
+  gb->save_path = ram_file_path;
+  pthread_mutex_init(&gb->save_lock, NULL);
+  pthread_cond_init(&gb->save_wake, NULL);
+
+  // Start watching for writes
+  map_cartridge_banks();
+
+  return true;
 }
 
-bool gameboy_init(const char* rom_file_path) {
+// Savegames
+//
+// Writes to cartridge RAM mark their bank dirty; see map_cartridge_banks().
+// Every SAVE_INTERVAL_FRAMES the dirty banks are copied to save_image and
+// handed to a writer thread, which replaces the file atomically. The frame
+// loop never waits for the writer; if it is busy, the hand-off is retried
+// on the next frame.
+
+#define SAVE_INTERVAL_FRAMES 60
+
+static void write_save_file(const char* path, const uint8_t* data, size_t size) {
+  char* temporary_path = malloc(strlen(path) + strlen(".tmp") + 1);
+  strcpy(temporary_path, path);
+  strcat(temporary_path, ".tmp");
+
+  FILE* f = fopen(temporary_path, "wb");
+  bool success = (f != NULL);
+  if (success) {
+    success &= (fwrite(data, 1, size, f) == size);
+    success &= (fflush(f) == 0);
+    success &= (fsync(fileno(f)) == 0);
+    success &= (fclose(f) == 0);
+  }
+  if (success) {
+    success = (rename(temporary_path, path) == 0);
+  }
+  if (!success) {
+    fprintf(stderr, "Could not write savegame '%s': %s\n", path, strerror(errno));
+  }
+
+  free(temporary_path);
+}
+
+static void* save_writer_main(void* argument) {
+  GameboyContext* context = argument;
+  uint8_t image[sizeof(context->save_image)];
+
+  pthread_mutex_lock(&context->save_lock);
+  while(true) {
+    while(!context->save_pending && !context->save_stop) {
+      pthread_cond_wait(&context->save_wake, &context->save_lock);
+    }
+    if (!context->save_pending) {
+      break;
+    }
+    memcpy(image, context->save_image, context->save_size);
+    context->save_pending = false;
+
+    // Write without holding the lock, so the next hand-off doesn't wait
+    pthread_mutex_unlock(&context->save_lock);
+    write_save_file(context->save_path, image, context->save_size);
+    pthread_mutex_lock(&context->save_lock);
+  }
+  pthread_mutex_unlock(&context->save_lock);
+
+  return NULL;
+}
+
+// Called once per frame
+static void update_save() {
+  if ((gb->save_size == 0) || (gb->cartridge_ram_dirty == 0) || (++gb->save_frames < SAVE_INTERVAL_FRAMES)) {
+    return;
+  }
+  if (pthread_mutex_trylock(&gb->save_lock) != 0) {
+    return;
+  }
+
+  for(unsigned int bank = 0; bank * 0x2000 < gb->cartridge_ram_size; bank++) {
+    if (gb->cartridge_ram_dirty & (1 << bank)) {
+      size_t offset = bank * 0x2000;
+      size_t size = (gb->cartridge_ram_size - offset < 0x2000) ? (gb->cartridge_ram_size - offset) : 0x2000;
+      memcpy(&gb->save_image[offset], &gb->cartridge_ram_memory[offset], size);
+    }
+  }
+  if (gb->rtc_present) {
+    store_rtc(&gb->save_image[gb->cartridge_ram_size]);
+  }
+  gb->save_pending = true;
+  pthread_cond_signal(&gb->save_wake);
+  pthread_mutex_unlock(&gb->save_lock);
+
+  if (!gb->save_thread_started) {
+    int error = pthread_create(&gb->save_thread, NULL, save_writer_main, gb);
+    assert(error == 0);
+    gb->save_thread_started = true;
+  }
+
+  // Watch for the next writes
+  gb->cartridge_ram_dirty = 0;
+  gb->save_frames = 0;
+  if (!gb->dma_active) {
+    map_cartridge_banks();
+  }
+}
+
+// Stops the writer and writes what is still dirty
+static void finish_save() {
+  if (gb->save_size == 0) {
+    return;
+  }
+
+  if (gb->save_thread_started) {
+    pthread_mutex_lock(&gb->save_lock);
+    gb->save_stop = true;
+    pthread_cond_signal(&gb->save_wake);
+    pthread_mutex_unlock(&gb->save_lock);
+    pthread_join(gb->save_thread, NULL);
+    gb->save_thread_started = false;
+  }
+
+  // The clock is always written, it moves on without RAM writes
+  if ((gb->cartridge_ram_dirty != 0) || gb->rtc_present) {
+    memcpy(gb->save_image, gb->cartridge_ram_memory, gb->cartridge_ram_size);
+    if (gb->rtc_present) {
+      store_rtc(&gb->save_image[gb->cartridge_ram_size]);
+    }
+    write_save_file(gb->save_path, gb->save_image, gb->save_size);
+    printf("Savegame written (%zu bytes)\n", gb->save_size);
+  }
+
+  pthread_mutex_destroy(&gb->save_lock);
+  pthread_cond_destroy(&gb->save_wake);
+  free(gb->save_path);
+  gb->save_path = NULL;
+  gb->save_size = 0;
+}
+
+static void select_cpu_engine();
+static void select_render_policy();
+static void select_render_thread();
+static void start_render_thread();
+static bool render_thread_enabled;
+static GameboyRenderPolicy default_render_policy;
+static unsigned int default_render_interval;
+static void flush_decoded_blocks();
+static void initialize_scheduler();
+#if DEBUG
+static void start_trace_from_environment();
+#endif
+
+GameboyContext* gameboy_context_init(const char* rom_file_path, unsigned int flags) {
   printf("Loading '%s'\n", rom_file_path);
 
-  // Clear gameboy_framebuffer to dark gray
-  memset(gameboy_framebuffer, 0x33, sizeof(gameboy_framebuffer));
+  // Pick interpreter (GB_CPU_ENGINE=table|threaded|cached, GB_JIT=off|on|diff)
+  static pthread_once_t engine_selected = PTHREAD_ONCE_INIT;
+  pthread_once(&engine_selected, select_cpu_engine);
+
+  // Pick tile decoding and drawing kernels (GB_SIMD=scalar|sse2|avx2)
+  static pthread_once_t kernels_selected = PTHREAD_ONCE_INIT;
+  pthread_once(&kernels_selected, select_pixel_kernels);
+
+  // Pick frames to draw (GB_RENDER=all|every:<n>|request|none|adaptive)
+  // and where to draw them (GB_RENDER_THREAD=off|on)
+  static pthread_once_t render_policy_selected = PTHREAD_ONCE_INIT;
+  pthread_once(&render_policy_selected, select_render_policy);
+  static pthread_once_t render_thread_selected = PTHREAD_ONCE_INIT;
+  pthread_once(&render_thread_selected, select_render_thread);
+
+  GameboyContext* context = calloc(1, sizeof(GameboyContext));
+  if (context == NULL) {
+    fprintf(stderr, "Could not allocate context\n");
+    return NULL;
+  }
+  gb = context;
+
+  // Clear framebuffer to dark gray
+  memset(gb->framebuffer, 0x33, sizeof(gb->framebuffer));
+  gameboy_context_render_policy(gb, default_render_policy, default_render_interval);
 
   // Initialize memory to safe values
-  memset(vram_memory, 0x00, sizeof(vram_memory));
-  memset(wram0_memory, 0x00, sizeof(wram0_memory));
-  memset(wram1_memory, 0x00, sizeof(wram1_memory));
-  memset(echo_memory, 0x00, sizeof(echo_memory));
-  memset(oam_memory, 0x00, sizeof(oam_memory));
-  memset(hram_memory, 0x00, sizeof(hram_memory));
+  memset(gb->video.vram_memory, 0x00, sizeof(gb->video.vram_memory));
+  memset(gb->wram0_memory, 0x00, sizeof(gb->wram0_memory));
+  memset(gb->wram1_memory, 0x00, sizeof(gb->wram1_memory));
+  memset(gb->video.oam_memory, 0x00, sizeof(gb->video.oam_memory));
+  memset(gb->hram_memory, 0x00, sizeof(gb->hram_memory));
 
   // Initialize CPU
   initialize_cpu();
 
+  // Start with the first LCD line
+  initialize_scheduler();
+
   // Initialize cartridge
-  initialize_cartridge(rom_file_path);
+  if (!initialize_cartridge(rom_file_path, !(flags & GAMEBOY_CONTEXT_NO_SAVE))) {
+    free(context);
+    gb = NULL;
+    return NULL;
+  }
+
+  // Forget code decoded from a previous cartridge
+  flush_decoded_blocks();
+
+  if (render_thread_enabled) {
+    start_render_thread();
+  }
+
+  return context;
+}
+
+bool gameboy_init(const char* rom_file_path) {
+  gameboy = gameboy_context_init(rom_file_path, 0);
+  if (gameboy == NULL) {
+    return false;
+  }
+
+#if DEBUG
+  // Start binary trace (GB_TRACE=<path>)
+  start_trace_from_environment();
+#endif
 
   // Return success
   return true;
 }
 
 static void push16(uint16_t value) {
-  cpu.sp -= 2;
-  write_memory16(cpu.sp, value);
+  gb->cpu.sp -= 2;
+  write_memory16(gb->cpu.sp, value);
 }
 
 static uint16_t pop16() {
-  uint16_t value = read_memory16(cpu.sp);
-  cpu.sp += 2;
+  uint16_t value = read_memory16(gb->cpu.sp);
+  gb->cpu.sp += 2;
   return value;
 }
 
 static void call(uint16_t address) {
-  push16(cpu.pc);
-  cpu.pc = address;
+  push16(gb->cpu.pc);
+  gb->cpu.pc = address;
 }
 
 static uint8_t rr(uint8_t value) {
   bool carry = (value >> 0) & 1;
   value = value >> 1;
-  if (cpu.f.cy) {
+  if (get_carry_flag()) {
     value |= 0x80;
   }
 
   // Update CPU flags
-  cpu.f.zf = (value == 0x00);
-  cpu.f.n = 0;
-  cpu.f.h = 0;
-  cpu.f.cy = carry;
+  record_shift_flags(value, carry);
 
   return value;
 }
@@ -590,15 +2015,12 @@ static uint8_t rr(uint8_t value) {
 static uint8_t rl(uint8_t value) {
   bool carry = (value >> 7) & 1;
   value = value << 1;
-  if (cpu.f.cy) {
+  if (get_carry_flag()) {
     value |= 0x01;
   }
 
   // Update CPU flags
-  cpu.f.zf = (value == 0x00);
-  cpu.f.n = 0;
-  cpu.f.h = 0;
-  cpu.f.cy = carry;
+  record_shift_flags(value, carry);
 
   return value;
 }
@@ -611,10 +2033,7 @@ static uint8_t rrc(uint8_t value) {
   }
 
   // Update CPU flags
-  cpu.f.zf = (value == 0x00);
-  cpu.f.n = 0;
-  cpu.f.h = 0;
-  cpu.f.cy = carry;
+  record_shift_flags(value, carry);
 
   return value;
 }
@@ -627,22 +2046,57 @@ static uint8_t rlc(uint8_t value) {
   }
 
   // Update CPU flags
-  cpu.f.zf = (value == 0x00);
-  cpu.f.n = 0;
-  cpu.f.h = 0;
-  cpu.f.cy = carry;
+  record_shift_flags(value, carry);
 
   return value;
 }
 
-uint8_t and8(int a, int b) {
-  uint8_t result = a & b;
+static uint8_t sla(uint8_t value) {
+  bool carry = (value >> 7) & 1;
+  value = value << 1;
 
   // Update CPU flags
-  cpu.f.zf = (result == 0x00);
-  cpu.f.n = 0;
-  cpu.f.h = 1;
-  cpu.f.cy = 0;
+  record_shift_flags(value, carry);
+
+  return value;
+}
+
+static uint8_t sra(uint8_t value) {
+  bool carry = (value >> 0) & 1;
+  value = (value & 0x80) | (value >> 1);
+
+  // Update CPU flags
+  record_shift_flags(value, carry);
+
+  return value;
+}
+
+static uint8_t swap(uint8_t value) {
+  uint8_t high_nibble = (value >> 4) & 0xF;
+  uint8_t low_nibble  = (value >> 0) & 0xF;
+  value = (low_nibble << 4) | high_nibble;
+
+  // Update CPU flags
+  record_flags(FLAGS_LOGIC, 0, 0, value);
+
+  return value;
+}
+
+static uint8_t srl(uint8_t value) {
+  bool carry = (value >> 0) & 1;
+  value = value >> 1;
+
+  // Update CPU flags
+  record_shift_flags(value, carry);
+
+  return value;
+}
+
+uint8_t and8(int a, int b) {
+  uint8_t result = a & b;
+
+  // Update CPU flags
+  record_flags(FLAGS_AND, a, b, result);
 
   return result;
 }
@@ -651,10 +2105,7 @@ uint8_t or8(int a, int b) {
   uint8_t result = a | b;
 
   // Update CPU flags
-  cpu.f.zf = (result == 0x00);
-  cpu.f.n = 0;
-  cpu.f.h = 0;
-  cpu.f.cy = 0;
+  record_flags(FLAGS_LOGIC, a, b, result);
 
   return result;
 }
@@ -663,24 +2114,20 @@ uint8_t xor8(int a, int b) {
   uint8_t result = a ^ b;
 
   // Update CPU flags
-  cpu.f.zf = (result == 0x00);
-  cpu.f.n = 0;
-  cpu.f.h = 0;
-  cpu.f.cy = 0;
+  record_flags(FLAGS_LOGIC, a, b, result);
 
   return result;
 }
 
 uint8_t add8(int a, int b, bool update_carry) {
   int result = a + b;
-  int half_carry_result = (a & 0xF) + (b & 0xF);
 
   // Update CPU flags
-  cpu.f.zf = ((uint8_t)result == 0x00);
-  cpu.f.n = 0;
-  cpu.f.h = (half_carry_result > 0xF);
   if (update_carry) {
-    cpu.f.cy = (result > 0xFF);
+    record_flags(FLAGS_ADD, a, b, result);
+  } else {
+    gb->lazy_flags.carry = get_carry_flag();
+    record_flags(FLAGS_ADD_KEEP_CY, a, b, result);
   }
 
   return result;
@@ -688,14 +2135,13 @@ uint8_t add8(int a, int b, bool update_carry) {
 
 uint8_t sub8(int a, int b, bool update_carry) {
   int result = a - b;
-  int half_carry_result = (a & 0xF) - (b & 0xF);
 
   // Update CPU flags
-  cpu.f.zf = ((uint8_t)result == 0x00);
-  cpu.f.n = 1;
-  cpu.f.h = (half_carry_result < 0x0);
   if (update_carry) {
-    cpu.f.cy = (result < 0x00);
+    record_flags(FLAGS_SUB, a, b, result);
+  } else {
+    gb->lazy_flags.carry = get_carry_flag();
+    record_flags(FLAGS_SUB_KEEP_CY, a, b, result);
   }
 
   return result;
@@ -703,13 +2149,11 @@ uint8_t sub8(int a, int b, bool update_carry) {
 
 uint16_t add16(int a, int b) {
   int result = a + b;
-  int half_carry_result = (a & 0xF00) + (b & 0xF00);
 
   // Update CPU flags
   //possibly wrong..
-  cpu.f.n = 0;
-  cpu.f.h = 0;
-  cpu.f.cy = (result > 0xFFFF);
+  gb->lazy_flags.zero = get_zero_flag();
+  record_flags(FLAGS_ADD16, a, b, result);
 
   return result;
 }
@@ -718,16 +2162,16 @@ static bool get_cc_result(uint8_t cc) {
   bool cc_result = false;
   switch(cc) {
   case 0: // NZ = not zero
-    cc_result = !cpu.f.zf;
+    cc_result = !get_zero_flag();
     break;
   case 1: // Z = zero
-    cc_result = cpu.f.zf;
+    cc_result = get_zero_flag();
     break;
   case 2: // NC = not carry
-    cc_result = !cpu.f.cy;
+    cc_result = !get_carry_flag();
     break;
   case 3: // C = carry
-    cc_result = cpu.f.cy;
+    cc_result = get_carry_flag();
     break;
   default:
     assert(false);
@@ -741,12 +2185,6 @@ const char* operands8[8] = { "b", "c", "d", "e", "h", "l", "[hl]", "a" };
 const char* operands16[4] = { "bc", "de", "hl", "sp" };
 const char* conditions[] = { "nz", "z",  "nc", "c" };
 
-typedef struct {
-  unsigned int length;
-  unsigned int(*emulate)(uint8_t*); // unsigned int func(uint8_t*) {}
-  void(*disassemble)(uint8_t*, char*); // void func(uint8_t*, char*) {}
-} InstructionHandler;
-
 #define DECODE_X8_X8() \
     uint8_t op2 = code[0] & 7; \
     const char* s_op2 = operands8[op2]; \
@@ -764,9 +2202,12 @@ typedef struct {
     uint8_t op1 = (code[0] >> 4) & 3; \
     const char* s_op1 = operands16[op1];
 
+#define DECODE_D16() \
+    uint16_t d16 = (code[2] << 8) | code[1];
+
 #define DECODE_X16_D16() \
     DECODE_X16() \
-    uint16_t d16 = (code[2] << 8) | code[1];
+    DECODE_D16()
 
 #define DECODE_X8_X16() \
     DECODE_X8() \
@@ -802,21 +2243,102 @@ static void disassemble_nop(uint8_t* code, char* s) {
   sprintf(s, "nop ");
 }
 
+// Cycles returned by halt and idle loops; more than any budget, so the
+// interpreter loop stops and cpu_step() can skip the rest of the budget
+#define SKIP_CYCLES 0x100000
+
+
+static bool is_interrupt_pending() {
+  return (gb->ie & read_io8(IF) & 0x1F) != 0;
+}
+
 static unsigned int emulate_halt(uint8_t* code) {
-  return 4;
+
+  // Halt does nothing if an interrupt is already waiting
+  if (is_interrupt_pending()) {
+    return 4;
+  }
+
+  // Interrupts are only raised between cpu_step() calls, so cpu_step() can
+  // skip the rest of the budget
+  gb->halted = true;
+  return SKIP_CYCLES;
 }
 
 static void disassemble_halt(uint8_t* code, char* s) {
   sprintf(s, "halt");
 }
 
-static unsigned int emulate_ld(uint8_t* code) {
-  DECODE_X8_X8()
-  uint8_t value = read_x8(op2);
-  write_x8(op1, value);
-  return 4; //FIXME: If operand (HL) is used, then 8 cycles
+// Idle loop detection
+//
+// Polling loops (like `ldh a, [LY]; cp N; jr nz`) can't make progress within
+// one cpu_step() budget: I/O registers only change between budgets. If a
+// backward branch reaches the same target with the same CPU state, and no
+// memory was written in between, the loop will repeat forever, so the rest of
+// the budget is skipped.
+static IdleLoop* get_idle_loop(uint16_t address) {
+  unsigned int bank = get_rom_bank_number(address);
+  for(unsigned int i = 0; i < gb->idle_loop_count; i++) {
+    if ((gb->idle_loops[i].address == address) && (gb->idle_loops[i].bank == bank)) {
+      return &gb->idle_loops[i];
+    }
+  }
+  if (gb->idle_loop_count == IDLE_LOOP_COUNT) {
+    return NULL;
+  }
+  IdleLoop* loop = &gb->idle_loops[gb->idle_loop_count++];
+  loop->bank = bank;
+  loop->address = address;
+  loop->detections = 0;
+  loop->skipped_cycles = 0;
+  return loop;
+}
+
+// Called after a taken backward branch, returns the cycles to spend
+static unsigned int detect_idle_loop(unsigned int cycles) {
+  materialize_flags();
+
+  if (gb->idle_loop_valid && !gb->idle_memory_written && (gb->ime == gb->idle_loop_ime) &&
+      !memcmp(&gb->cpu, &gb->idle_loop_cpu, sizeof(gb->cpu))) {
+    gb->idle_loop = get_idle_loop(gb->cpu.pc);
+    if (gb->idle_loop != NULL) {
+      gb->idle_loop->detections++;
+      return SKIP_CYCLES;
+    }
+  }
+
+  gb->idle_loop_valid = true;
+  gb->idle_loop_cpu = gb->cpu;
+  gb->idle_loop_ime = gb->ime;
+  gb->idle_memory_written = false;
+  return cycles;
+}
+
+static void print_idle_loop_statistics() {
+  printf("Idle loops:\n");
+  for(unsigned int i = 0; i < gb->idle_loop_count; i++) {
+    IdleLoop* loop = &gb->idle_loops[i];
+    printf("  %02X:%04X: %lu times, %lu cycles skipped\n",
+           loop->bank, loop->address, loop->detections, loop->skipped_cycles);
+  }
 }
 
+#define GENERATE_LD_X8_X8(op1, op2) \
+  static unsigned int emulate_ld_ ## op1 ## _ ## op2(uint8_t* code) { \
+    WRITE_X8_ ## op1(READ_X8_ ## op2()); \
+    return 4; /*FIXME: If operand (HL) is used, then 8 cycles*/ \
+  }
+FOR_EACH_X8_WITH(GENERATE_LD_X8_X8, b)
+FOR_EACH_X8_WITH(GENERATE_LD_X8_X8, c)
+FOR_EACH_X8_WITH(GENERATE_LD_X8_X8, d)
+FOR_EACH_X8_WITH(GENERATE_LD_X8_X8, e)
+FOR_EACH_X8_WITH(GENERATE_LD_X8_X8, h)
+FOR_EACH_X8_WITH(GENERATE_LD_X8_X8, l)
+// ld [hl], [hl] is halt
+GENERATE_LD_X8_X8(hl, b) GENERATE_LD_X8_X8(hl, c) GENERATE_LD_X8_X8(hl, d) GENERATE_LD_X8_X8(hl, e)
+GENERATE_LD_X8_X8(hl, h) GENERATE_LD_X8_X8(hl, l) GENERATE_LD_X8_X8(hl, a)
+FOR_EACH_X8_WITH(GENERATE_LD_X8_X8, a)
+
 static void disassemble_ld(uint8_t* code, char* s) {
   DECODE_X8_X8()
   sprintf(s, "ld %s, %s", s_op1, s_op2);
@@ -824,7 +2346,7 @@ static void disassemble_ld(uint8_t* code, char* s) {
 
 static unsigned int emulate_ld_a16(uint8_t* code) {
   DECODE_A16()
-  write_memory16(a16, cpu.sp);
+  write_memory16(a16, gb->cpu.sp);
   return 20;
 }
 
@@ -833,19 +2355,22 @@ static void disassemble_ld_a16(uint8_t* code, char* s) {
   sprintf(s, "ld [$%04X], sp", a16);
 }
 
-static unsigned int emulate_ld_x16_d16(uint8_t* code) {
-  DECODE_X16_D16()
-  write_x16(op1, d16);
-  return 12;
-}
+#define GENERATE_LD_X16_D16(op1) \
+  static unsigned int emulate_ld_x16_d16_ ## op1(uint8_t* code) { \
+    DECODE_D16() \
+    X16_REGISTER_ ## op1 = d16; \
+    return 12; \
+  }
+FOR_EACH_X16(GENERATE_LD_X16_D16)
+
 static void disassemble_ld_x16_d16(uint8_t* code, char* s) {
   DECODE_X16_D16()
   sprintf(s, "ld %s, $%02X", s_op1, d16);
 }
 
 static unsigned int emulate_ldd(uint8_t* code) {
-  write_memory8(cpu.hl, cpu.a);
-  cpu.hl -= 1;
+  write_memory8(gb->cpu.hl, gb->cpu.a);
+  gb->cpu.hl -= 1;
   return 8;
 }
 
@@ -853,52 +2378,52 @@ static void disassemble_ldd(uint8_t* code, char* s) {
   sprintf(s, "ld [hl-], a");
 }
 
-static unsigned int emulate_dec_x16(uint8_t* code) {
-  DECODE_X16()
-  uint16_t value = read_x16(op1);
-  value -= 1;
-  write_x16(op1, value);
-  return 8;
-}
+#define GENERATE_DEC_X16(op1) \
+  static unsigned int emulate_dec_x16_ ## op1(uint8_t* code) { \
+    X16_REGISTER_ ## op1 -= 1; \
+    return 8; \
+  }
+FOR_EACH_X16(GENERATE_DEC_X16)
 
 static void disassemble_dec_x16(uint8_t* code, char* s) {
   DECODE_X16();
   sprintf(s, "dec %s", s_op1);
 }
 
-static unsigned int emulate_dec_x8(uint8_t* code) {
-  DECODE_X8_X8()
-  uint8_t value = read_x8(op1);
-  value = sub8(value, 1, false);
-  write_x8(op1, value);
-  return 4;
-}
+#define GENERATE_DEC_X8(op1) \
+  static unsigned int emulate_dec_x8_ ## op1(uint8_t* code) { \
+    uint8_t value = READ_X8_ ## op1(); \
+    value = sub8(value, 1, false); \
+    WRITE_X8_ ## op1(value); \
+    return 4; \
+  }
+FOR_EACH_X8(GENERATE_DEC_X8)
 
 static void disassemble_dec_x8(uint8_t* code, char* s) {
   DECODE_X8_X8();
   sprintf(s, "dec %s", s_op1);
 }
 
-static unsigned int emulate_inc_x16(uint8_t* code) {
-  DECODE_X16()
-  uint16_t value = read_x16(op1);
-  value += 1;
-  write_x16(op1, value);
-  return 8;
-}
+#define GENERATE_INC_X16(op1) \
+  static unsigned int emulate_inc_x16_ ## op1(uint8_t* code) { \
+    X16_REGISTER_ ## op1 += 1; \
+    return 8; \
+  }
+FOR_EACH_X16(GENERATE_INC_X16)
 
 static void disassemble_inc_x16(uint8_t* code, char* s) {
   DECODE_X16();
   sprintf(s, "inc %s", s_op1);
 }
 
-static unsigned int emulate_inc_x8(uint8_t* code) {
-  DECODE_X8_X8()
-  uint8_t value = read_x8(op1);
-  value = add8(value, 1, false);
-  write_x8(op1, value);
-  return 4;
-}
+#define GENERATE_INC_X8(op1) \
+  static unsigned int emulate_inc_x8_ ## op1(uint8_t* code) { \
+    uint8_t value = READ_X8_ ## op1(); \
+    value = add8(value, 1, false); \
+    WRITE_X8_ ## op1(value); \
+    return 4; \
+  }
+FOR_EACH_X8(GENERATE_INC_X8)
 
 static void disassemble_inc_x8(uint8_t* code, char* s) {
   DECODE_X8_X8()
@@ -906,8 +2431,8 @@ static void disassemble_inc_x8(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_ldi(uint8_t* code) {
-  write_memory8(cpu.hl, cpu.a);
-  cpu.hl += 1;
+  write_memory8(gb->cpu.hl, gb->cpu.a);
+  gb->cpu.hl += 1;
   return 8;
 }
 
@@ -916,7 +2441,7 @@ static void disassemble_ldi(uint8_t* code, char*s) {
 }
 
 static unsigned int emulate_ld_mem_02(uint8_t* code) {
-  write_memory8(cpu.bc, cpu.a);
+  write_memory8(gb->cpu.bc, gb->cpu.a);
   return 8;
 }
 
@@ -925,7 +2450,7 @@ static void disassemble_ld_mem_02(uint8_t*code, char* s) {
 }
 
 static unsigned int emulate_ld_mem_12(uint8_t* code) {
-  write_memory8(cpu.de, cpu.a);
+  write_memory8(gb->cpu.de, gb->cpu.a);
   return 8;
 }
 
@@ -934,7 +2459,7 @@ static void disassemble_ld_mem_12(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_ld_mem_0a(uint8_t* code) {
-  cpu.a = read_memory16(cpu.bc);
+  gb->cpu.a = read_memory16(gb->cpu.bc);
   return 8;
 }
 
@@ -943,7 +2468,7 @@ static void disassemble_ld_mem_0a(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_ld_mem_1a(uint8_t* code) {
-  cpu.a = read_memory16(cpu.de);
+  gb->cpu.a = read_memory16(gb->cpu.de);
   return 8;
 }
 
@@ -952,8 +2477,8 @@ static void disassemble_ld_mem_1a(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_ldi_2a(uint8_t* code) {
-  cpu.a = read_memory8(cpu.hl);
-  cpu.hl += 1;
+  gb->cpu.a = read_memory8(gb->cpu.hl);
+  gb->cpu.hl += 1;
   return 8;
 }
 
@@ -962,8 +2487,8 @@ static void disassemble_ldi_2a(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_ldd_3a(uint8_t* code) {
-  cpu.a = read_memory8(cpu.hl);
-  cpu.hl -= 1;
+  gb->cpu.a = read_memory8(gb->cpu.hl);
+  gb->cpu.hl -= 1;
   return 8;
 }
 
@@ -971,14 +2496,17 @@ static void disassemble_ldd_3a(uint8_t* code, char* s) {
   sprintf(s, "ld a, [hl-]");
 }
 
-static unsigned int emulate_jr_cc_r8(uint8_t* code) {
-  DECODE_CC_R8()
-  if (get_cc_result(cc)) {
-    cpu.pc += r8;
-    return 12;
+#define GENERATE_JR_CC_R8(cc) \
+  static unsigned int emulate_jr_cc_r8_ ## cc(uint8_t* code) { \
+    DECODE_R8() \
+    if (get_cc_result(CC_ ## cc)) { \
+      gb->cpu.pc += r8; \
+      return (r8 < 0) ? detect_idle_loop(12) : 12; \
+    } \
+    return 8; \
   }
-  return 8;
-}
+FOR_EACH_CC(GENERATE_JR_CC_R8)
+
 static void disassemble_jr_cc_r8(uint8_t* code, char* s) {
   DECODE_CC_R8()
   sprintf(s, "jr %s, $%02X", conditions[cc], r8 & 0xFF);
@@ -986,8 +2514,8 @@ static void disassemble_jr_cc_r8(uint8_t* code, char* s) {
 
 static unsigned int emulate_jr_r8(uint8_t* code) {
   DECODE_R8()
-  cpu.pc += r8;
-  return 12;
+  gb->cpu.pc += r8;
+  return (r8 < 0) ? detect_idle_loop(12) : 12;
 }
 
 static void disassemble_jr_r8(uint8_t* code, char* s) {
@@ -1002,8 +2530,9 @@ static void disassemble_jr_r8(uint8_t* code, char* s) {
 
 static unsigned int emulate_jp_a16(uint8_t* code) {
   DECODE_A16()
-  cpu.pc = a16;
-  return 16;
+  bool backward = (a16 < gb->cpu.pc);
+  gb->cpu.pc = a16;
+  return backward ? detect_idle_loop(16) : 16;
 }
 
 static void disassemble_jp_a16(uint8_t* code, char* s) {
@@ -1012,7 +2541,7 @@ static void disassemble_jp_a16(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_jp_hl(uint8_t* code) {
-  cpu.pc = cpu.hl;
+  gb->cpu.pc = gb->cpu.hl;
   return 4;
 }
 
@@ -1020,16 +2549,18 @@ static void disassemble_jp_hl(uint8_t* code, char* s) {
   sprintf(s, "jp hl"); //possibly incorrect
 }
 
-static unsigned int emulate_jp_cc(uint8_t* code) {
-  DECODE_CC()
-  DECODE_A16()
-  if (get_cc_result(cc)) {
-    cpu.pc = a16;
-    return 16;
-  } else {
-    return 12;
+#define GENERATE_JP_CC(cc) \
+  static unsigned int emulate_jp_cc_ ## cc(uint8_t* code) { \
+    DECODE_A16() \
+    if (get_cc_result(CC_ ## cc)) { \
+      bool backward = (a16 < gb->cpu.pc); \
+      gb->cpu.pc = a16; \
+      return backward ? detect_idle_loop(16) : 16; \
+    } else { \
+      return 12; \
+    } \
   }
-}
+FOR_EACH_CC(GENERATE_JP_CC)
 
 static void disassemble_jp_cc(uint8_t* code, char* s) {
   DECODE_CC()
@@ -1037,46 +2568,50 @@ static void disassemble_jp_cc(uint8_t* code, char* s) {
   sprintf(s, "jp %s, $%X", conditions[cc], a16);
 }
 
-static unsigned int emulate_sub(uint8_t* code) {
-  DECODE_X8()
-  cpu.a = sub8(cpu.a, read_x8(op1), true);
-  return 4;
+#define GENERATE_SUB(op1) \
+  static unsigned int emulate_sub_ ## op1(uint8_t* code) { \
+    gb->cpu.a = sub8(gb->cpu.a, READ_X8_ ## op1(), true); \
+    return 4; \
+  }
+FOR_EACH_X8(GENERATE_SUB)
 
-}
 static void disassemble_sub(uint8_t* code, char* s) {
   DECODE_X8()
   sprintf(s, "sub a, %s", s_op1);
 }
 
-static unsigned int emulate_sbc(uint8_t* code) {
-  DECODE_X8()
-  int carry = cpu.f.cy ? 1: 0;
-  cpu.a = sub8(cpu.a, read_x8(op1) + carry, true);
-  return 4;
+#define GENERATE_SBC(op1) \
+  static unsigned int emulate_sbc_ ## op1(uint8_t* code) { \
+    int carry = get_carry_flag() ? 1: 0; \
+    gb->cpu.a = sub8(gb->cpu.a, READ_X8_ ## op1() + carry, true); \
+    return 4; \
+  }
+FOR_EACH_X8(GENERATE_SBC)
 
-}
 static void disassemble_sbc(uint8_t* code, char* s) {
   DECODE_X8()
   sprintf(s, "sbc a, %s", s_op1);
 }
 
-static unsigned int emulate_add(uint8_t* code) {
-  DECODE_X8()
-  cpu.a = add8(cpu.a, read_x8(op1), true);
-  return 4;
+#define GENERATE_ADD(op1) \
+  static unsigned int emulate_add_ ## op1(uint8_t* code) { \
+    gb->cpu.a = add8(gb->cpu.a, READ_X8_ ## op1(), true); \
+    return 4; \
+  }
+FOR_EACH_X8(GENERATE_ADD)
 
-}
 static void disassemble_add(uint8_t* code, char* s) {
   DECODE_X8()
   sprintf(s, "add a, %s", s_op1);
 }
 
-static unsigned int emulate_adc(uint8_t* code) {
-  DECODE_X8()
-  int carry = cpu.f.cy ? 1: 0;
-  cpu.a = add8(cpu.a, read_x8(op1) + carry, true);
-  return 4;
-}
+#define GENERATE_ADC(op1) \
+  static unsigned int emulate_adc_ ## op1(uint8_t* code) { \
+    int carry = get_carry_flag() ? 1: 0; \
+    gb->cpu.a = add8(gb->cpu.a, READ_X8_ ## op1() + carry, true); \
+    return 4; \
+  }
+FOR_EACH_X8(GENERATE_ADC)
 
 static void disassemble_adc(uint8_t* code, char* s) {
   DECODE_X8()
@@ -1085,8 +2620,8 @@ static void disassemble_adc(uint8_t* code, char* s) {
 
 static unsigned int emulate_adc_d8(uint8_t* code) {
   DECODE_D8()
-  int carry = cpu.f.cy ? 1: 0;
-  cpu.a = add8(cpu.a, d8 + carry, true);
+  int carry = get_carry_flag() ? 1: 0;
+  gb->cpu.a = add8(gb->cpu.a, d8 + carry, true);
   return 8;
 }
 
@@ -1097,8 +2632,8 @@ static void disassemble_adc_d8(uint8_t* code, char* s) {
 
 static unsigned int emulate_sbc_d8(uint8_t* code) {
   DECODE_D8()
-  int carry = cpu.f.cy ? 1: 0;
-  cpu.a = sub8(cpu.a, d8 + carry, true);
+  int carry = get_carry_flag() ? 1: 0;
+  gb->cpu.a = sub8(gb->cpu.a, d8 + carry, true);
   return 8;
 }
 
@@ -1107,46 +2642,49 @@ static void disassemble_sbc_d8(uint8_t* code, char* s) {
   sprintf(s, "sbc $%02X", d8); 
 }
 
-static unsigned int emulate_rst(uint8_t* code) {
-  //      hard coded here instead of using X8_X8 macro
-  //       This would match http://www.z80.info/decoding.htm
-  uint8_t target = ((code[0] >> 3) & 7) * 0x8;
-  call(target);
-  return 16;
-}
+#define GENERATE_RST(target) \
+  static unsigned int emulate_rst_ ## target(uint8_t* code) { \
+    call(target); \
+    return 16; \
+  }
+GENERATE_RST(0x00) GENERATE_RST(0x08) GENERATE_RST(0x10) GENERATE_RST(0x18)
+GENERATE_RST(0x20) GENERATE_RST(0x28) GENERATE_RST(0x30) GENERATE_RST(0x38)
 
 static void disassemble_rst(uint8_t* code, char* s) {
   uint8_t target = ((code[0] >> 3) & 7) * 0x8;
   sprintf(s, "rst $%02X", target);
 }
 
-static unsigned int emulate_xor(uint8_t* code) {
-  DECODE_X8()
-  cpu.a = xor8(cpu.a, read_x8(op1));
-  return 4;
-}
+#define GENERATE_XOR(op1) \
+  static unsigned int emulate_xor_ ## op1(uint8_t* code) { \
+    gb->cpu.a = xor8(gb->cpu.a, READ_X8_ ## op1()); \
+    return 4; \
+  }
+FOR_EACH_X8(GENERATE_XOR)
 
 static void disassemble_xor(uint8_t* code, char* s) {
   DECODE_X8()
   sprintf(s, "xor %s", s_op1);
 }
 
-static unsigned int emulate_and(uint8_t* code) {
-  DECODE_X8()
-  cpu.a = and8(cpu.a, read_x8(op1));
-  return 4;
-}
+#define GENERATE_AND(op1) \
+  static unsigned int emulate_and_ ## op1(uint8_t* code) { \
+    gb->cpu.a = and8(gb->cpu.a, READ_X8_ ## op1()); \
+    return 4; \
+  }
+FOR_EACH_X8(GENERATE_AND)
 
 static void disassemble_and(uint8_t* code, char* s) {
   DECODE_X8()
   sprintf(s, "and %s", s_op1);
 }
 
-static unsigned int emulate_or(uint8_t* code) {
-  DECODE_X8()
-  cpu.a = or8(cpu.a, read_x8(op1));
-  return 4;
-}
+#define GENERATE_OR(op1) \
+  static unsigned int emulate_or_ ## op1(uint8_t* code) { \
+    gb->cpu.a = or8(gb->cpu.a, READ_X8_ ## op1()); \
+    return 4; \
+  }
+FOR_EACH_X8(GENERATE_OR)
 
 static void disassemble_or(uint8_t* code, char* s) {
   DECODE_X8()
@@ -1155,7 +2693,7 @@ static void disassemble_or(uint8_t* code, char* s) {
 
 static unsigned int emulate_e0_ldh(uint8_t* code) {
   DECODE_A8()
-  write_memory8(0xFF00 + a8, cpu.a);
+  write_memory8(0xFF00 + a8, gb->cpu.a);
   return 12;
 }
 
@@ -1166,7 +2704,7 @@ static void disassemble_e0_ldh(uint8_t* code, char* s) {
 
 static unsigned int emulate_f0_ldh(uint8_t* code) {
   DECODE_A8()
-  cpu.a = read_memory8(0xFF00 + a8);
+  gb->cpu.a = read_memory8(0xFF00 + a8);
   return 12;
 }
 
@@ -1177,7 +2715,7 @@ static void disassemble_f0_ldh(uint8_t* code, char* s) {
 
 static unsigned int emulate_cp_d8(uint8_t* code) {
   DECODE_D8()
-  sub8(cpu.a, d8, true);
+  sub8(gb->cpu.a, d8, true);
   return 8;
 }
 
@@ -1186,12 +2724,13 @@ static void disassemble_cp_d8(uint8_t* code, char* s) {
   sprintf(s, "cp $%02X", d8);
 }
 
-static unsigned int emulate_cp_x8(uint8_t* code) {
-  DECODE_X8()
-  uint8_t value = read_x8(op1);
-  sub8(cpu.a, value, true);
-  return 4;
-}
+#define GENERATE_CP_X8(op1) \
+  static unsigned int emulate_cp_x8_ ## op1(uint8_t* code) { \
+    uint8_t value = READ_X8_ ## op1(); \
+    sub8(gb->cpu.a, value, true); \
+    return 4; \
+  }
+FOR_EACH_X8(GENERATE_CP_X8)
 
 static void disassemble_cp_x8(uint8_t* code, char* s) {
   DECODE_X8()
@@ -1200,7 +2739,7 @@ static void disassemble_cp_x8(uint8_t* code, char* s) {
 
 static unsigned int emulate_and_d8(uint8_t* code) {
   DECODE_D8()
-  cpu.a = and8(cpu.a, d8);
+  gb->cpu.a = and8(gb->cpu.a, d8);
   return 8;
 }
 
@@ -1211,7 +2750,7 @@ static void disassemble_and_d8(uint8_t* code, char* s) {
 
 static unsigned int emulate_or_d8(uint8_t* code) {
   DECODE_D8()
-  cpu.a = or8(cpu.a, d8);
+  gb->cpu.a = or8(gb->cpu.a, d8);
   return 8;
 }
 
@@ -1223,7 +2762,7 @@ static void disassemble_or_d8(uint8_t* code, char* s) {
 
 static unsigned int emulate_add_d8(uint8_t* code) {
   DECODE_D8()
-  cpu.a = add8(cpu.a, d8, true);
+  gb->cpu.a = add8(gb->cpu.a, d8, true);
   return 8;
 }
 
@@ -1235,10 +2774,10 @@ static void disassemble_add_d8(uint8_t* code, char* s) {
 static unsigned int emulate_add_sp(uint8_t* code) {
   DECODE_R8();
 
-  uint16_t a = cpu.sp;
+  uint16_t a = gb->cpu.sp;
   uint16_t b = r8;
   
-  cpu.sp = add16(a, b);
+  gb->cpu.sp = add16(a, b);
 
   return 16;
 }
@@ -1248,16 +2787,14 @@ static void disassemble_add_sp(uint8_t* code, char* s) {
   sprintf(s, "add sp, $%02X", r8);
 }
 
-static unsigned int emulate_add_hl(uint8_t* code) {
-  DECODE_X16();
-
-  uint16_t a = cpu.hl;
-  uint16_t b = read_x16(op1);
-  
-  cpu.hl = add16(a, b);
-
-  return 8;
-}
+#define GENERATE_ADD_HL(op1) \
+  static unsigned int emulate_add_hl_ ## op1(uint8_t* code) { \
+    uint16_t a = gb->cpu.hl; \
+    uint16_t b = X16_REGISTER_ ## op1; \
+    gb->cpu.hl = add16(a, b); \
+    return 8; \
+  }
+FOR_EACH_X16(GENERATE_ADD_HL)
 
 static void disassemble_add_hl(uint8_t* code, char* s) {
   DECODE_X16();
@@ -1267,10 +2804,10 @@ static void disassemble_add_hl(uint8_t* code, char* s) {
 static unsigned int emulate_ld_f8(uint8_t* code){
   DECODE_R8()
   
-  uint16_t a = cpu.sp;
+  uint16_t a = gb->cpu.sp;
   uint16_t b = r8;
 
-  cpu.hl = add16(a, b);
+  gb->cpu.hl = add16(a, b);
   
   return 12;
 }
@@ -1282,7 +2819,7 @@ static void disassemble_ld_f8(uint8_t* code, char* s){
 
 static unsigned int emulate_sub_d8(uint8_t* code) {
   DECODE_D8()
-  cpu.a = sub8(cpu.a, d8, true);
+  gb->cpu.a = sub8(gb->cpu.a, d8, true);
   return 8;
 }
 
@@ -1293,7 +2830,7 @@ static void disassemble_sub_d8(uint8_t* code, char* s) {
 
 static unsigned int emulate_xor_d8(uint8_t* code) {
   DECODE_D8()
-  cpu.a = xor8(cpu.a, d8);
+  gb->cpu.a = xor8(gb->cpu.a, d8);
   return 8;
 }
 
@@ -1308,103 +2845,60 @@ static void disassemble_xor_d8(uint8_t* code, char* s) {
   uint8_t op1 = operation & 7; \
   const char* s_op1 = operands8[op1];
 
-static unsigned int emulate_cb_prefix(uint8_t* code) {
-    DECODE_CB()
-
-    uint8_t value = read_x8(op1);
-
-    if ((operation >= 0x00) && (operation <= 0x07)) {
-      // RLC (Rotate Left Circular)
-
-      value = rlc(value);
-
-    } else if ((operation >= 0x08) && (operation <= 0x0F)) {
-      // RRC (Rotate Right Circular)
-
-      value = rrc(value);
-
-    } else if ((operation >= 0x10) && (operation <= 0x17)) {
-      // RL (Rotate Left through carry)
-
-      value = rl(value);
-
-    } else if ((operation >= 0x18) && (operation <= 0x1F)) {
-      // RR (Rotate Right through carry)
-
-      value = rr(value);
-
-    } else if ((operation >= 0x20) && (operation <= 0x27)) {
-      // SLA
-
-      bool carry = (value >> 7) & 1;
-      value = value << 1;
-
-      // Update CPU flags
-      cpu.f.zf = (value == 0x00);
-      cpu.f.n = 0;
-      cpu.f.h = 0;
-      cpu.f.cy = carry;
-    
-    } else if ((operation >= 0x28) && (operation <= 0x2F)) {
-      // SRA
-
-      bool carry = (value >> 0) & 1;
-      value = (value & 0x80) | (value >> 1);
-
-      // Update CPU flags
-      cpu.f.zf = (value == 0x00);
-      cpu.f.n = 0;
-      cpu.f.h = 0;
-      cpu.f.cy = carry;
-
-    } else if ((operation >= 0x30) && (operation <= 0x37)) {
-      // SWAP
-
-      uint8_t high_nibble = (value >> 4) & 0xF;
-      uint8_t low_nibble  = (value >> 0) & 0xF;
-      value = (low_nibble << 4) | high_nibble;
-
-      // Update CPU flags
-      cpu.f.zf = (value == 0x00);
-      cpu.f.n = 0;
-      cpu.f.h = 0;
-      cpu.f.cy = 0;
-
-    } else if ((operation >= 0x37) && (operation <= 0x3F)) {
-      // SRL
-
-      bool carry = (value >> 0) & 1;
-      value = value >> 1;
-
-      // Update CPU flags
-      cpu.f.zf = (value == 0x00);
-      cpu.f.n = 0;
-      cpu.f.h = 0;
-      cpu.f.cy = carry;
-
-    } else if ((operation >= 0x40) && (operation <= 0x7F)) {
-      // BIT
-            
-      bool bit = (value >> operation_index) & 1;
-
-      // Update CPU flags
-      cpu.f.zf = bit;
-      cpu.f.n = 0;
-      cpu.f.h = 1;
-      
-    } else if ((operation >= 0x80) && (operation <= 0xBF)) {
-      // RES
-
-      value &= ~(1 << operation_index);
-
-    } else if ((operation >= 0xC0) && (operation <= 0xFF)) {
-      // SET
+// Rotate and shift operations (CB 00-3F)
+#define GENERATE_CB_SHIFT(operation, op1) \
+  static unsigned int emulate_cb_ ## operation ## _ ## op1(uint8_t* code) { \
+    uint8_t value = READ_X8_ ## op1(); \
+    value = operation(value); \
+    WRITE_X8_ ## op1(value); \
+    return 8; \
+  }
+FOR_EACH_X8_WITH(GENERATE_CB_SHIFT, rlc)
+FOR_EACH_X8_WITH(GENERATE_CB_SHIFT, rrc)
+FOR_EACH_X8_WITH(GENERATE_CB_SHIFT, rl)
+FOR_EACH_X8_WITH(GENERATE_CB_SHIFT, rr)
+FOR_EACH_X8_WITH(GENERATE_CB_SHIFT, sla)
+FOR_EACH_X8_WITH(GENERATE_CB_SHIFT, sra)
+FOR_EACH_X8_WITH(GENERATE_CB_SHIFT, swap)
+FOR_EACH_X8_WITH(GENERATE_CB_SHIFT, srl)
+
+// BIT (CB 40-7F)
+#define GENERATE_CB_BIT(bit, op1) \
+  static unsigned int emulate_cb_bit_ ## bit ## _ ## op1(uint8_t* code) { \
+    uint8_t value = READ_X8_ ## op1(); \
+    \
+    /* Update CPU flags */ \
+    gb->lazy_flags.carry = get_carry_flag(); \
+    record_flags(FLAGS_BIT, 0, 0, (value >> bit) & 1); \
+    \
+    return 8; \
+  }
+FOR_EACH_BIT(GENERATE_CB_BIT)
+
+// RES (CB 80-BF)
+#define GENERATE_CB_RES(bit, op1) \
+  static unsigned int emulate_cb_res_ ## bit ## _ ## op1(uint8_t* code) { \
+    uint8_t value = READ_X8_ ## op1(); \
+    value &= ~(1 << bit); \
+    WRITE_X8_ ## op1(value); \
+    return 8; \
+  }
+FOR_EACH_BIT(GENERATE_CB_RES)
+
+// SET (CB C0-FF)
+#define GENERATE_CB_SET(bit, op1) \
+  static unsigned int emulate_cb_set_ ## bit ## _ ## op1(uint8_t* code) { \
+    uint8_t value = READ_X8_ ## op1(); \
+    value |= 1 << bit; \
+    WRITE_X8_ ## op1(value); \
+    return 8; \
+  }
+FOR_EACH_BIT(GENERATE_CB_SET)
 
-      value |= 1 << operation_index;
-    }
+static const InstructionHandler cpu_cb_opcodes[256];
 
-    write_x8(op1, value);
-    return 8;
+static unsigned int emulate_cb_prefix(uint8_t* code) {
+  return cpu_cb_opcodes[code[1]].emulate(code);
 }
 
 static void disassemble_cb_prefix(uint8_t* code, char* s) {
@@ -1432,16 +2926,17 @@ static void disassemble_call(uint8_t* code, char* s) {
   sprintf(s, "call $%X", a16);
 }
 
-static unsigned int emulate_call_cc_a16(uint8_t* code) {
-  DECODE_CC()
-  DECODE_A16()
-  if(get_cc_result(cc)) {
-    call(a16);
-    return 24;
-  } else {
-    return 12;
+#define GENERATE_CALL_CC_A16(cc) \
+  static unsigned int emulate_call_cc_a16_ ## cc(uint8_t* code) { \
+    DECODE_A16() \
+    if (get_cc_result(CC_ ## cc)) { \
+      call(a16); \
+      return 24; \
+    } else { \
+      return 12; \
+    } \
   }
-}
+FOR_EACH_CC(GENERATE_CALL_CC_A16)
 
 static void disassemble_call_cc_a16(uint8_t* code, char* s) {
   DECODE_CC()
@@ -1450,12 +2945,12 @@ static void disassemble_call_cc_a16(uint8_t* code, char* s) {
 
 }
 
-static unsigned int emulate_push_x16(uint8_t* code) {
-  DECODE_X16()
-  uint16_t value = read_x16(op1);
-  push16(value);
-  return 16;
-}
+#define GENERATE_PUSH_X16(op1) \
+  static unsigned int emulate_push_x16_ ## op1(uint8_t* code) { \
+    push16(X16_REGISTER_ ## op1); \
+    return 16; \
+  }
+GENERATE_PUSH_X16(bc) GENERATE_PUSH_X16(de) GENERATE_PUSH_X16(hl)
 
 static void disassemble_push_x16(uint8_t* code, char* s) {
   DECODE_X16()
@@ -1463,7 +2958,8 @@ static void disassemble_push_x16(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_push_af(uint8_t* code) {
-  push16(cpu.af);
+  materialize_flags();
+  push16(gb->cpu.af);
   return 16;
 }
 
@@ -1472,7 +2968,7 @@ static void disassemble_push_af(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_ret(uint8_t* code) {
-  cpu.pc = pop16();
+  gb->cpu.pc = pop16();
   return 16;
 }
 
@@ -1480,19 +2976,20 @@ static void disassemble_ret(uint8_t* code, char* s) {
   sprintf(s, "ret "); 
 }
 
-static unsigned int emulate_ret_cc(uint8_t* code) {
-  DECODE_CC()
-  if (get_cc_result(cc)) {
-    cpu.pc = pop16();
-    return 20;
-  } else {
-    return 8;
+#define GENERATE_RET_CC(cc) \
+  static unsigned int emulate_ret_cc_ ## cc(uint8_t* code) { \
+    if (get_cc_result(CC_ ## cc)) { \
+      gb->cpu.pc = pop16(); \
+      return 20; \
+    } else { \
+      return 8; \
+    } \
   }
-}
+FOR_EACH_CC(GENERATE_RET_CC)
 
 static unsigned int emulate_reti(uint8_t* code) {
-  ime = true;
-  cpu.pc = pop16();
+  gb->ime = true;
+  gb->cpu.pc = pop16();
   return 16;
 }
 
@@ -1505,12 +3002,12 @@ static void disassemble_ret_cc(uint8_t* code, char* s) {
   sprintf(s, "ret %s", conditions[cc]);
 }
 
-static unsigned int emulate_pop_x16(uint8_t* code) {
-  DECODE_X16()
-  uint16_t value = pop16();
-  write_x16(op1, value);
-  return 12;
-}
+#define GENERATE_POP_X16(op1) \
+  static unsigned int emulate_pop_x16_ ## op1(uint8_t* code) { \
+    X16_REGISTER_ ## op1 = pop16(); \
+    return 12; \
+  }
+GENERATE_POP_X16(bc) GENERATE_POP_X16(de) GENERATE_POP_X16(hl)
 
 static void disassemble_pop_x16(uint8_t* code, char* s) {
   DECODE_X16()
@@ -1518,7 +3015,10 @@ static void disassemble_pop_x16(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_pop_af(uint8_t* code) {
-  cpu.af = pop16();
+
+  // The lower 4 bits of F always read as zero
+  gb->cpu.af = pop16() & 0xFFF0;
+  gb->lazy_flags.operation = FLAGS_MATERIALIZED;
   return 12;
 }
 
@@ -1526,12 +3026,14 @@ static void disassemble_pop_af(uint8_t* code, char* s) {
   sprintf(s, "pop af");
 }
 
-static unsigned int emulate_ld_x8_d8(uint8_t* code) {
-  DECODE_D8()
-  DECODE_X8_X8()
-  write_x8(op1, d8);
-  return 8;
-}
+#define GENERATE_LD_X8_D8(op1) \
+  static unsigned int emulate_ld_x8_d8_ ## op1(uint8_t* code) { \
+    DECODE_D8() \
+    WRITE_X8_ ## op1(d8); \
+    return 8; \
+  }
+FOR_EACH_X8(GENERATE_LD_X8_D8)
+
 static void disassemble_ld_x8_d8(uint8_t* code, char* s) {
   DECODE_D8()
   DECODE_X8_X8()  //using this macro for a test
@@ -1540,7 +3042,7 @@ static void disassemble_ld_x8_d8(uint8_t* code, char* s) {
 
 static unsigned int emulate_ld_ea(uint8_t* code) {
   DECODE_A16()
-  write_memory8(a16, cpu.a);
+  write_memory8(a16, gb->cpu.a);
   return 16;
 }
 
@@ -1551,7 +3053,7 @@ static void disassemble_ld_ea(uint8_t* code, char* s) {
 
 static unsigned int emulate_ld_e2(uint8_t* code) {
   
-  write_memory8(0xFF00 + cpu.c, cpu.a);
+  write_memory8(0xFF00 + gb->cpu.c, gb->cpu.a);
   return 8;
 }
 
@@ -1562,7 +3064,7 @@ static void disassemble_ld_e2(uint8_t* code, char* s) {
 
 static unsigned int emulate_ld_f2(uint8_t* code) {
   
-  cpu.a = read_memory8(0xFF00 + cpu.c);
+  gb->cpu.a = read_memory8(0xFF00 + gb->cpu.c);
   return 8;
 }
 
@@ -1573,7 +3075,7 @@ static void disassemble_ld_f2(uint8_t* code, char* s) {
 
 static unsigned int emulate_ld_fa(uint8_t* code) {
   DECODE_A16()
-  cpu.a = read_memory8(a16);
+  gb->cpu.a = read_memory8(a16);
   return 16;
 }
 
@@ -1583,7 +3085,7 @@ static void disassemble_ld_fa(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_ld_f9(uint8_t* code) {
-  cpu.sp = cpu.hl;
+  gb->cpu.sp = gb->cpu.hl;
   return 8;
 }
 
@@ -1592,7 +3094,7 @@ static void disassemble_ld_f9(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_ei(uint8_t* code) {
-  ime = true;
+  gb->ime = true;
   return 4;
 }
 
@@ -1601,7 +3103,7 @@ static void disassemble_ei(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_di(uint8_t* code) {
-  ime = false;
+  gb->ime = false;
   return 4;
 }
 
@@ -1609,9 +3111,10 @@ static void disassemble_di(uint8_t* code, char* s) {
   sprintf(s, "di "); 
 }
 
+// The CPU locks up, but time keeps passing for the rest of the system
 static unsigned int emulate_undefined(uint8_t* code) {
-  cpu.pc -= 1;
-  return 0;
+  gb->cpu.pc -= 1;
+  return 4;
 }
 
 static void disassemble_undefined(uint8_t* code, char* s) {
@@ -1619,10 +3122,10 @@ static void disassemble_undefined(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_rra(uint8_t* code) {
-  cpu.a = rr(cpu.a);
+  gb->cpu.a = rr(gb->cpu.a);
 
   // Fixup the zero flag (rrc sets it according to result)
-  cpu.f.zf = 0;
+  gb->lazy_flags.operation = FLAGS_SHIFT_A;
 
   return 4;
 }
@@ -1632,10 +3135,10 @@ static void disassemble_rra(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_rrca(uint8_t* code) {
-  cpu.a = rrc(cpu.a);
+  gb->cpu.a = rrc(gb->cpu.a);
 
   // zero flag is set by rrc according to the result
-  cpu.f.zf = 0;
+  gb->lazy_flags.operation = FLAGS_SHIFT_A;
 
   return 4;
 }
@@ -1645,10 +3148,10 @@ static void disassemble_rrca(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_rla(uint8_t* code) {
-  cpu.a = rl(cpu.a);
+  gb->cpu.a = rl(gb->cpu.a);
 
   
-  cpu.f.zf = 0;
+  gb->lazy_flags.operation = FLAGS_SHIFT_A;
 
   return 4;
 }
@@ -1658,10 +3161,10 @@ static void disassemble_rla(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_rlca(uint8_t* code) {
-  cpu.a = rlc(cpu.a);
+  gb->cpu.a = rlc(gb->cpu.a);
 
  //setting 0 flag 
-  cpu.f.zf = 0;
+  gb->lazy_flags.operation = FLAGS_SHIFT_A;
 
   return 4;
 }
@@ -1681,11 +3184,12 @@ static void disassemble_stop_0(uint8_t* code, char* s) {
 
 static unsigned int emulate_cpl(uint8_t* code) {
     
-  cpu.a ^= 0xFF;
+  gb->cpu.a ^= 0xFF;
     
   // Update CPU flags
-  cpu.f.n = 1;
-  cpu.f.h = 1;
+  materialize_flags();
+  gb->cpu.f.n = 1;
+  gb->cpu.f.h = 1;
       
   return 4;
 }
@@ -1697,9 +3201,10 @@ static void disassemble_cpl(uint8_t* code, char* s) {
 static unsigned int emulate_scf(uint8_t* code) {
     
   // Update CPU flags
-  cpu.f.n = 0;
-  cpu.f.h = 0;
-  cpu.f.cy = 1;
+  materialize_flags();
+  gb->cpu.f.n = 0;
+  gb->cpu.f.h = 0;
+  gb->cpu.f.cy = 1;
   
   return 4;   
 }
@@ -1711,9 +3216,10 @@ static void disassemble_scf(uint8_t* code, char* s) {
 static unsigned int emulate_ccf(uint8_t* code) {
 
   // Update CPU flags
-  cpu.f.n = 0;
-  cpu.f.h = 0;
-  cpu.f.cy = !cpu.f.cy;
+  materialize_flags();
+  gb->cpu.f.n = 0;
+  gb->cpu.f.h = 0;
+  gb->cpu.f.cy = !gb->cpu.f.cy;
   
   return 4;
 }
@@ -1723,26 +3229,27 @@ static void disassemble_ccf(uint8_t* code, char* s) {
 }
 
 static unsigned int emulate_daa(uint8_t* code) {
+  materialize_flags();
 
   // do not understand this section very well
-  if (cpu.f.n) {
-    if (cpu.f.h)  { cpu.a += 0xFA; }
-    if (cpu.f.cy) { cpu.a += 0xA0; }
+  if (gb->cpu.f.n) {
+    if (gb->cpu.f.h)  { gb->cpu.a += 0xFA; }
+    if (gb->cpu.f.cy) { gb->cpu.a += 0xA0; }
   } else {
-    int a = cpu.a;
-    if ((a & 0x00F) > 0x09 || cpu.f.h) {
+    int a = gb->cpu.a;
+    if ((a & 0x00F) > 0x09 || gb->cpu.f.h) {
        a += 0x06;
     }
-    if ((a & 0x1F0) > 0x90 || cpu.f.cy) {
+    if ((a & 0x1F0) > 0x90 || gb->cpu.f.cy) {
       a += 0x60; 
-      cpu.f.cy = 1;
+      gb->cpu.f.cy = 1;
     } else {
-      cpu.f.cy = 0;
+      gb->cpu.f.cy = 0;
     }
-    cpu.a = a;
+    gb->cpu.a = a;
   }
-  cpu.f.h = 0;
-  cpu.f.zf = (cpu.a != 0x00);
+  gb->cpu.f.h = 0;
+  gb->cpu.f.zf = (gb->cpu.a != 0x00);
   
   return 4;
 }
@@ -1751,232 +3258,163 @@ static void disassemble_daa(uint8_t* code, char* s) {
   sprintf(s, "daa");
 }
 
-#define INSTRUCTION_HANDLER(name, length) InstructionHandler handle_ ## name = { (length), emulate_ ## name, disassemble_ ## name }
-INSTRUCTION_HANDLER(stop_0,      2);
-INSTRUCTION_HANDLER(rra,         1);
-INSTRUCTION_HANDLER(rla,         1);
-INSTRUCTION_HANDLER(jr_cc_r8,    2);
-INSTRUCTION_HANDLER(cp_d8,       2);
-INSTRUCTION_HANDLER(cp_x8,       1);
-INSTRUCTION_HANDLER(and_d8,      2);
-INSTRUCTION_HANDLER(add_d8,      2);
-INSTRUCTION_HANDLER(sub_d8,      2);
-INSTRUCTION_HANDLER(or_d8,       2);
-INSTRUCTION_HANDLER(xor_d8,      2);
-INSTRUCTION_HANDLER(dec_x8,      1);
-INSTRUCTION_HANDLER(dec_x16,     1);
-INSTRUCTION_HANDLER(inc_x16,     1);
-INSTRUCTION_HANDLER(inc_x8,      1);
-INSTRUCTION_HANDLER(nop,         1);
-INSTRUCTION_HANDLER(call,        3);
-INSTRUCTION_HANDLER(call_cc_a16, 3);
-INSTRUCTION_HANDLER(push_x16,    1);
-INSTRUCTION_HANDLER(pop_x16,     1);
-INSTRUCTION_HANDLER(push_af,     1);
-INSTRUCTION_HANDLER(pop_af,      1);
-INSTRUCTION_HANDLER(halt,        1);
-INSTRUCTION_HANDLER(ld,          1);
-INSTRUCTION_HANDLER(ldi,         1);
-INSTRUCTION_HANDLER(ldd,         1);
-INSTRUCTION_HANDLER(ld_mem_02,   1);
-INSTRUCTION_HANDLER(ld_mem_12,   1);
-INSTRUCTION_HANDLER(ld_mem_0a,   1);
-INSTRUCTION_HANDLER(ld_mem_1a,   1);
-INSTRUCTION_HANDLER(ldi_2a,      1);
-INSTRUCTION_HANDLER(ldd_3a,      1);
-INSTRUCTION_HANDLER(ld_x8_d8,    2);
-INSTRUCTION_HANDLER(ld_e2,       1);
-INSTRUCTION_HANDLER(ld_f2,       1);
-INSTRUCTION_HANDLER(jp_a16,      3);
-INSTRUCTION_HANDLER(jp_hl,       1);
-INSTRUCTION_HANDLER(jp_cc,       3);
-INSTRUCTION_HANDLER(jr_r8,       2);
-INSTRUCTION_HANDLER(add_hl,      1);
-INSTRUCTION_HANDLER(sub,         1);
-INSTRUCTION_HANDLER(sbc,         1);
-INSTRUCTION_HANDLER(add,         1);
-INSTRUCTION_HANDLER(adc,         1);
-INSTRUCTION_HANDLER(adc_d8,      2);
-INSTRUCTION_HANDLER(xor,         1);
-INSTRUCTION_HANDLER(sbc_d8,      2);
-INSTRUCTION_HANDLER(or,          1);
-INSTRUCTION_HANDLER(and,         1);
-INSTRUCTION_HANDLER(e0_ldh,      2);
-INSTRUCTION_HANDLER(ld_ea,       3);
-INSTRUCTION_HANDLER(ld_fa,       3);
-INSTRUCTION_HANDLER(ld_f8,       2);
-INSTRUCTION_HANDLER(ld_f9,       1);
-INSTRUCTION_HANDLER(f0_ldh,      2);
-INSTRUCTION_HANDLER(cb_prefix,   2);
-INSTRUCTION_HANDLER(ret,         1);
-INSTRUCTION_HANDLER(ret_cc,      1);
-INSTRUCTION_HANDLER(reti,        1);
-INSTRUCTION_HANDLER(ld_x16_d16,  3);
-INSTRUCTION_HANDLER(undefined,   1);
-INSTRUCTION_HANDLER(ei,          1);
-INSTRUCTION_HANDLER(di,          1);
-INSTRUCTION_HANDLER(rst,         1);
-INSTRUCTION_HANDLER(rrca,        1);
-INSTRUCTION_HANDLER(rlca,        1);
-INSTRUCTION_HANDLER(ld_a16,      3);
-INSTRUCTION_HANDLER(add_sp,      2);
-INSTRUCTION_HANDLER(cpl,         1);
-INSTRUCTION_HANDLER(scf,         1);
-INSTRUCTION_HANDLER(ccf,         1);
-INSTRUCTION_HANDLER(daa,         1);
-
-static InstructionHandler* cpu_decode(uint8_t opcode) {
-  if (opcode == 0x00) {
-    return &handle_nop;
-  } else if ((opcode == 0x01) || (opcode == 0x11) || (opcode == 0x21) || (opcode == 0x31)) {
-    return &handle_ld_x16_d16;
-  } else if (opcode == 0x02) {
-    return &handle_ld_mem_02;
-  } else if ((opcode == 0x03) || (opcode == 0x13) || (opcode == 0x23) || (opcode == 0x33)) {
-    return &handle_inc_x16;
-  } else if ((opcode == 0x04) || (opcode == 0x14) || (opcode == 0x24) || (opcode == 0x34) || (opcode == 0x0C) || (opcode == 0x1C) || (opcode == 0x2C) || (opcode == 0x3C)) {
-    return &handle_inc_x8;
-  } else if ((opcode == 0x05) || (opcode == 0x15) || (opcode == 0x25) || (opcode == 0x35) || (opcode == 0x0D) || (opcode == 0x1D) || (opcode == 0x2D) || (opcode == 0x3D)) {
-    return &handle_dec_x8;
-  } else if ((opcode == 0x06) || (opcode == 0x16) || (opcode == 0x26) || (opcode == 0x36) || (opcode == 0x0E) || (opcode == 0x1E) || (opcode == 0x2E) || (opcode == 0x3E)) {
-    return &handle_ld_x8_d8;      
-  } else if (opcode == 0x07) {
-    return &handle_rlca;
-  } else if (opcode == 0x08) {
-    return &handle_ld_a16;
-  } else if ((opcode == 0x09) || (opcode == 0x19) || (opcode == 0x29) || (opcode == 0x39)) {
-    return &handle_add_hl;
-  } else if (opcode == 0x0A) {
-    return &handle_ld_mem_0a;
-  } else if ((opcode == 0x0B) || (opcode == 0x1B) || (opcode == 0x2B) || (opcode == 0x3B)) {
-    return &handle_dec_x16;
-  } else if (opcode == 0x0F) {
-    return &handle_rrca;
-  } else if (opcode == 0x10) {
-    return &handle_stop_0;
-  } else if (opcode == 0x12) {
-    return &handle_ld_mem_12;
-  } else if (opcode == 0x17) {
-    return &handle_rla;
-  } else if (opcode == 0x18) {
-    return &handle_jr_r8;
-  } else if (opcode == 0x1A) {
-    return &handle_ld_mem_1a;
-  } else if (opcode == 0x1F) {
-    return &handle_rra;
-  } else if ((opcode == 0x20) || (opcode == 0x28) || (opcode == 0x30) || (opcode == 0x38)) {
-    return &handle_jr_cc_r8;
-  } else if (opcode == 0x22) {
-    return &handle_ldi;
-  } else if (opcode == 0x27) {
-    return &handle_daa;
-  } else if (opcode == 0x2A) {
-    return &handle_ldi_2a;
-  } else if (opcode == 0x2F) {
-    return &handle_cpl;
-  } else if (opcode == 0x32) {
-    return &handle_ldd;
-  } else if (opcode == 0x37) {
-    return &handle_scf;
-  } else if (opcode == 0x3A) {
-    return &handle_ldd_3a;
-  } else if (opcode == 0x3F) {
-    return &handle_ccf;
-  } else if ((opcode >= 0x40) && (opcode <= 0x7F)) {
-    if (opcode == 0x76) {
-       return &handle_halt;
-    } else {
-      return &handle_ld;
-    }
-  } else if ((opcode >= 0x80) && (opcode <= 0x87)) {
-    return &handle_add;
-  } else if ((opcode >= 0x88) && (opcode <= 0x8F)) {
-    return &handle_adc;
-  } else if ((opcode >= 0x90) && (opcode <= 0x97)) {
-    return &handle_sub;
-  } else if ((opcode >= 0x98) && (opcode <= 0x9F)) {
-    return &handle_sbc;
-  } else if ((opcode >= 0xA8) && (opcode <= 0xAF)) {
-    return &handle_xor;
-  } else if ((opcode >= 0xA0) && (opcode <= 0xA7)) {
-    return &handle_and;
-  } else if ((opcode >= 0xB0) && (opcode <= 0xB7)) {
-    return &handle_or;
-  } else if ((opcode >= 0xB8) && (opcode <= 0xBF)) {
-    return &handle_cp_x8;
-  } else if ((opcode == 0xC0) || (opcode == 0xC8) ||(opcode == 0xD0) || (opcode == 0xD8)) {
-    return &handle_ret_cc;
-  } else if ((opcode == 0xC1) || (opcode == 0xD1) || (opcode == 0xE1)) {
-    return &handle_pop_x16;
-  } else if ((opcode == 0xC2) || (opcode == 0xCA) || (opcode == 0xD2) || (opcode == 0xDA)) {
-    return &handle_jp_cc;
-  } else if (opcode == 0xC3) {
-    return &handle_jp_a16;
-  } else if ((opcode == 0xC4) || (opcode == 0xCC) || (opcode == 0xD4) || (opcode == 0xDC)) {
-    return &handle_call_cc_a16;
-  } else if ((opcode == 0xC5) || (opcode == 0xD5) || (opcode == 0xE5)) {
-    return &handle_push_x16;
-  } else if (opcode == 0xC6) {
-    return &handle_add_d8;
-  } else if ((opcode == 0xC7) || (opcode == 0xD7) || (opcode == 0xE7) || (opcode == 0xF7) || (opcode == 0xCF) || (opcode == 0xDF) || (opcode == 0xEF) || (opcode == 0xFF)) {
-    return &handle_rst;
-  } else if (opcode == 0xC9) {
-    return &handle_ret;
-  } else if (opcode == 0xCB) {
-    return &handle_cb_prefix;
-  } else if (opcode == 0xCD) {
-    return &handle_call;
-  } else if (opcode == 0xCE) {
-    return &handle_adc_d8;
-  } else if ((opcode == 0xD3) || (opcode == 0xDB) || (opcode == 0xDD) || (opcode == 0xE3) || (opcode == 0xE4) || ((opcode >= 0xEB) && (opcode <=0xED)) || (opcode == 0xF4) || (opcode == 0xFC) ||(opcode == 0xFD)) {
-    return &handle_undefined;
-  } else if (opcode == 0xD6) {
-    return &handle_sub_d8;
-  } else if (opcode == 0xD9) {
-    return &handle_reti;
-  } else if (opcode == 0xDE) {
-    return &handle_sbc_d8;
-  } else if (opcode == 0xE0) {
-    return &handle_e0_ldh;
-  } else if (opcode == 0xE2) {
-    return &handle_ld_e2;
-  } else if (opcode == 0xE6) {
-    return &handle_and_d8;
-  } else if (opcode == 0xE8) {
-    return &handle_add_sp;
-  } else if (opcode == 0xE9) {
-    return &handle_jp_hl;
-  } else if (opcode == 0xEA) {
-    return &handle_ld_ea;
-  } else if (opcode == 0xEE) {
-    return &handle_xor_d8;
-  } else if (opcode == 0xF0) {
-    return &handle_f0_ldh;
-  } else if (opcode == 0xF1) {
-    return &handle_pop_af;
-  } else if (opcode == 0xF2) {
-    return &handle_ld_f2;
-  } else if (opcode == 0xF3) {
-    return &handle_di;
-  } else if (opcode == 0xF5) {
-    return &handle_push_af;
-  } else if (opcode == 0xF6) {
-    return &handle_or_d8;
-  } else if (opcode == 0xF8) {
-    return &handle_ld_f8;
-  } else if (opcode == 0xF9) {
-    return &handle_ld_f9;
-  } else if (opcode == 0xFA) {
-    return &handle_ld_fa;
-  } else if (opcode == 0xFB) {
-    return &handle_ei;
-  } else if (opcode == 0xFE) {
-    return &handle_cp_d8;
-  } else {
+// Opcode list, expanded by X(opcode, name, disassembler, length) into the
+// handler table and into the threaded interpreter. Each handler has its
+// operands baked in.
+#define OPCODE_LD_X8_X8(X, op1, op2)  X(0x40 | (X8_ ## op1 << 3) | X8_ ## op2, ld_ ## op1 ## _ ## op2, ld, 1)
+#define OPCODE_LD_X8_D8(X, op1)       X(0x06 | (X8_ ## op1 << 3), ld_x8_d8_ ## op1, ld_x8_d8, 2)
+#define OPCODE_INC_X8(X, op1)         X(0x04 | (X8_ ## op1 << 3), inc_x8_ ## op1, inc_x8, 1)
+#define OPCODE_DEC_X8(X, op1)         X(0x05 | (X8_ ## op1 << 3), dec_x8_ ## op1, dec_x8, 1)
+#define OPCODE_LD_X16_D16(X, op1)     X(0x01 | (X16_ ## op1 << 4), ld_x16_d16_ ## op1, ld_x16_d16, 3)
+#define OPCODE_INC_X16(X, op1)        X(0x03 | (X16_ ## op1 << 4), inc_x16_ ## op1, inc_x16, 1)
+#define OPCODE_DEC_X16(X, op1)        X(0x0B | (X16_ ## op1 << 4), dec_x16_ ## op1, dec_x16, 1)
+#define OPCODE_ADD_HL(X, op1)         X(0x09 | (X16_ ## op1 << 4), add_hl_ ## op1, add_hl, 1)
+#define OPCODE_PUSH_X16(X, op1)       X(0xC5 | (X16_ ## op1 << 4), push_x16_ ## op1, push_x16, 1)
+#define OPCODE_POP_X16(X, op1)        X(0xC1 | (X16_ ## op1 << 4), pop_x16_ ## op1, pop_x16, 1)
+#define OPCODE_JR_CC_R8(X, cc)        X(0x20 | (CC_ ## cc << 3), jr_cc_r8_ ## cc, jr_cc_r8, 2)
+#define OPCODE_RET_CC(X, cc)          X(0xC0 | (CC_ ## cc << 3), ret_cc_ ## cc, ret_cc, 1)
+#define OPCODE_JP_CC(X, cc)           X(0xC2 | (CC_ ## cc << 3), jp_cc_ ## cc, jp_cc, 3)
+#define OPCODE_CALL_CC_A16(X, cc)     X(0xC4 | (CC_ ## cc << 3), call_cc_a16_ ## cc, call_cc_a16, 3)
+#define OPCODE_RST(X, target)         X(0xC7 | target, rst_ ## target, rst, 1)
+#define OPCODE_ADD(X, op1)            X(0x80 | X8_ ## op1, add_ ## op1, add, 1)
+#define OPCODE_ADC(X, op1)            X(0x88 | X8_ ## op1, adc_ ## op1, adc, 1)
+#define OPCODE_SUB(X, op1)            X(0x90 | X8_ ## op1, sub_ ## op1, sub, 1)
+#define OPCODE_SBC(X, op1)            X(0x98 | X8_ ## op1, sbc_ ## op1, sbc, 1)
+#define OPCODE_AND(X, op1)            X(0xA0 | X8_ ## op1, and_ ## op1, and, 1)
+#define OPCODE_XOR(X, op1)            X(0xA8 | X8_ ## op1, xor_ ## op1, xor, 1)
+#define OPCODE_OR(X, op1)             X(0xB0 | X8_ ## op1, or_ ## op1, or, 1)
+#define OPCODE_CP_X8(X, op1)          X(0xB8 | X8_ ## op1, cp_x8_ ## op1, cp_x8, 1)
+
+#define CPU_OPCODES(X) \
+  /* 00-3F */ \
+  X(0x00, nop,       nop,       1) \
+  X(0x02, ld_mem_02, ld_mem_02, 1) \
+  X(0x07, rlca,      rlca,      1) \
+  X(0x08, ld_a16,    ld_a16,    3) \
+  X(0x0A, ld_mem_0a, ld_mem_0a, 1) \
+  X(0x0F, rrca,      rrca,      1) \
+  X(0x10, stop_0,    stop_0,    2) \
+  X(0x12, ld_mem_12, ld_mem_12, 1) \
+  X(0x17, rla,       rla,       1) \
+  X(0x18, jr_r8,     jr_r8,     2) \
+  X(0x1A, ld_mem_1a, ld_mem_1a, 1) \
+  X(0x1F, rra,       rra,       1) \
+  X(0x22, ldi,       ldi,       1) \
+  X(0x27, daa,       daa,       1) \
+  X(0x2A, ldi_2a,    ldi_2a,    1) \
+  X(0x2F, cpl,       cpl,       1) \
+  X(0x32, ldd,       ldd,       1) \
+  X(0x37, scf,       scf,       1) \
+  X(0x3A, ldd_3a,    ldd_3a,    1) \
+  X(0x3F, ccf,       ccf,       1) \
+  FOR_EACH_X16_WITH(OPCODE_LD_X16_D16, X) \
+  FOR_EACH_X16_WITH(OPCODE_INC_X16, X) \
+  FOR_EACH_X16_WITH(OPCODE_DEC_X16, X) \
+  FOR_EACH_X16_WITH(OPCODE_ADD_HL, X) \
+  FOR_EACH_X8_WITH(OPCODE_INC_X8, X) \
+  FOR_EACH_X8_WITH(OPCODE_DEC_X8, X) \
+  FOR_EACH_X8_WITH(OPCODE_LD_X8_D8, X) \
+  FOR_EACH_CC_WITH(OPCODE_JR_CC_R8, X) \
+  \
+  /* 40-7F */ \
+  FOR_EACH_X8_WITH2(OPCODE_LD_X8_X8, X, b) \
+  FOR_EACH_X8_WITH2(OPCODE_LD_X8_X8, X, c) \
+  FOR_EACH_X8_WITH2(OPCODE_LD_X8_X8, X, d) \
+  FOR_EACH_X8_WITH2(OPCODE_LD_X8_X8, X, e) \
+  FOR_EACH_X8_WITH2(OPCODE_LD_X8_X8, X, h) \
+  FOR_EACH_X8_WITH2(OPCODE_LD_X8_X8, X, l) \
+  OPCODE_LD_X8_X8(X, hl, b) OPCODE_LD_X8_X8(X, hl, c) OPCODE_LD_X8_X8(X, hl, d) OPCODE_LD_X8_X8(X, hl, e) \
+  OPCODE_LD_X8_X8(X, hl, h) OPCODE_LD_X8_X8(X, hl, l) OPCODE_LD_X8_X8(X, hl, a) \
+  FOR_EACH_X8_WITH2(OPCODE_LD_X8_X8, X, a) \
+  X(0x76, halt,      halt,      1) \
+  \
+  /* 80-BF */ \
+  FOR_EACH_X8_WITH(OPCODE_ADD, X) \
+  FOR_EACH_X8_WITH(OPCODE_ADC, X) \
+  FOR_EACH_X8_WITH(OPCODE_SUB, X) \
+  FOR_EACH_X8_WITH(OPCODE_SBC, X) \
+  FOR_EACH_X8_WITH(OPCODE_AND, X) \
+  FOR_EACH_X8_WITH(OPCODE_XOR, X) \
+  FOR_EACH_X8_WITH(OPCODE_OR, X) \
+  FOR_EACH_X8_WITH(OPCODE_CP_X8, X) \
+  \
+  /* C0-FF */ \
+  FOR_EACH_CC_WITH(OPCODE_RET_CC, X) \
+  FOR_EACH_CC_WITH(OPCODE_JP_CC, X) \
+  FOR_EACH_CC_WITH(OPCODE_CALL_CC_A16, X) \
+  OPCODE_POP_X16(X, bc) OPCODE_POP_X16(X, de) OPCODE_POP_X16(X, hl) \
+  OPCODE_PUSH_X16(X, bc) OPCODE_PUSH_X16(X, de) OPCODE_PUSH_X16(X, hl) \
+  OPCODE_RST(X, 0x00) OPCODE_RST(X, 0x08) OPCODE_RST(X, 0x10) OPCODE_RST(X, 0x18) \
+  OPCODE_RST(X, 0x20) OPCODE_RST(X, 0x28) OPCODE_RST(X, 0x30) OPCODE_RST(X, 0x38) \
+  X(0xC3, jp_a16,    jp_a16,    3) \
+  X(0xC6, add_d8,    add_d8,    2) \
+  X(0xC9, ret,       ret,       1) \
+  X(0xCB, cb_prefix, cb_prefix, 2) \
+  X(0xCD, call,      call,      3) \
+  X(0xCE, adc_d8,    adc_d8,    2) \
+  X(0xD6, sub_d8,    sub_d8,    2) \
+  X(0xD9, reti,      reti,      1) \
+  X(0xDE, sbc_d8,    sbc_d8,    2) \
+  X(0xE0, e0_ldh,    e0_ldh,    2) \
+  X(0xE2, ld_e2,     ld_e2,     1) \
+  X(0xE6, and_d8,    and_d8,    2) \
+  X(0xE8, add_sp,    add_sp,    2) \
+  X(0xE9, jp_hl,     jp_hl,     1) \
+  X(0xEA, ld_ea,     ld_ea,     3) \
+  X(0xEE, xor_d8,    xor_d8,    2) \
+  X(0xF0, f0_ldh,    f0_ldh,    2) \
+  X(0xF1, pop_af,    pop_af,    1) \
+  X(0xF2, ld_f2,     ld_f2,     1) \
+  X(0xF3, di,        di,        1) \
+  X(0xF5, push_af,   push_af,   1) \
+  X(0xF6, or_d8,     or_d8,     2) \
+  X(0xF8, ld_f8,     ld_f8,     2) \
+  X(0xF9, ld_f9,     ld_f9,     1) \
+  X(0xFA, ld_fa,     ld_fa,     3) \
+  X(0xFB, ei,        ei,        1) \
+  X(0xFE, cp_d8,     cp_d8,     2)
+
+// Opcodes which share the undefined handler, expanded by X(opcode)
+#define CPU_UNDEFINED_OPCODES(X) \
+  X(0xD3) X(0xDB) X(0xDD) X(0xE3) X(0xE4) X(0xEB) X(0xEC) X(0xED) X(0xF4) X(0xFC) X(0xFD)
+
+#define HANDLER(name, disassembler, length) { (length), emulate_ ## name, disassemble_ ## disassembler }
+#define OPCODE_HANDLER(opcode, name, disassembler, length) [opcode] = HANDLER(name, disassembler, length),
+#define UNDEFINED_OPCODE_HANDLER(opcode) [opcode] = HANDLER(undefined, undefined, 1),
+
+static const InstructionHandler cpu_opcodes[256] = {
+  CPU_OPCODES(OPCODE_HANDLER)
+  CPU_UNDEFINED_OPCODES(UNDEFINED_OPCODE_HANDLER)
+};
+
+#define HANDLER_CB_SHIFT(operation, op1) [(CB_ ## operation << 3) | X8_ ## op1] = HANDLER(cb_ ## operation ## _ ## op1, cb_prefix, 2),
+#define HANDLER_CB_BIT(bit, op1)         [0x40 | (bit << 3) | X8_ ## op1] = HANDLER(cb_bit_ ## bit ## _ ## op1, cb_prefix, 2),
+#define HANDLER_CB_RES(bit, op1)         [0x80 | (bit << 3) | X8_ ## op1] = HANDLER(cb_res_ ## bit ## _ ## op1, cb_prefix, 2),
+#define HANDLER_CB_SET(bit, op1)         [0xC0 | (bit << 3) | X8_ ## op1] = HANDLER(cb_set_ ## bit ## _ ## op1, cb_prefix, 2),
+enum { CB_rlc, CB_rrc, CB_rl, CB_rr, CB_sla, CB_sra, CB_swap, CB_srl };
+
+static const InstructionHandler cpu_cb_opcodes[256] = {
+  FOR_EACH_X8_WITH(HANDLER_CB_SHIFT, rlc)
+  FOR_EACH_X8_WITH(HANDLER_CB_SHIFT, rrc)
+  FOR_EACH_X8_WITH(HANDLER_CB_SHIFT, rl)
+  FOR_EACH_X8_WITH(HANDLER_CB_SHIFT, rr)
+  FOR_EACH_X8_WITH(HANDLER_CB_SHIFT, sla)
+  FOR_EACH_X8_WITH(HANDLER_CB_SHIFT, sra)
+  FOR_EACH_X8_WITH(HANDLER_CB_SHIFT, swap)
+  FOR_EACH_X8_WITH(HANDLER_CB_SHIFT, srl)
+  FOR_EACH_BIT(HANDLER_CB_BIT)
+  FOR_EACH_BIT(HANDLER_CB_RES)
+  FOR_EACH_BIT(HANDLER_CB_SET)
+};
+
+static const InstructionHandler* cpu_decode(uint8_t opcode) {
+  const InstructionHandler* handler = &cpu_opcodes[opcode];
+  if (handler->emulate == NULL) {
     fprintf(stderr, "Unknown instruction 0x%02X\n", opcode);
     assert(false);
+    return NULL;
   }
-  return NULL;
+  return handler;
 }
 
 #define INTERRUPTS_VBLANK    (1 << 0)
@@ -1985,124 +3423,291 @@ static InstructionHandler* cpu_decode(uint8_t opcode) {
 #define INTERRUPTS_SERIAL    (1 << 3)
 #define INTERRUPTS_JOYPAD    (1 << 4)
 
+// Sets bits in IF, keeping whatever is pending already
+static void request_interrupts(uint8_t interrupts) {
+  write_io8(IF, read_io8(IF) | interrupts);
+}
+
 void invoke_interrupt(uint16_t address) {
-  ime = false;
+  gb->ime = false;
   call(address);
 }
 
 
-static int cpu_step(int mcycles) {
+static void cpu_begin_instruction() {
 
-  while(mcycles > 0) {
+  if (gb->ime)  {
 
-    //FIXME: Make this part of register access
-    cpu.f.zero = 0;
+    // If this interrupt is enabled AND it's also triggering now
+    uint8_t _if = read_io8(IF);
+    uint8_t irq = gb->ie & _if;
 
-    if (ime)  {
- 
-      // If this interrupt is enabled AND it's also triggering now
-      uint8_t _if = read_io8(IF);
-      uint8_t irq = ie & _if;
-
-      //interrupts
-
-      if (irq & INTERRUPTS_VBLANK) {
-        invoke_interrupt(0x40);
-        _if &= ~INTERRUPTS_VBLANK;
-      } else if (irq & INTERRUPTS_LCDSTAT) {
-        invoke_interrupt(0x48);
-        _if &= ~INTERRUPTS_LCDSTAT;
-      } if (irq & INTERRUPTS_TIMER) {
-        
-        
-        
+    //interrupts
 
-        //rememebr to do this 
-        //assert(false); // Test
-        
-        
-        
-        invoke_interrupt(0x50);
-        _if &= ~INTERRUPTS_TIMER;
-      } if (irq & INTERRUPTS_SERIAL) {
-        assert(false); // Test .. not ready
-        invoke_interrupt(0x58);
-        _if &= ~INTERRUPTS_SERIAL;
-      } if (irq & INTERRUPTS_JOYPAD) {          
-        assert(false); // Test
-        invoke_interrupt(0x60);
-        _if &= ~INTERRUPTS_JOYPAD;
-      } else {
-        // No interrupt triggered, keep IME enabled
-      }
-   
-      write_io8(IF, _if);
+    if (irq & INTERRUPTS_VBLANK) {
+      invoke_interrupt(0x40);
+      _if &= ~INTERRUPTS_VBLANK;
+    } else if (irq & INTERRUPTS_LCDSTAT) {
+      invoke_interrupt(0x48);
+      _if &= ~INTERRUPTS_LCDSTAT;
+    } if (irq & INTERRUPTS_TIMER) {
+      
+      
+      
+
+      //rememebr to do this 
+      //assert(false); // Test
+      
+      
+      
+      invoke_interrupt(0x50);
+      _if &= ~INTERRUPTS_TIMER;
+    } if (irq & INTERRUPTS_SERIAL) {
+      assert(false); // Test .. not ready
+      invoke_interrupt(0x58);
+      _if &= ~INTERRUPTS_SERIAL;
+    } if (irq & INTERRUPTS_JOYPAD) {          
+      assert(false); // Test
+      invoke_interrupt(0x60);
+      _if &= ~INTERRUPTS_JOYPAD;
+    } else {
+      // No interrupt triggered, keep IME enabled
     }
+ 
+    write_io8(IF, _if);
+  }
 
 #if 0
-    // Debug markers
-    if (cpu.pc == 0x3D0) {
-      printf("IMPORTANT 3D0\n"); // grep IMPORT
-    }
-    static unsigned int step = 0;
-    if (step % 100 == 0) {
-      printf("Step %d\n", step);
-    }
-    step++;
+  // Debug markers
+  if (gb->cpu.pc == 0x3D0) {
+    printf("IMPORTANT 3D0\n"); // grep IMPORT
+  }
+  static unsigned int step = 0;
+  if (step % 100 == 0) {
+    printf("Step %d\n", step);
+  }
+  step++;
 #endif
+}
 
 #if DEBUG
-    // Debug print the current CPU state
-    printf("A: %02X ", cpu.a);
-    printf("F: %02X ", cpu.f);
-    printf("B: %02X ", cpu.b);
-    printf("C: %02X ", cpu.c);
-    printf("D: %02X ", cpu.d);
-    printf("E: %02X ", cpu.e);
-    printf("H: %02X ", cpu.h);
-    printf("L: %02X ", cpu.l);
-    printf("SP: %04X ", cpu.sp);
-    unsigned int rom_bank = get_rom_bank_number(cpu.pc);
-    printf("PC: %02X:%04X ", rom_bank, cpu.pc);
-    printf("| ");
-#endif
+// Binary instruction trace
+//
+// Each executed instruction is stored as a fixed-size record in a ring buffer,
+// which is drained to disk by a writer thread. The writer also stores the
+// disassembly of each distinct instruction once, so the file can be turned
+// into the usual text trace offline (tools/gb-trace-format.py).
+//
+// Tracing is toggled at runtime with F8 (or started with GB_TRACE=<path>).
+
+#define TRACE_BUFFER_SIZE (64 * 1024) // Records, must be a power of two
+#define TRACE_DEFAULT_PATH "gameboy.trace"
 
-    // Get instruction
-    uint8_t opcode = read_memory8(cpu.pc);
+typedef struct {
+  uint64_t cycles;
+  uint16_t sp;
+  uint16_t pc;
+  uint16_t bank;
+  uint8_t a;
+  uint8_t f;
+  uint8_t b;
+  uint8_t c;
+  uint8_t d;
+  uint8_t e;
+  uint8_t h;
+  uint8_t l;
+  uint8_t code[3];
+  uint8_t length;
+  uint8_t reserved[6];
+} TraceRecord;
+
+// The trace has a single producer, so only one context is traced
+static GameboyContext* trace_context = NULL;
+
+// Ring buffer, the emulator only writes head, the writer thread only writes tail
+static TraceRecord* trace_buffer = NULL;
+static atomic_size_t trace_head;
+static atomic_size_t trace_tail;
+
+static FILE* trace_file = NULL;
+static uint8_t* trace_disassembled = NULL; // Bitmap of instruction bytes
+static pthread_t trace_writer;
+static atomic_bool trace_writer_running;
+
+
+static void write_trace_disassembly(const TraceRecord* record) {
+  uint32_t key = record->code[0];
+  if (record->length >= 2) { key |= record->code[1] << 8; }
+  if (record->length >= 3) { key |= record->code[2] << 16; }
+  if (trace_disassembled[key / 8] & (1 << (key % 8))) {
+    return;
+  }
+  trace_disassembled[key / 8] |= 1 << (key % 8);
 
-    // Figure out what instruction this is
-    InstructionHandler* handler = cpu_decode(opcode);
-    assert(handler != NULL);
+  char text[32];
+  memset(text, 0x00, sizeof(text));
+  uint8_t code[3];
+  memcpy(code, record->code, sizeof(code));
+  cpu_decode(code[0])->disassemble(code, text);
 
-    // Read rest of instruction
-    uint8_t code[32];
-    code[0] = opcode;
-    for(int i = 1; i < handler->length; i++) {
-      code[i] = read_memory8(cpu.pc + i);
+  fputc('M', trace_file);
+  fwrite(record->code, 1, sizeof(record->code), trace_file);
+  fputc(record->length, trace_file);
+  fwrite(text, 1, sizeof(text), trace_file);
+}
+
+static void* run_trace_writer(void* argument) {
+  size_t tail = atomic_load_explicit(&trace_tail, memory_order_relaxed);
+  while(true) {
+    bool running = atomic_load_explicit(&trace_writer_running, memory_order_acquire);
+    size_t head = atomic_load_explicit(&trace_head, memory_order_acquire);
+
+    if (head == tail) {
+      if (!running) {
+        break;
+      }
+      usleep(1000);
+      continue;
     }
 
-#if DEBUG
-    // Print instruction bytes
-    for(int i = 0; i < handler->length; i++) {
-      printf("%02X", code[i]);
+    while(tail != head) {
+      const TraceRecord* record = &trace_buffer[tail % TRACE_BUFFER_SIZE];
+      write_trace_disassembly(record);
+      fputc('I', trace_file);
+      fwrite(record, sizeof(TraceRecord), 1, trace_file);
+      tail++;
     }
-    printf(": ");
+    atomic_store_explicit(&trace_tail, tail, memory_order_release);
+  }
+  return NULL;
+}
 
-    // Print disassembly
-    char buffer[32];
-    handler->disassemble(code, buffer);
-    printf("%s", buffer);
-    printf("\n");
-    fflush(stdout);
+static void start_trace(const char* path) {
+  assert(trace_context == NULL);
+
+  trace_file = fopen(path, "wb");
+  if (trace_file == NULL) {
+    fprintf(stderr, "Could not open trace file '%s'\n", path);
+    return;
+  }
+  fwrite("GBTRACE1", 1, 8, trace_file);
+
+  if (trace_buffer == NULL) {
+    trace_buffer = malloc(TRACE_BUFFER_SIZE * sizeof(TraceRecord));
+    trace_disassembled = malloc(0x1000000 / 8);
+    assert((trace_buffer != NULL) && (trace_disassembled != NULL));
+  }
+  memset(trace_disassembled, 0x00, 0x1000000 / 8);
+  atomic_store(&trace_head, 0);
+  atomic_store(&trace_tail, 0);
+  atomic_store(&trace_writer_running, true);
+
+  int error = pthread_create(&trace_writer, NULL, run_trace_writer, NULL);
+  assert(error == 0);
+
+  trace_context = gb;
+  gb->trace_enabled = true;
+  printf("Tracing to '%s'\n", path);
+}
+
+static void stop_trace() {
+  if (trace_context == NULL) {
+    return;
+  }
+  trace_context->trace_enabled = false;
+  trace_context = NULL;
+
+  // Let the writer drain the buffer
+  atomic_store_explicit(&trace_writer_running, false, memory_order_release);
+  pthread_join(trace_writer, NULL);
+
+  fclose(trace_file);
+  trace_file = NULL;
+  printf("Tracing stopped\n");
+}
+
+static const char* get_trace_path() {
+  const char* path = getenv("GB_TRACE");
+  return (path != NULL) ? path : TRACE_DEFAULT_PATH;
+}
+
+static void trace_instruction(const InstructionHandler* handler, uint8_t* code, int mcycles) {
+  size_t head = atomic_load_explicit(&trace_head, memory_order_relaxed);
+
+  // Wait for the writer if the buffer is full
+  while(head - atomic_load_explicit(&trace_tail, memory_order_acquire) >= TRACE_BUFFER_SIZE) {
+    sched_yield();
+  }
+
+  TraceRecord* record = &trace_buffer[head % TRACE_BUFFER_SIZE];
+  materialize_flags();
+  record->cycles = gb->step_end - mcycles;
+  record->sp = gb->cpu.sp;
+  record->pc = gb->cpu.pc;
+  record->bank = get_rom_bank_number(gb->cpu.pc);
+  record->a = gb->cpu.a;
+  record->f = gb->cpu.af & 0xFF;
+  record->b = gb->cpu.b;
+  record->c = gb->cpu.c;
+  record->d = gb->cpu.d;
+  record->e = gb->cpu.e;
+  record->h = gb->cpu.h;
+  record->l = gb->cpu.l;
+  record->length = handler->length;
+  for(int i = 0; i < 3; i++) {
+    record->code[i] = (i < handler->length) ? code[i] : 0x00;
+  }
+
+  atomic_store_explicit(&trace_head, head + 1, memory_order_release);
+}
+
+static void start_trace_from_environment() {
+  if (getenv("GB_TRACE") != NULL) {
+    start_trace(get_trace_path());
+  }
+}
+
+#define TRACE_ENABLED() __builtin_expect(gb->trace_enabled, false)
+#define TRACE_INSTRUCTION(handler, code) \
+  if (TRACE_ENABLED()) { \
+    trace_instruction(handler, code, mcycles); \
+  }
+#else
+#define TRACE_ENABLED() false
+#define TRACE_INSTRUCTION(handler, code)
 #endif
 
-    // Move PC first, so we don't have to adjust jmp etc.
+// Called by the interpreters before each instruction.
+// Keeps the time visible to I/O handlers (see get_current_cycle()).
+#define BEGIN_INSTRUCTION(handler, code) \
+  gb->step_mcycles = mcycles; \
+  TRACE_INSTRUCTION(handler, code)
 
+// Interpreter which looks up the handler in the opcode table
+static int cpu_step_table(int mcycles) {
 
+  while(mcycles > 0) {
 
+    cpu_begin_instruction();
 
+    // Get instruction
+    uint8_t opcode = read_memory8(gb->cpu.pc);
 
-    cpu.pc += handler->length;
+    // Figure out what instruction this is
+    const InstructionHandler* handler = cpu_decode(opcode);
+    assert(handler != NULL);
+
+    // Read rest of instruction
+    uint8_t code[32];
+    code[0] = opcode;
+    for(int i = 1; i < handler->length; i++) {
+      code[i] = read_memory8(gb->cpu.pc + i);
+    }
+
+    BEGIN_INSTRUCTION(handler, code)
+
+    // Move PC first, so we don't have to adjust jmp etc.
+    gb->cpu.pc += handler->length;
 
     // Emulate instruction
     unsigned int cycles = handler->emulate(code);
@@ -2114,36 +3719,1114 @@ static int cpu_step(int mcycles) {
   return mcycles;
 }
 
+// Interpreter which dispatches straight to the generated handlers.
+// With labels-as-values every handler does its own dispatch, so each gets its
+// own indirect branch; otherwise it falls back to a switch.
+#ifndef CPU_THREADED_DISPATCH
+#if defined(__GNUC__)
+#define CPU_THREADED_DISPATCH 1
+#else
+#define CPU_THREADED_DISPATCH 0
+#endif
+#endif
 
-static uint8_t u2_to_u8(unsigned int v) { 
-  // ab => abababab
-  // 00 => 00000000 = 0%
-  // 01 => 01010101 = 33%
-  // 10 => 10101010 = 66%
-  // 11 => 11111111 = 100%
-  assert(v <= 3);
-  return (v << 6) | (v << 4) | (v << 2) | v;
+#define FETCH_OPERANDS_1()
+#define FETCH_OPERANDS_2() \
+  code[1] = read_memory8(gb->cpu.pc + 1);
+#define FETCH_OPERANDS_3() \
+  code[1] = read_memory8(gb->cpu.pc + 1); \
+  code[2] = read_memory8(gb->cpu.pc + 2);
+
+#define EMULATE_OPCODE(name, length) \
+  FETCH_OPERANDS_ ## length() \
+  BEGIN_INSTRUCTION(&cpu_opcodes[code[0]], code) \
+  gb->cpu.pc += length; \
+  mcycles -= emulate_ ## name(code);
+
+static int cpu_step_threaded(int mcycles) {
+  uint8_t code[3];
+
+#if CPU_THREADED_DISPATCH
+
+#define OPCODE_LABEL(opcode, name, disassembler, length) [opcode] = &&label_ ## name,
+#define UNDEFINED_OPCODE_LABEL(opcode) [opcode] = &&label_undefined,
+  static const void* const labels[256] = {
+    CPU_OPCODES(OPCODE_LABEL)
+    CPU_UNDEFINED_OPCODES(UNDEFINED_OPCODE_LABEL)
+  };
+
+#define DISPATCH() \
+  if (mcycles <= 0) { \
+    return mcycles; \
+  } \
+  cpu_begin_instruction(); \
+  code[0] = read_memory8(gb->cpu.pc); \
+  goto *labels[code[0]];
+
+#define OPCODE_BODY(opcode, name, disassembler, length) \
+  label_ ## name: \
+    EMULATE_OPCODE(name, length) \
+    DISPATCH()
+
+  DISPATCH()
+  CPU_OPCODES(OPCODE_BODY)
+  label_undefined:
+    EMULATE_OPCODE(undefined, 1)
+    DISPATCH()
+
+#else
+
+#define OPCODE_CASE(opcode, name, disassembler, length) \
+  case opcode: \
+    EMULATE_OPCODE(name, length) \
+    break;
+#define UNDEFINED_OPCODE_CASE(opcode) \
+  case opcode:
+
+  while(mcycles > 0) {
+    cpu_begin_instruction();
+    code[0] = read_memory8(gb->cpu.pc);
+    switch(code[0]) {
+    CPU_OPCODES(OPCODE_CASE)
+    CPU_UNDEFINED_OPCODES(UNDEFINED_OPCODE_CASE)
+      EMULATE_OPCODE(undefined, 1)
+      break;
+    }
+  }
+  return mcycles;
+
+#endif
+}
+
+// Decoded block cache
+//
+// Blocks are straight-line runs of pre-decoded instructions, ending at the
+// first control flow instruction. They are keyed by ROM bank and address, so
+// blocks from a switchable bank stay valid while another bank is mapped.
+// Only ROM, work RAM and HRAM are cached; code anywhere else is decoded on
+// every execution.
+static bool is_block_end(uint8_t opcode) {
+  switch(opcode) {
+  case 0x10: // stop
+  case 0x76: // halt
+  case 0x18: case 0x20: case 0x28: case 0x30: case 0x38: // jr
+  case 0xC2: case 0xC3: case 0xCA: case 0xD2: case 0xDA: case 0xE9: // jp
+  case 0xC4: case 0xCC: case 0xCD: case 0xD4: case 0xDC: // call
+  case 0xC0: case 0xC8: case 0xC9: case 0xD0: case 0xD8: case 0xD9: // ret
+  case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF: // rst
+    return true;
+  default:
+    // Undefined instructions keep the PC where it is
+    return cpu_opcodes[opcode].emulate == emulate_undefined;
+  }
+}
+
+static bool is_cacheable(uint16_t address) {
+  return (address <= 0x7FFF) || (get_decoded_code_index(address) >= 0);
+}
+
+static unsigned int get_decoded_block_slot(unsigned int bank, uint16_t pc) {
+  return (pc ^ (pc >> 10) ^ (bank * 0x9E)) % DECODED_BLOCK_COUNT;
+}
+
+// Writes to work RAM pages holding decoded code take the slow path, so they can
+// invalidate the decoded blocks. HRAM always takes the slow path.
+static void protect_code_page(uint16_t address, bool protect) {
+  if ((address >= 0xC000) && (address <= 0xDFFF)) {
+    uint8_t* page = protect ? NULL : gb->read_pages[address >> 8];
+    gb->write_pages[address >> 8] = page;
+    if (address <= 0xDDFF) {
+      gb->write_pages[(address + 0x2000) >> 8] = page;
+    }
+  }
+}
+
+// Checks a work RAM page for decoded code
+static bool has_decoded_code(uint16_t page_address) {
+  const uint8_t* page_bitmap = &gb->decoded_code_bitmap[(page_address - 0xC000) / 8];
+  for(unsigned int i = 0; i < 0x100 / 8; i++) {
+    if (page_bitmap[i] != 0x00) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static void decode_block(DecodedBlock* block, unsigned int bank, uint16_t pc) {
+  block->valid = true;
+  block->bank = bank;
+  block->pc = pc;
+  block->count = 0;
+  block->executions = 0;
+  block->jit_failed = false;
+  block->jit = NULL;
+
+  // Blocks must not cross into another memory region or ROM bank
+  bool rom = (pc <= 0x7FFF);
+  uint16_t region_end = (pc <= 0x3FFF) ? 0x3FFF : (pc <= 0x7FFF) ? 0x7FFF : (pc <= 0xDFFF) ? 0xDFFF : 0xFFFE;
+
+  while(block->count < DECODED_BLOCK_LENGTH) {
+    uint8_t opcode = read_memory8(pc);
+    const InstructionHandler* handler = cpu_decode(opcode);
+    if ((pc + handler->length - 1) > region_end) {
+      break;
+    }
+
+    DecodedInstruction* instruction = &block->instructions[block->count++];
+    instruction->handler = handler;
+    instruction->pc = pc;
+    instruction->code[0] = opcode;
+    for(int i = 1; i < handler->length; i++) {
+      instruction->code[i] = read_memory8(pc + i);
+    }
+
+    // Remember where code was read from RAM
+    if (!rom) {
+      for(int i = 0; i < handler->length; i++) {
+        int code_index = get_decoded_code_index(pc + i);
+        gb->decoded_code_bitmap[code_index / 8] |= 1 << (code_index % 8);
+        protect_code_page(pc + i, true);
+      }
+    }
+
+    pc += handler->length;
+    if (is_block_end(opcode)) {
+      break;
+    }
+  }
+
+  block->end = pc;
+}
+
+static DecodedBlock* get_decoded_block(uint16_t pc) {
+  if (!is_cacheable(pc)) {
+    return NULL;
+  }
+
+  // Only HRAM is readable during OAM DMA
+  if (gb->dma_active && (pc < 0xFF80)) {
+    return NULL;
+  }
+
+  unsigned int bank = get_rom_bank_number(pc);
+  DecodedBlock* block = &gb->decoded_blocks[get_decoded_block_slot(bank, pc)];
+  if (block->valid && (block->pc == pc) && (block->bank == bank)) {
+    gb->decoded_block_hits++;
+    return block;
+  }
+
+  gb->decoded_block_misses++;
+  decode_block(block, bank, pc);
+  if (block->count == 0) {
+    block->valid = false;
+    return NULL;
+  }
+  return block;
+}
+
+static void invalidate_decoded_blocks(uint16_t address) {
+
+  // Writes are rare enough that we can simply look at every block
+  for(unsigned int i = 0; i < DECODED_BLOCK_COUNT; i++) {
+    DecodedBlock* block = &gb->decoded_blocks[i];
+    if (!block->valid || (block->pc <= 0x7FFF)) {
+      continue;
+    }
+    if ((address >= block->pc) && (address < block->end)) {
+      block->valid = false;
+      gb->decoded_block_invalidations++;
+    }
+  }
+
+  int code_index = get_decoded_code_index(address);
+  gb->decoded_code_bitmap[code_index / 8] &= ~(1 << (code_index % 8));
+  gb->decoded_block_epoch++;
+
+  // Let writes take the fast path again once a work RAM page holds no more code
+  if ((code_index < 0x2000) && !has_decoded_code(address & 0xFF00)) {
+    protect_code_page(address, false);
+  }
+}
+
+#if JIT
+static void reset_jit();
+#endif
+
+static void flush_decoded_blocks() {
+  memset(gb->decoded_blocks, 0x00, sizeof(gb->decoded_blocks));
+  memset(gb->decoded_code_bitmap, 0x00, sizeof(gb->decoded_code_bitmap));
+  gb->decoded_block_epoch++;
+  for(unsigned int address = 0xC000; address <= 0xDFFF; address += 0x100) {
+    protect_code_page(address, false);
+  }
+#if JIT
+  reset_jit();
+#endif
+}
+
+static void print_decoded_block_statistics() {
+  unsigned long lookups = gb->decoded_block_hits + gb->decoded_block_misses;
+  printf("Decoded blocks: %lu hits, %lu misses (%.2f%% hit rate), %lu invalidations, %lu uncached instructions\n",
+         gb->decoded_block_hits, gb->decoded_block_misses,
+         lookups ? (100.0 * gb->decoded_block_hits / lookups) : 0.0,
+         gb->decoded_block_invalidations, gb->decoded_block_uncached);
+}
+
+// Dynamic recompiler for hot ROM blocks (x86-64)
+//
+// Blocks from cartridge ROM which ran JIT_HOT_THRESHOLD times are translated
+// to native code. Simple register moves are emitted inline, everything else
+// becomes a direct call to the instruction handler, so the generated code
+// behaves exactly like the interpreter would.
+//
+// The generated code returns to the interpreter before any instruction which
+// would touch I/O ports, IE or the MBC registers (so it can not switch banks
+// or raise interrupts), and before instructions which change IME. The cycle
+// budget is checked after every instruction, the same way cpu_step() does.
+//
+// GB_JIT=on enables the recompiler, GB_JIT=diff additionally re-runs every
+// block in the interpreter and reports the first register divergence.
+#if JIT
+
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define JIT_HOT_THRESHOLD 32
+#define JIT_CODE_SIZE (4 * 1024 * 1024)
+#define JIT_BLOCK_CODE_SIZE (8 * 1024)
+
+typedef enum {
+  JIT_OFF,
+  JIT_ON,
+  JIT_DIFF
+} JitMode;
+
+static JitMode jit_mode = JIT_OFF;
+
+
+// Code being emitted
+typedef struct {
+  uint8_t buffer[JIT_BLOCK_CODE_SIZE];
+  size_t size;
+  bool overflow;
+
+  // Jumps to the shared epilogue which must be patched
+  size_t exits[4 * DECODED_BLOCK_LENGTH];
+  unsigned int exit_count;
+} JitEmitter;
+
+static void emit8(JitEmitter* e, uint8_t v) {
+  if (e->size >= sizeof(e->buffer)) {
+    e->overflow = true;
+    return;
+  }
+  e->buffer[e->size++] = v;
+}
+
+static void emit16(JitEmitter* e, uint16_t v) {
+  emit8(e, (v >> 0) & 0xFF);
+  emit8(e, (v >> 8) & 0xFF);
+}
+
+static void emit32(JitEmitter* e, uint32_t v) {
+  emit16(e, (v >> 0) & 0xFFFF);
+  emit16(e, (v >> 16) & 0xFFFF);
+}
+
+static void emit64(JitEmitter* e, uint64_t v) {
+  emit32(e, (v >> 0) & 0xFFFFFFFF);
+  emit32(e, (v >> 32) & 0xFFFFFFFF);
+}
+
+// Emits a rel32 jump (0x0F 0x8x for conditional, 0xE9 otherwise), returns the patch location
+#define X86_JMP 0x00
+#define X86_JB  0x82
+#define X86_JAE 0x83
+#define X86_JE  0x84
+#define X86_JG  0x8F
+static size_t emit_jump(JitEmitter* e, uint8_t condition) {
+  if (condition == X86_JMP) {
+    emit8(e, 0xE9);
+  } else {
+    emit8(e, 0x0F);
+    emit8(e, condition);
+  }
+  size_t at = e->size;
+  emit32(e, 0);
+  return at;
+}
+
+static void patch_jump(JitEmitter* e, size_t at, size_t target) {
+  if (e->overflow) {
+    return;
+  }
+  uint32_t rel = (uint32_t)(target - (at + 4));
+  memcpy(&e->buffer[at], &rel, 4);
+}
+
+// Register access relative to rbx, which points at the CPU registers
+#define JIT_OFFSET(field) ((uint8_t)offsetof(Registers, field))
+static const uint8_t jit_x8_offsets[8] = {
+  JIT_OFFSET(b), JIT_OFFSET(c), JIT_OFFSET(d), JIT_OFFSET(e),
+  JIT_OFFSET(h), JIT_OFFSET(l), 0xFF, JIT_OFFSET(a)
+};
+static const uint8_t jit_x16_offsets[4] = {
+  JIT_OFFSET(bc), JIT_OFFSET(de), JIT_OFFSET(hl), JIT_OFFSET(sp)
+};
+
+static void emit_store_pc(JitEmitter* e, uint16_t pc) {
+  // mov word [rbx+pc], imm16
+  emit8(e, 0x66); emit8(e, 0xC7); emit8(e, 0x43); emit8(e, JIT_OFFSET(pc));
+  emit16(e, pc);
+}
+
+// Leave the block; the cycle budget is returned by the epilogue
+static void emit_exit(JitEmitter* e) {
+  assert(e->exit_count < ARRAY_SIZE(e->exits));
+  e->exits[e->exit_count++] = emit_jump(e, X86_JMP);
+}
+
+// Leave the block before an instruction, so the interpreter runs it
+static void emit_bailout(JitEmitter* e, uint16_t pc) {
+  emit_store_pc(e, pc);
+  // mov rax, &jit_bailouts; inc qword [rax]
+  emit8(e, 0x48); emit8(e, 0xB8); emit64(e, (uint64_t)(uintptr_t)&gb->jit_bailouts);
+  emit8(e, 0x48); emit8(e, 0xFF); emit8(e, 0x00);
+  emit_exit(e);
+}
+
+static bool jit_is_safe_address(uint16_t address, bool write) {
+  if ((address >= 0xFF00) && (address <= 0xFF7F)) {
+    return false; // I/O ports
+  }
+  if (address == 0xFFFF) {
+    return false; // Interrupt enable
+  }
+  if (write && (address <= 0x7FFF)) {
+    return false; // MBC registers
+  }
+  return true;
+}
+
+// Checks the address in eax; bails out if jit_is_safe_address() would fail
+static void emit_address_guard(JitEmitter* e, uint16_t pc, bool write) {
+  size_t bail[3];
+  unsigned int bail_count = 0;
+
+  // lea ecx, [rax-0xFF00]; cmp ecx, 0x80; jb bail
+  emit8(e, 0x8D); emit8(e, 0x88); emit32(e, (uint32_t)-0xFF00);
+  emit8(e, 0x81); emit8(e, 0xF9); emit32(e, 0x80);
+  bail[bail_count++] = emit_jump(e, X86_JB);
+
+  // cmp eax, 0xFFFF; je bail
+  emit8(e, 0x3D); emit32(e, 0xFFFF);
+  bail[bail_count++] = emit_jump(e, X86_JE);
+
+  if (write) {
+    // cmp eax, 0x8000; jb bail
+    emit8(e, 0x3D); emit32(e, 0x8000);
+    bail[bail_count++] = emit_jump(e, X86_JB);
+  }
+
+  size_t ok = emit_jump(e, X86_JMP);
+  for(unsigned int i = 0; i < bail_count; i++) {
+    patch_jump(e, bail[i], e->size);
+  }
+  emit_bailout(e, pc);
+  patch_jump(e, ok, e->size);
+}
+
+static void emit_x16_guard(JitEmitter* e, uint16_t pc, uint8_t x16_offset, bool write) {
+  // movzx eax, word [rbx+x16]
+  emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0x43); emit8(e, x16_offset);
+  emit_address_guard(e, pc, write);
+}
+
+static void emit_c_guard(JitEmitter* e, uint16_t pc, bool write) {
+  // movzx eax, byte [rbx+c]; add eax, 0xFF00
+  emit8(e, 0x0F); emit8(e, 0xB6); emit8(e, 0x43); emit8(e, JIT_OFFSET(c));
+  emit8(e, 0x05); emit32(e, 0xFF00);
+  emit_address_guard(e, pc, write);
+}
+
+// The stack must be in work RAM or HRAM, so push and pop never reach I/O
+static void emit_stack_guard(JitEmitter* e, uint16_t pc) {
+  // movzx eax, word [rbx+sp]
+  emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0x43); emit8(e, JIT_OFFSET(sp));
+
+  // lea ecx, [rax-0xC002]; cmp ecx, 0x1FFE; jb ok
+  emit8(e, 0x8D); emit8(e, 0x88); emit32(e, (uint32_t)-0xC002);
+  emit8(e, 0x81); emit8(e, 0xF9); emit32(e, 0x1FFE);
+  size_t ok_wram = emit_jump(e, X86_JB);
+
+  // lea ecx, [rax-0xFF82]; cmp ecx, 0x7C; jb ok
+  emit8(e, 0x8D); emit8(e, 0x88); emit32(e, (uint32_t)-0xFF82);
+  emit8(e, 0x81); emit8(e, 0xF9); emit32(e, 0x7C);
+  size_t ok_hram = emit_jump(e, X86_JB);
+
+  emit_bailout(e, pc);
+  patch_jump(e, ok_wram, e->size);
+  patch_jump(e, ok_hram, e->size);
+}
+
+static void emit_handler_call(JitEmitter* e, DecodedInstruction* instruction) {
+
+  // Handlers expect the PC to point at the next instruction
+  emit_store_pc(e, instruction->pc + instruction->handler->length);
+
+  // mov rdi, code; mov rax, emulate; call rax
+  emit8(e, 0x48); emit8(e, 0xBF); emit64(e, (uint64_t)(uintptr_t)instruction->code);
+  emit8(e, 0x48); emit8(e, 0xB8); emit64(e, (uint64_t)(uintptr_t)instruction->handler->emulate);
+  emit8(e, 0xFF); emit8(e, 0xD0);
+
+  // sub r12d, eax
+  emit8(e, 0x41); emit8(e, 0x29); emit8(e, 0xC4);
+}
+
+static void emit_cycles(JitEmitter* e, unsigned int cycles) {
+  // sub r12d, imm32
+  emit8(e, 0x41); emit8(e, 0x81); emit8(e, 0xEC); emit32(e, cycles);
+}
+
+static bool is_stack_opcode(uint8_t opcode) {
+  switch(opcode) {
+  case 0xC0: case 0xC8: case 0xD0: case 0xD8: case 0xC9: // ret
+  case 0xC1: case 0xD1: case 0xE1: case 0xF1: // pop
+  case 0xC5: case 0xD5: case 0xE5: case 0xF5: // push
+  case 0xC4: case 0xCC: case 0xD4: case 0xDC: case 0xCD: // call
+  case 0xC7: case 0xCF: case 0xD7: case 0xDF: case 0xE7: case 0xEF: case 0xF7: case 0xFF: // rst
+    return true;
+  default:
+    return false;
+  }
+}
+
+// Emits one instruction, returns false if it must be left to the interpreter
+static bool emit_instruction(JitEmitter* e, DecodedInstruction* instruction, bool* pc_written) {
+  uint8_t* code = instruction->code;
+  uint8_t opcode = code[0];
+  uint16_t pc = instruction->pc;
+  uint16_t next_pc = pc + instruction->handler->length;
+  *pc_written = false;
+
+  // Instructions which change IME or stop the CPU
+  if ((opcode == 0x10) || (opcode == 0x76) || (opcode == 0xD9) ||
+      (opcode == 0xF3) || (opcode == 0xFB) ||
+      (instruction->handler->emulate == emulate_undefined)) {
+    return false;
+  }
+
+  // nop
+  if (opcode == 0x00) {
+    emit_cycles(e, 4);
+    return true;
+  }
+
+  // ld r, r'
+  if ((opcode >= 0x40) && (opcode <= 0x7F) && ((opcode & 7) != X8_hl) && (((opcode >> 3) & 7) != X8_hl)) {
+    // mov al, [rbx+src]; mov [rbx+dst], al
+    emit8(e, 0x8A); emit8(e, 0x43); emit8(e, jit_x8_offsets[opcode & 7]);
+    emit8(e, 0x88); emit8(e, 0x43); emit8(e, jit_x8_offsets[(opcode >> 3) & 7]);
+    emit_cycles(e, 4);
+    return true;
+  }
+
+  // ld r, d8
+  if (((opcode & 0xC7) == 0x06) && (((opcode >> 3) & 7) != X8_hl)) {
+    // mov byte [rbx+dst], imm8
+    emit8(e, 0xC6); emit8(e, 0x43); emit8(e, jit_x8_offsets[(opcode >> 3) & 7]); emit8(e, code[1]);
+    emit_cycles(e, 8);
+    return true;
+  }
+
+  // ld rr, d16
+  if ((opcode & 0xCF) == 0x01) {
+    // mov word [rbx+dst], imm16
+    emit8(e, 0x66); emit8(e, 0xC7); emit8(e, 0x43); emit8(e, jit_x16_offsets[(opcode >> 4) & 3]);
+    emit16(e, (code[2] << 8) | code[1]);
+    emit_cycles(e, 12);
+    return true;
+  }
+
+  // inc rr / dec rr
+  if (((opcode & 0xCF) == 0x03) || ((opcode & 0xCF) == 0x0B)) {
+    // add/sub word [rbx+dst], 1
+    emit8(e, 0x66); emit8(e, 0x83); emit8(e, ((opcode & 0xCF) == 0x03) ? 0x43 : 0x6B);
+    emit8(e, jit_x16_offsets[(opcode >> 4) & 3]); emit8(e, 0x01);
+    emit_cycles(e, 8);
+    return true;
+  }
+
+  // ld sp, hl
+  if (opcode == 0xF9) {
+    // movzx eax, word [rbx+hl]; mov [rbx+sp], ax
+    emit8(e, 0x0F); emit8(e, 0xB7); emit8(e, 0x43); emit8(e, JIT_OFFSET(hl));
+    emit8(e, 0x66); emit8(e, 0x89); emit8(e, 0x43); emit8(e, JIT_OFFSET(sp));
+    emit_cycles(e, 8);
+    return true;
+  }
+
+  // jp a16 (backward jumps may be idle loops, so they use the handler)
+  if ((opcode == 0xC3) && (((code[2] << 8) | code[1]) >= next_pc)) {
+    emit_store_pc(e, (code[2] << 8) | code[1]);
+    *pc_written = true;
+    emit_cycles(e, 16);
+    return true;
+  }
+
+  // jr r8
+  if ((opcode == 0x18) && ((int8_t)code[1] >= 0)) {
+    emit_store_pc(e, next_pc + (int8_t)code[1]);
+    *pc_written = true;
+    emit_cycles(e, 12);
+    return true;
+  }
+
+  // Everything else calls the handler, after checking memory accesses
+  if (opcode == 0xCB) {
+    if ((code[1] & 7) == X8_hl) {
+      bool bit = (code[1] >= 0x40) && (code[1] <= 0x7F);
+      emit_x16_guard(e, pc, JIT_OFFSET(hl), !bit);
+    }
+  } else if (is_stack_opcode(opcode)) {
+    emit_stack_guard(e, pc);
+  } else if ((opcode >= 0x40) && (opcode <= 0xBF)) {
+    if ((opcode & 7) == X8_hl) {
+      emit_x16_guard(e, pc, JIT_OFFSET(hl), false);
+    }
+    if ((opcode <= 0x7F) && (((opcode >> 3) & 7) == X8_hl)) {
+      emit_x16_guard(e, pc, JIT_OFFSET(hl), true);
+    }
+  } else {
+    uint16_t a16 = (code[2] << 8) | code[1];
+    switch(opcode) {
+    case 0x02: emit_x16_guard(e, pc, JIT_OFFSET(bc), true); break;
+    case 0x0A: emit_x16_guard(e, pc, JIT_OFFSET(bc), false); break;
+    case 0x12: emit_x16_guard(e, pc, JIT_OFFSET(de), true); break;
+    case 0x1A: emit_x16_guard(e, pc, JIT_OFFSET(de), false); break;
+    case 0x22: case 0x32: case 0x34: case 0x35: case 0x36:
+      emit_x16_guard(e, pc, JIT_OFFSET(hl), true);
+      break;
+    case 0x2A: case 0x3A:
+      emit_x16_guard(e, pc, JIT_OFFSET(hl), false);
+      break;
+    case 0xE2: emit_c_guard(e, pc, true); break;
+    case 0xF2: emit_c_guard(e, pc, false); break;
+    case 0x08:
+      if (!jit_is_safe_address(a16, true) || !jit_is_safe_address(a16 + 1, true)) {
+        return false;
+      }
+      break;
+    case 0xEA:
+      if (!jit_is_safe_address(a16, true)) {
+        return false;
+      }
+      break;
+    case 0xFA:
+      if (!jit_is_safe_address(a16, false)) {
+        return false;
+      }
+      break;
+    case 0xE0:
+      if (!jit_is_safe_address(0xFF00 + code[1], true)) {
+        return false;
+      }
+      break;
+    case 0xF0:
+      if (!jit_is_safe_address(0xFF00 + code[1], false)) {
+        return false;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+
+  emit_handler_call(e, instruction);
+  *pc_written = true;
+  return true;
+}
+
+static void reset_jit() {
+  gb->jit_code_used = 0;
+}
+
+static bool compile_block(DecodedBlock* block) {
+
+  // Allocate code memory once
+  if (gb->jit_code == NULL) {
+    void* memory = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (memory == MAP_FAILED) {
+      fprintf(stderr, "Could not allocate JIT code memory\n");
+      jit_mode = JIT_OFF;
+      return false;
+    }
+    gb->jit_code = memory;
+  }
+
+  static __thread JitEmitter emitter;
+  JitEmitter* e = &emitter;
+  e->size = 0;
+  e->overflow = false;
+  e->exit_count = 0;
+
+  // Prologue: int block(Registers* registers, int mcycles)
+  emit8(e, 0x53);                                 // push rbx
+  emit8(e, 0x41); emit8(e, 0x54);                 // push r12
+  emit8(e, 0x48); emit8(e, 0x83); emit8(e, 0xEC); emit8(e, 0x08); // sub rsp, 8
+  emit8(e, 0x48); emit8(e, 0x89); emit8(e, 0xFB); // mov rbx, rdi
+  emit8(e, 0x41); emit8(e, 0x89); emit8(e, 0xF4); // mov r12d, esi
+
+  unsigned int count = 0;
+  for(unsigned int i = 0; i < block->count; i++) {
+    DecodedInstruction* instruction = &block->instructions[i];
+    bool pc_written;
+    size_t size = e->size;
+    unsigned int exit_count = e->exit_count;
+    if (!emit_instruction(e, instruction, &pc_written)) {
+      e->size = size;
+      e->exit_count = exit_count;
+      break;
+    }
+    count++;
+
+    uint16_t next_pc = instruction->pc + instruction->handler->length;
+    bool last = (i + 1 == block->count);
+    if (last) {
+      if (!pc_written) {
+        emit_store_pc(e, next_pc);
+      }
+      emit_exit(e);
+    } else {
+
+      // Stop once the budget is used up, like cpu_step() does
+      size_t next = emit_jump(e, X86_JG);
+      if (!pc_written) {
+        emit_store_pc(e, next_pc);
+      }
+      emit_exit(e);
+      patch_jump(e, next, e->size);
+    }
+  }
+
+  // The first untranslated instruction is left to the interpreter
+  if (count < block->count) {
+    emit_store_pc(e, block->instructions[count].pc);
+    emit_exit(e);
+  }
+
+  // Epilogue
+  size_t epilogue = e->size;
+  emit8(e, 0x44); emit8(e, 0x89); emit8(e, 0xE0); // mov eax, r12d
+  emit8(e, 0x48); emit8(e, 0x83); emit8(e, 0xC4); emit8(e, 0x08); // add rsp, 8
+  emit8(e, 0x41); emit8(e, 0x5C);                 // pop r12
+  emit8(e, 0x5B);                                 // pop rbx
+  emit8(e, 0xC3);                                 // ret
+  for(unsigned int i = 0; i < e->exit_count; i++) {
+    patch_jump(e, e->exits[i], epilogue);
+  }
+
+  if ((count == 0) || e->overflow) {
+    gb->jit_failed_blocks++;
+    return false;
+  }
+
+  // Start over if the code memory is full
+  if (gb->jit_code_used + e->size > JIT_CODE_SIZE) {
+    for(unsigned int i = 0; i < DECODED_BLOCK_COUNT; i++) {
+      gb->decoded_blocks[i].jit = NULL;
+    }
+    reset_jit();
+  }
+
+  // Copy code into executable memory
+  uint8_t* function = &gb->jit_code[gb->jit_code_used];
+  mprotect(gb->jit_code, JIT_CODE_SIZE, PROT_READ | PROT_WRITE);
+  memcpy(function, e->buffer, e->size);
+  mprotect(gb->jit_code, JIT_CODE_SIZE, PROT_READ | PROT_EXEC);
+  gb->jit_code_used += (e->size + 15) & ~15;
+
+  block->jit = (JitFunction)function;
+  gb->jit_compiled_blocks++;
+  return true;
+}
+
+// Memory which can be changed by a block, for the differential mode
+typedef struct {
+  Registers cpu;
+  uint8_t vram_memory[sizeof(gb->video.vram_memory)];
+  uint8_t cartridge_ram_memory[sizeof(gb->cartridge_ram_memory)];
+  uint8_t wram0_memory[sizeof(gb->wram0_memory)];
+  uint8_t wram1_memory[sizeof(gb->wram1_memory)];
+  uint8_t oam_memory[sizeof(gb->video.oam_memory)];
+  uint8_t hram_memory[sizeof(gb->hram_memory)];
+
+  // Idle loop detection
+  bool idle_loop_valid;
+  Registers idle_loop_cpu;
+  bool idle_loop_ime;
+  bool idle_memory_written;
+  IdleLoop* idle_loop;
+} JitSnapshot;
+
+static void save_jit_snapshot(JitSnapshot* snapshot) {
+  snapshot->cpu = gb->cpu;
+  memcpy(snapshot->vram_memory, gb->video.vram_memory, sizeof(gb->video.vram_memory));
+  memcpy(snapshot->cartridge_ram_memory, gb->cartridge_ram_memory, gb->cartridge_ram_size);
+  memcpy(snapshot->wram0_memory, gb->wram0_memory, sizeof(gb->wram0_memory));
+  memcpy(snapshot->wram1_memory, gb->wram1_memory, sizeof(gb->wram1_memory));
+  memcpy(snapshot->oam_memory, gb->video.oam_memory, sizeof(gb->video.oam_memory));
+  memcpy(snapshot->hram_memory, gb->hram_memory, sizeof(gb->hram_memory));
+  snapshot->idle_loop_valid = gb->idle_loop_valid;
+  snapshot->idle_loop_cpu = gb->idle_loop_cpu;
+  snapshot->idle_loop_ime = gb->idle_loop_ime;
+  snapshot->idle_memory_written = gb->idle_memory_written;
+  snapshot->idle_loop = gb->idle_loop;
+}
+
+static void load_jit_snapshot(const JitSnapshot* snapshot) {
+  gb->cpu = snapshot->cpu;
+  memcpy(gb->video.vram_memory, snapshot->vram_memory, sizeof(gb->video.vram_memory));
+  decode_tiles(&gb->video, 0, sizeof(gb->video.vram_memory));
+  mark_vram_dirty(0, sizeof(gb->video.vram_memory));
+  memcpy(gb->cartridge_ram_memory, snapshot->cartridge_ram_memory, gb->cartridge_ram_size);
+  memcpy(gb->wram0_memory, snapshot->wram0_memory, sizeof(gb->wram0_memory));
+  memcpy(gb->wram1_memory, snapshot->wram1_memory, sizeof(gb->wram1_memory));
+  memcpy(gb->video.oam_memory, snapshot->oam_memory, sizeof(gb->video.oam_memory));
+  gb->video.oam_index_valid = false;
+  gb->oam_dirty = true;
+  memcpy(gb->hram_memory, snapshot->hram_memory, sizeof(gb->hram_memory));
+  gb->idle_loop_valid = snapshot->idle_loop_valid;
+  gb->idle_loop_cpu = snapshot->idle_loop_cpu;
+  gb->idle_loop_ime = snapshot->idle_loop_ime;
+  gb->idle_memory_written = snapshot->idle_memory_written;
+  gb->idle_loop = snapshot->idle_loop;
+}
+
+static void print_jit_registers(const char* name, const Registers* registers) {
+  fprintf(stderr, "  %-11s A: %02X F: %02X B: %02X C: %02X D: %02X E: %02X H: %02X L: %02X SP: %04X PC: %04X\n",
+          name, registers->a, registers->af & 0xFF, registers->b, registers->c, registers->d,
+          registers->e, registers->h, registers->l, registers->sp, registers->pc);
+}
+
+// Runs the block natively, then again in the interpreter, and compares
+static int run_jit_block_diff(DecodedBlock* block, int mcycles) {
+  static __thread JitSnapshot before;
+  materialize_flags();
+  save_jit_snapshot(&before);
+
+  int jit_mcycles = block->jit(&gb->cpu, mcycles);
+  materialize_flags();
+  Registers jit_cpu = gb->cpu;
+
+  load_jit_snapshot(&before);
+  int interpreter_mcycles = mcycles;
+  unsigned int executed = 0;
+  for(unsigned int i = 0; i < block->count; i++) {
+    DecodedInstruction* instruction = &block->instructions[i];
+    if ((interpreter_mcycles <= jit_mcycles) || (instruction->pc != gb->cpu.pc)) {
+      break;
+    }
+    if (i > 0) {
+      cpu_begin_instruction();
+    }
+    gb->cpu.pc += instruction->handler->length;
+    interpreter_mcycles -= instruction->handler->emulate(instruction->code);
+    executed++;
+  }
+  materialize_flags();
+
+  if ((interpreter_mcycles != jit_mcycles) || memcmp(&gb->cpu, &jit_cpu, sizeof(gb->cpu))) {
+    if (gb->jit_divergences == 0) {
+      fprintf(stderr, "JIT diverged in block %02X:%04X after %u instructions (%d vs %d cycles left)\n",
+              block->bank, block->pc, executed, jit_mcycles, interpreter_mcycles);
+      print_jit_registers("before", &before.cpu);
+      print_jit_registers("jit", &jit_cpu);
+      print_jit_registers("interpreter", &gb->cpu);
+    }
+    gb->jit_divergences++;
+
+    // Keep the interpreter result and stop using this block
+    block->jit = NULL;
+    block->jit_failed = true;
+  }
+  return interpreter_mcycles;
+}
+
+static int run_jit_block(DecodedBlock* block, int mcycles) {
+  gb->jit_executions++;
+  if (jit_mode == JIT_DIFF) {
+    return run_jit_block_diff(block, mcycles);
+  }
+  return block->jit(&gb->cpu, mcycles);
+}
+
+static void select_jit_mode() {
+  const char* mode = getenv("GB_JIT");
+  if (mode == NULL) {
+    return;
+  }
+  if (!strcmp(mode, "on")) {
+    jit_mode = JIT_ON;
+  } else if (!strcmp(mode, "diff")) {
+    jit_mode = JIT_DIFF;
+  } else if (!strcmp(mode, "off")) {
+    jit_mode = JIT_OFF;
+  } else {
+    fprintf(stderr, "Unknown JIT mode '%s'\n", mode);
+    return;
+  }
+  printf("JIT mode: %s\n", mode);
+}
+
+static void print_jit_statistics() {
+  printf("JIT: %lu blocks compiled, %lu not compilable, %lu executions, %lu bailouts, %lu divergences, %zu bytes of code\n",
+         gb->jit_compiled_blocks, gb->jit_failed_blocks, gb->jit_executions, gb->jit_bailouts, gb->jit_divergences, gb->jit_code_used);
+}
+
+#endif
+
+// Interpreter which runs pre-decoded blocks
+static int cpu_step_cached(int mcycles) {
+  DecodedBlock* block = gb->decoded_block;
+  unsigned int index = gb->decoded_block_index;
+  unsigned int epoch = gb->decoded_block_current_epoch;
+
+  while(mcycles > 0) {
+
+    cpu_begin_instruction();
+
+    // Continue in the current block, unless we jumped, got interrupted, or
+    // the block became stale
+    if ((block == NULL) || (index >= block->count) || (epoch != gb->decoded_block_epoch) ||
+        (block->instructions[index].pc != gb->cpu.pc)) {
+      block = get_decoded_block(gb->cpu.pc);
+      index = 0;
+      epoch = gb->decoded_block_epoch;
+    }
+
+    if (block == NULL) {
+
+      // Decode instruction from uncached memory
+      uint8_t code[3];
+      code[0] = read_memory8(gb->cpu.pc);
+      const InstructionHandler* handler = cpu_decode(code[0]);
+      for(int i = 1; i < handler->length; i++) {
+        code[i] = read_memory8(gb->cpu.pc + i);
+      }
+      BEGIN_INSTRUCTION(handler, code)
+      gb->cpu.pc += handler->length;
+      mcycles -= handler->emulate(code);
+      gb->decoded_block_uncached++;
+      continue;
+    }
+
+#if JIT
+    // Run hot ROM blocks natively (unless every instruction has to be traced)
+    if ((index == 0) && (jit_mode != JIT_OFF) && (block->pc <= 0x7FFF) && !block->jit_failed && !TRACE_ENABLED()) {
+      if ((block->jit == NULL) && (++block->executions >= JIT_HOT_THRESHOLD)) {
+        block->jit_failed = !compile_block(block);
+      }
+      if (block->jit != NULL) {
+        int jit_mcycles = run_jit_block(block, mcycles);
+
+        // Continue in the interpreter unless the first instruction bailed out
+        if ((jit_mcycles != mcycles) || (gb->cpu.pc != block->pc)) {
+          mcycles = jit_mcycles;
+          while((index < block->count) && (block->instructions[index].pc != gb->cpu.pc)) {
+            index++;
+          }
+          continue;
+        }
+      }
+    }
+#endif
+
+    DecodedInstruction* instruction = &block->instructions[index++];
+    BEGIN_INSTRUCTION(instruction->handler, instruction->code)
+    gb->cpu.pc += instruction->handler->length;
+    mcycles -= instruction->handler->emulate(instruction->code);
+  }
+
+  gb->decoded_block = block;
+  gb->decoded_block_index = index;
+  gb->decoded_block_current_epoch = epoch;
+  return mcycles;
+}
+
+typedef enum {
+  CPU_ENGINE_TABLE,
+  CPU_ENGINE_THREADED,
+  CPU_ENGINE_CACHED
+} CpuEngine;
+
+static CpuEngine cpu_engine = CPU_ENGINE_THREADED;
+
+static void select_cpu_engine() {
+
+#if JIT
+  // The recompiler runs blocks from the cache
+  select_jit_mode();
+  if (jit_mode != JIT_OFF) {
+    cpu_engine = CPU_ENGINE_CACHED;
+  }
+#endif
+
+  const char* engine = getenv("GB_CPU_ENGINE");
+  if (engine == NULL) {
+    return;
+  }
+  if (!strcmp(engine, "table")) {
+    cpu_engine = CPU_ENGINE_TABLE;
+  } else if (!strcmp(engine, "threaded")) {
+    cpu_engine = CPU_ENGINE_THREADED;
+  } else if (!strcmp(engine, "cached")) {
+    cpu_engine = CPU_ENGINE_CACHED;
+  } else {
+    fprintf(stderr, "Unknown CPU engine '%s'\n", engine);
+    return;
+  }
+  printf("Using %s CPU engine\n", engine);
+}
+
+static int cpu_step_engine(int mcycles) {
+  switch(cpu_engine) {
+  case CPU_ENGINE_THREADED:
+    return cpu_step_threaded(mcycles);
+  case CPU_ENGINE_CACHED:
+    return cpu_step_cached(mcycles);
+  default:
+    return cpu_step_table(mcycles);
+  }
+}
+
+// Time of the current instruction, for I/O handlers
+static uint64_t get_current_cycle() {
+  return gb->step_end - gb->step_mcycles;
+}
+
+static int cpu_step(int mcycles) {
+
+  // Sleep until the next event, unless an interrupt woke us up
+  if (gb->halted) {
+    if (!is_interrupt_pending()) {
+      gb->halt_skipped_cycles += mcycles;
+      return 0;
+    }
+    gb->halted = false;
+  }
+
+  // Keep track of time for I/O handlers and the trace
+  gb->step_end = gb->cycle_counter + mcycles;
+
+  mcycles = cpu_step_engine(mcycles);
+
+  // Fast-forward to the end of the budget if the CPU was halted or is idling
+  if (gb->halted) {
+    gb->halt_skipped_cycles += mcycles + SKIP_CYCLES;
+    mcycles = 0;
+  } else if (gb->idle_loop != NULL) {
+    gb->idle_loop->skipped_cycles += mcycles + SKIP_CYCLES;
+    gb->idle_loop = NULL;
+    mcycles = 0;
+  }
+  return mcycles;
+}
+
+// Event scheduler
+//
+// Hardware events are kept in a small priority queue, ordered by the cycle
+// they are due at. The CPU runs uninterrupted until the next event; if it
+// overshoots, the event is handled late, but later events keep their timing.
+static bool is_event_before(const Event* a, const Event* b) {
+  if (a->cycle != b->cycle) {
+    return a->cycle < b->cycle;
+  }
+  return (int)(a->sequence - b->sequence) < 0;
+}
+
+static void swap_events(unsigned int a, unsigned int b) {
+  Event event = gb->event_queue[a];
+  gb->event_queue[a] = gb->event_queue[b];
+  gb->event_queue[b] = event;
 }
+
+static void schedule_event(EventType type, uint64_t cycle) {
+  assert(gb->event_count < EVENT_QUEUE_SIZE);
+  unsigned int index = gb->event_count++;
+  gb->event_queue[index].cycle = cycle;
+  gb->event_queue[index].sequence = gb->event_sequence++;
+  gb->event_queue[index].type = type;
+
+  // Move up to keep the earliest event first
+  while(index > 0) {
+    unsigned int parent = (index - 1) / 2;
+    if (!is_event_before(&gb->event_queue[index], &gb->event_queue[parent])) {
+      break;
+    }
+    swap_events(index, parent);
+    index = parent;
+  }
+}
+
+static Event pop_event() {
+  assert(gb->event_count > 0);
+  Event event = gb->event_queue[0];
+  gb->event_queue[0] = gb->event_queue[--gb->event_count];
+
+  // Move down to keep the earliest event first
+  unsigned int index = 0;
+  while(true) {
+    unsigned int first = index;
+    unsigned int left = index * 2 + 1;
+    unsigned int right = index * 2 + 2;
+    if ((left < gb->event_count) && is_event_before(&gb->event_queue[left], &gb->event_queue[first])) {
+      first = left;
+    }
+    if ((right < gb->event_count) && is_event_before(&gb->event_queue[right], &gb->event_queue[first])) {
+      first = right;
+    }
+    if (first == index) {
+      break;
+    }
+    swap_events(index, first);
+    index = first;
+  }
+
+  return event;
+}
+
+static void handle_event(const Event* event);
+
+// Runs the CPU until the next event is due, then handles it
+static void run_next_event() {
+  uint64_t cycle = gb->event_queue[0].cycle;
+  if (cycle > gb->cycle_counter) {
+    int mcycles = cpu_step(cycle - gb->cycle_counter);
+    gb->cycle_counter = cycle - mcycles;
+
+    // Between steps, get_current_cycle() is the cycle counter
+    gb->step_end = gb->cycle_counter;
+    gb->step_mcycles = 0;
+  }
+
+  // I/O registers may change
+  gb->idle_loop_valid = false;
+
+  Event event = pop_event();
+  handle_event(&event);
+}
+
 static unsigned int u8_to_u2(uint8_t v) {
   return v >> 6;
 }
 
-uint8_t get_palette_color(uint16_t palette_register, unsigned int palette_index) {
- 
-  // Read palette and get color
-  // Bit 7-6 - Shade for Color Number 3
-  // Bit 5-4 - Shade for Color Number 2
-  // Bit 3-2 - Shade for Color Number 1
-  // Bit 1-0 - Shade for Color Number 0 
-  assert(palette_index <= 3);
-  uint8_t palette = read_io8(palette_register);
-  uint8_t palette_color = (palette >> (2 * palette_index)) & 0x3;
-  
-  // Remap color (0 = white, 3 = black)
-  return 3 - palette_color;
-
+// Framebuffer intensity of the 4 colors of BGP, OBP0 or OBP1
+static const uint8_t* get_palette_shades(uint16_t palette_register) {
+  assert((palette_register >= BGP) && (palette_register <= OBP1));
+  return gb->palette_shades[palette_register - BGP];
 }
-      
+
 static void draw_tile_line(uint8_t* image, unsigned w, unsigned int h, int x, int y, uint16_t address, int __dx, int dy, uint16_t palette_register, bool flip_x, bool flip_y) {
 
   //FIXME: Unsupported    
@@ -2153,86 +4836,162 @@ static void draw_tile_line(uint8_t* image, unsigned w, unsigned int h, int x, in
   if (dy < 0) { return; }
   if (dy >= 8) { return; }
 
+  // Check image bounds
+  if ((y < 0) || (y >= h)) { return; }
+  int start = (x < 0) ? -x : 0;
+  int end = (x + 8 > (int)w) ? ((int)w - x) : 8;
+  if (start >= end) { return; }
+
   // Handle mirroring
   int tile_y = flip_y ? (7 - dy) : dy;
     
-  // Read tile row from memory
-  unsigned int row_offset = tile_y * 2;
-  uint8_t low_byte = read_memory8(address + row_offset + 0);
-  uint8_t high_byte = read_memory8(address + row_offset + 1);
-    
-  for(unsigned int dx = 0; dx < 8; dx++) {
-        
-    // Handle mirroring
-    int tile_x = flip_x ? dx : (7 - dx);
-       
-    // Construct palette index
-    unsigned int low_bit = (low_byte >> tile_x) & 1;
-    unsigned int high_bit = (high_byte >> tile_x) & 1;
-    unsigned int palette_index = (high_bit << 1) | low_bit;
-    
-    // Skip color 0:  
-    // - For background: already drawn
-    // - For sprites: transparent
-    if (palette_index == 0) {
-      continue;
-    }    
-      
-    // Get coordinates in image
-    int image_x = x + dx;
-    int image_y = y;
-      
-    // Check bounds
-    if (image_x < 0) { continue; }
-    if (image_y < 0) { continue; }
-    if (image_x >= w) { continue; }
-    if (image_y >= h) { continue; }
-     
-    // Lookup color from palette
-    uint8_t color = get_palette_color(palette_register, palette_index);  
-      
-    // Write color to image buffer
-    unsigned int image_pixel_index = image_y * w + image_x;
-    image[image_pixel_index] = u2_to_u8(color);
-      
+  // Read tile row from the tile cache
+  const uint8_t* pixels = get_tile_row(&gb->video, address, tile_y, flip_x);
+
+  // Write colors to image buffer, color 0 is transparent
+  compose_pixels(&image[y * w + x + start], &pixels[start], end - start, get_palette_shades(palette_register), true);
+}
+
+static void draw_tile(uint8_t* image, unsigned w, unsigned int h, int x, int y, uint16_t address, uint16_t palette_register, bool flip_x, bool flip_y) {
+  // Each tile is sized 8x8 pixels and has a color depth of 4 colors/gray shades
+  for(unsigned int dy = 0; dy < 8; dy++) {
+    draw_tile_line(image, w, h, x, y + dy, address, 0, dy, palette_register, flip_x, flip_y);
+  }
+}
+
+// Tile of the background or window map at 9800-9BFF / 9C00-9FFF
+static uint16_t get_map_tile_address(const VideoMemory* video, uint16_t map_address, unsigned int tile_col, unsigned int tile_row, bool bg_tiles) {
+  uint8_t tile_index = video->vram_memory[map_address - 0x8000 + tile_row * 32 + tile_col];
+
+  // Use specified tiles
+  if (bg_tiles) {
+    return 0x9000 + (int8_t)tile_index * 0x10;
+  }
+  return 0x8000 + tile_index * 0x10;
+}
+
+// Palette indices of `width` pixels of line `map_y` of the 256x256 pixel map, starting
+// at column `map_x` and wrapping around. Only the tiles which are visible are fetched.
+// Up to 7 indices past `width` are overwritten, so whole tiles can be copied.
+static void fetch_background_line(const VideoMemory* video, uint8_t* indices, unsigned int width, uint16_t map_address, bool bg_tiles, uint8_t map_x, uint8_t map_y) {
+  assert(width <= 32 * 8);
+  unsigned int tile_row = map_y / 8;
+  unsigned int tile_line = map_y % 8;
+
+  // Only the first tile can be partially visible on the left
+  unsigned int first_x = map_x % 8;
+  unsigned int tile_count = (first_x + width + 7) / 8;
+  for(unsigned int i = 0; i < tile_count; i++) {
+    unsigned int tile_col = (map_x / 8 + i) % 32;
+    uint16_t tile_address = get_map_tile_address(video, map_address, tile_col, tile_row, bg_tiles);
+    const uint8_t* pixels = get_tile_row(video, tile_address, tile_line, false);
+    if (i == 0) {
+      memcpy(indices, &pixels[first_x], 8 - first_x);
+    } else {
+      memcpy(&indices[i * 8 - first_x], pixels, 8);
+    }
   }
-  
 }
 
-static void draw_tile(uint8_t* image, unsigned w, unsigned int h, int x, int y, uint16_t address, uint16_t palette_register, bool flip_x, bool flip_y) {
-  // Each tile is sized 8x8 pixels and has a color depth of 4 colors/gray shades
-  for(unsigned int dy = 0; dy < 8; dy++) {
-    draw_tile_line(image, w, h, x, y + dy, address, 0, dy, palette_register, flip_x, flip_y);
+static void draw_background_line(uint8_t* line, unsigned int width, uint16_t map_address, bool bg_tiles, uint8_t map_x, uint8_t map_y) {
+  uint8_t indices[32 * 8 + 7];
+  fetch_background_line(&gb->video, indices, width, map_address, bg_tiles, map_x, map_y);
+
+  // Color 0 is drawn already
+  compose_pixels(line, indices, width, get_palette_shades(BGP), true);
+}
+
+// Sprites of one line, by priority
+#define LINE_SPRITE_COUNT 10
+
+typedef struct {
+  unsigned int count;
+  uint8_t entries[LINE_SPRITE_COUNT]; // OAM index
+} LineSprites;
+
+static void index_oam(VideoMemory* video) {
+  memset(video->oam_buckets, 0x00, sizeof(video->oam_buckets));
+  for(unsigned int sprite_index = 0; sprite_index < 40; sprite_index++) {
+    video->oam_buckets[video->oam_memory[sprite_index * 4 + 0] / 8] |= (uint64_t)1 << sprite_index;
+  }
+  video->oam_index_valid = true;
+}
+
+// OAM search (Mode 2): picks the first 10 sprites in OAM which overlap `line`,
+// no matter their X coordinate. They are sorted by priority: the smaller X
+// coordinate first, and for the same X, the lower OAM index first.
+static void scan_oam_line(VideoMemory* video, int line, bool tall_sprites, LineSprites* sprites) {
+  sprites->count = 0;
+  if (!video->oam_index_valid) {
+    index_oam(video);
+  }
+
+  // Sprites at Y cover the lines Y-16 and following, so only Y from line+1 to line+16 can overlap
+  int sprite_height = tall_sprites ? 16 : 8;
+  uint64_t candidates = 0;
+  for(int bucket = (line + 1) / 8; bucket <= (line + 16) / 8; bucket++) {
+    if ((bucket >= 0) && (bucket < ARRAY_SIZE(video->oam_buckets))) {
+      candidates |= video->oam_buckets[bucket];
+    }
+  }
+
+  while((candidates != 0) && (sprites->count < LINE_SPRITE_COUNT)) {
+    unsigned int sprite_index = __builtin_ctzll(candidates);
+    candidates &= candidates - 1;
+
+    int sprite_y = video->oam_memory[sprite_index * 4 + 0] - 16;
+    if ((line < sprite_y) || (line >= sprite_y + sprite_height)) {
+      continue;
+    }
+
+    // Insert behind sprites with a smaller or the same X coordinate
+    uint8_t sprite_x = video->oam_memory[sprite_index * 4 + 1];
+    unsigned int position = sprites->count++;
+    while((position > 0) && (video->oam_memory[sprites->entries[position - 1] * 4 + 1] > sprite_x)) {
+      sprites->entries[position] = sprites->entries[position - 1];
+      position--;
+    }
+    sprites->entries[position] = sprite_index;
   }
 }
 
-static void draw_background_line(uint8_t* image, unsigned int w, unsigned h, int x, int y, uint16_t map_address, bool bg_tiles, uint8_t dx, uint8_t dy) {
-  unsigned int tile_row = dy / 8;
-  unsigned int tile_line = dy % 8;
-  
- for(unsigned int screen_x = 0; screen_x < 32*8; screen_x++) {  
-     
-    unsigned int tile_col = screen_x / 8;
-                    
-    // Read tile index from background map memory
-    unsigned int block_index = tile_row * 32 + tile_col;
-    int tile_index = read_memory8(map_address + block_index);
-      
-    // Use specified tiles
-    unsigned int tile_address = bg_tiles ? 0x9000 : 0x8000;
-    if (bg_tiles) {
-      tile_index = (int8_t)tile_index;
-    }
+// Palette indices of line `sprite_line` of an OAM entry, mirrored like the sprite
+static const uint8_t* get_sprite_row(const VideoMemory* video, const uint8_t* sprite, int sprite_line, bool tall_sprites) {
+  uint8_t tile_index = sprite[2];
+  uint8_t flags = sprite[3];
+  assert((sprite_line >= 0) && (sprite_line < (tall_sprites ? 16 : 8)));
 
-    
-    //             image, w, h,                   x, y
-    draw_tile_line(image, w, h, x + 8*tile_col - dx, y, tile_address + tile_index * 0x10, 0, tile_line, BGP, false, false);
-    draw_tile_line(image, w, h, x + 8*tile_col + 32*8 - dx, y, tile_address + tile_index * 0x10, 0, tile_line, BGP, false, false);
+  // Bit5   X flip          (0=Normal, 1=Horizontally mirrored)
+  bool flip_x = flags & (1 << 5);
+
+  // Bit6   Y flip          (0=Normal, 1=Vertically mirrored)
+  bool flip_y = flags & (1 << 6);
+  if (flip_y) {
+    sprite_line = (tall_sprites ? 15 : 7) - sprite_line;
+  }
+
+  // In 8x16 mode, the lower bit of the tile number is ignored. Ie. the upper 8x8 tile is "NN AND FEh", and the lower 8x8 tile is "NN OR 01h".
+  // Flipping the sprite vertically also swaps the two tiles.
+  if (tall_sprites) {
+    tile_index = (sprite_line < 8) ? (tile_index & 0xFE) : (tile_index | 0x01);
+    sprite_line %= 8;
+  }
+  return get_tile_row(video, 0x8000 + tile_index * 0x10, sprite_line, flip_x);
+}
 
+// Draws the 8 pixels of a sprite row at `x` of a line which is `width` pixels wide
+static void compose_sprite_row(uint8_t* line, unsigned int width, int x, const uint8_t* pixels, const uint8_t* shades) {
+  int start = (x < 0) ? -x : 0;
+  int end = (x + 8 > (int)width) ? ((int)width - x) : 8;
+  if (start >= end) {
+    return;
   }
+
+  // Color 0 is transparent
+  compose_pixels(&line[x + start], &pixels[start], end - start, shades, true);
 }
 
-static void draw_sprites_line(uint8_t* image, unsigned int w, unsigned int h, int x, int y, int dy, bool background) {
+static void draw_sprites_line(uint8_t* image, unsigned int w, int x, int y, int dy, const LineSprites* sprites, bool background) {
   
   uint8_t lcdc = read_io8(LCDC);
 
@@ -2245,14 +5004,14 @@ static void draw_sprites_line(uint8_t* image, unsigned int w, unsigned int h, in
   if (!sprites_enabled) {
     return;
   }
-      
-  for(unsigned int sprite_index = 0; sprite_index < 40; sprite_index++) {
 
-    uint16_t sprite_address = 0xFE00 + sprite_index * 4;
-    int sprite_y = read_memory8(sprite_address + 0) - 16;
-    int sprite_x = read_memory8(sprite_address + 1) - 8;
-    uint8_t tile_index = read_memory8(sprite_address + 2);
-    uint8_t flags = read_memory8(sprite_address + 3);
+  // Lowest priority first, so sprites with a higher priority are drawn over them
+  for(int i = sprites->count - 1; i >= 0; i--) {
+
+    const uint8_t* sprite = &gb->video.oam_memory[sprites->entries[i] * 4];
+    int sprite_y = sprite[0] - 16;
+    int sprite_x = sprite[1] - 8;
+    uint8_t flags = sprite[3];
       
     // Bit7   OBJ-to-BG Priority (0=OBJ Above BG, 1=OBJ Behind BG color 1-3)
     // (Used for both BG and Window. BG color 0 is always behind OBJ)
@@ -2263,182 +5022,728 @@ static void draw_sprites_line(uint8_t* image, unsigned int w, unsigned int h, in
       
     // Bit4   Palette number  **Non CGB Mode Only** (0=OBP0, 1=OBP1)
     uint16_t palette_register = (flags & (1 << 4)) ? OBP1 : OBP0;
-      
-    // Bit5   X flip          (0=Normal, 1=Horizontally mirrored)
-    bool flip_x = flags & (1 << 5);
-      
-    // Bit6   Y flip          (0=Normal, 1=Vertically mirrored)
-    bool flip_y = flags & (1 << 6);
 
     //From pan docs: An offscreen value (X=0 or X>=168) hides the sprite, but the sprite still affects the priority ordering - a better way to hide a sprite is to set its Y-coordinate offscreen.
-  
-
-    // In 8x16 mode, the lower bit of the tile number is ignored. Ie. the upper 8x8 tile is "NN AND FEh", and the lower 8x8 tile is "NN OR 01h".
-    uint16_t tile_address = 0x8000;
-    if (tall_sprites) {
-      assert(flip_y == false);
-      draw_tile_line(image, w, h, x + sprite_x, y, tile_address + (tile_index & 0xFE) * 0x10, 0, dy - (sprite_y + 0), palette_register, flip_x, flip_y);
-      draw_tile_line(image, w, h, x + sprite_x, y, tile_address + (tile_index | 0x01) * 0x10, 0, dy - (sprite_y + 8), palette_register, flip_x, flip_y);
-    } else {
-      draw_tile_line(image, w, h, x + sprite_x, y, tile_address + tile_index * 0x10, 0, dy - sprite_y, palette_register, flip_x, flip_y);
-    }
-  
+    const uint8_t* pixels = get_sprite_row(&gb->video, sprite, dy - sprite_y, tall_sprites);
+    compose_sprite_row(&image[y * w], w, x + sprite_x, pixels, get_palette_shades(palette_register));
   }
     
 }
    
-static void gameboy_step_once() {
+// LCD timing
+//
+// CPU: 4.194304 MHz => /4 = 1.048576 megahertz; 1/f = 953.674316 nanoseconds
+// LCD: 59.73 Hz = refresh rate => 1/59.73 Hz = 16.7420057 milliseconds
+//
+// LCD has 144 lines + 10 lines [vblank] = 154 lines
+// 16.7420057mns / 154 lines = 108.714323 microseconds
+// The LY can take on any value between 0 through 153. The values between 144 and 153 indicate the V-Blank period.
+//
+// Emulate CPU for 108.714323 microseconds per line
+// That'd be: (108.714323 microseconds) / (953.674316 nanoseconds) = 113.99523 ~ 114 M-cycles per line [456 T-Cyles]
+//
+// Each line is split into events for the mode changes:
+//   Line 0-143:   Mode 2 (80 cycles), Mode 3 (172 cycles), Mode 0 (204 cycles)
+//   Line 144-153: Mode 1 (456 cycles)
+
+// Replaces the mode flag, STAT is read again as the CPU may have changed the enable bits
+static uint8_t set_lcd_mode(uint8_t mode) {
+  uint8_t stat = (read_io8(STAT) & ~0x3) | mode;
+  write_io8(STAT, stat);
+  return stat;
+}
+
+static void start_lcd_line(uint64_t cycle) {
+  uint8_t ly = gb->lcd_ly;
+
+  // Update LCD Y controller
+  write_io8(LY, ly);
+
+  // Get current line comparator
+  uint8_t lyc = read_io8(LYC);
+      
+  // Handle STAT register
+  uint8_t stat = read_io8(STAT);
+  
+  // Bit 2 - Coincidence Flag  (0:LYC<>LY, 1:LYC=LY) (Read Only)
+  if (lyc != ly) {
+    stat &= ~(1 << 2);
+  } else {
+    stat |= (1 << 2);
     
-  // CPU: 4.194304 MHz => /4 = 1.048576 megahertz; 1/f = 953.674316 nanoseconds
-  // LCD: 59.73 Hz = refresh rate => 1/59.73 Hz = 16.7420057 milliseconds
-
-  int wasted_cycles = 0;
-
-  // LCD has 144 lines + 10 lines [vblank] = 154 lines
-  // 16.7420057mns / 154 lines = 108.714323 microseconds
-  // The LY can take on any value between 0 through 153. The values between 144 and 153 indicate the V-Blank period.
-  for(uint8_t ly = 0; ly < 154; ly++) {
+    // Bit 6 - LYC=LY Coincidence Interrupt (1=Enable) (Read/Write)
+    if (stat & (1 << 6)) {
+      request_interrupts(INTERRUPTS_LCDSTAT);
+    }
     
-    // Update LCD Y controller
-    write_io8(LY, ly);
+  }
 
-    // Read current flags    
-    uint8_t _if = read_io8(IF);
-    
-    // Get current line comparator
-    uint8_t lyc = read_io8(LYC);
+  // Reset mode flag to 0, so we can OR the actual mode onto it
+  // Bit 1-0 - Mode Flag       (Mode 0-3, see below) (Read Only)
+  //           0: During H-Blank
+  //           1: During V-Blank
+  //           2: During Searching OAM-RAM
+  //           3: During Transfering Data to LCD Driver
+  stat &= ~0x3;
+
+  //FIXME: Add memory access restrictions
+  // Mode 0: The LCD controller is in the H-Blank period and
+  //         the CPU can access both the display RAM (8000h-9FFFh)
+  //         and OAM (FE00h-FE9Fh)
         
-    // Handle STAT register
-    uint8_t stat = read_io8(STAT);
+  // Mode 1: The LCD contoller is in the V-Blank period (or the
+  //         display is disabled) and the CPU can access both the
+  //         display RAM (8000h-9FFFh) and OAM (FE00h-FE9Fh)
+
+  //FIXME: Add memory access restrictions
+  // Mode 2: The LCD controller is reading from OAM memory.
+  //         The CPU <cannot> access OAM memory (FE00h-FE9Fh)
+  //         during this period.
+
+  //FIXME: Add memory access restrictions
+  // Mode 3: The LCD controller is reading from both OAM and VRAM,
+  //         The CPU <cannot> access OAM and VRAM during this period.
+  //         CGB Mode: Cannot access Palette Data (FF69,FF6B) either.
+
+
+  if (ly < 144) {
+      
+    // Mode 2
+    write_io8(STAT, stat | 2);
+    // Bit 5 - Mode 2 OAM Interrupt         (1=Enable) (Read/Write)
+    if (stat & (1 << 5)) {
+      request_interrupts(INTERRUPTS_LCDSTAT);
+    }
+    schedule_event(EVENT_LCD_MODE3, cycle + 80);
+
+  } else {
+
+    // Mode 1
+    write_io8(STAT, stat | 1);
     
-    // Bit 2 - Coincidence Flag  (0:LYC<>LY, 1:LYC=LY) (Read Only)
-    if (lyc != ly) {
-      stat &= ~(1 << 2);
-    } else {
-      stat |= (1 << 2);
+    // Trigger vblank interrupt at start of first invisible line (line 144)
+    if (ly == 144) {
+      request_interrupts(INTERRUPTS_VBLANK);
       
-      // Bit 6 - LYC=LY Coincidence Interrupt (1=Enable) (Read/Write)
-      if (stat & (1 << 6)) {
-        write_io8(IF, _if | INTERRUPTS_LCDSTAT);
-      }
       
+      // Trigger optional LCDSTAT interrupt
+      // Bit 4 - Mode 1 V-Blank Interrupt     (1=Enable) (Read/Write)
+      if (stat & (1 << 4)) {
+        request_interrupts(INTERRUPTS_LCDSTAT);
+      }
     }
-  
-    // Reset mode flag to 0, so we can OR the actual mode onto it
-    // Bit 1-0 - Mode Flag       (Mode 0-3, see below) (Read Only)
-    //           0: During H-Blank
-    //           1: During V-Blank
-    //           2: During Searching OAM-RAM
-    //           3: During Transfering Data to LCD Driver
-    stat &= ~0x3;
-  
-    //FIXME: Add memory access restrictions
-    // Mode 0: The LCD controller is in the H-Blank period and
-    //         the CPU can access both the display RAM (8000h-9FFFh)
-    //         and OAM (FE00h-FE9Fh)
-          
-    // Mode 1: The LCD contoller is in the V-Blank period (or the
-    //         display is disabled) and the CPU can access both the
-    //         display RAM (8000h-9FFFh) and OAM (FE00h-FE9Fh)
-
-    //FIXME: Add memory access restrictions
-    // Mode 2: The LCD controller is reading from OAM memory.
-    //         The CPU <cannot> access OAM memory (FE00h-FE9Fh)
-    //         during this period.
-
-    //FIXME: Add memory access restrictions
-    // Mode 3: The LCD controller is reading from both OAM and VRAM,
-    //         The CPU <cannot> access OAM and VRAM during this period.
-    //         CGB Mode: Cannot access Palette Data (FF69,FF6B) either.
-          
-    // Emulate CPU for 108.714323 microseconds
-    // That'd be: (108.714323 microseconds) / (953.674316 nanoseconds) = 113.99523 ~ 114 M-cycles per line [456 T-Cyles]     
-    if (ly < 144) {
-        
-        // Mode 2
-        write_io8(STAT, stat | 2);
-        // Bit 5 - Mode 2 OAM Interrupt         (1=Enable) (Read/Write)
-        if (stat & (1 << 5)) {
-          write_io8(IF, _if | INTERRUPTS_LCDSTAT);
-        }
-        wasted_cycles = cpu_step(80 + wasted_cycles);
-        
-        
-        // Mode 3
-        write_io8(STAT, stat | 3);
-        wasted_cycles = cpu_step(172 + wasted_cycles);
-        
-        // Mode 0
-        write_io8(STAT, stat | 0);
-        // Bit 3 - Mode 0 H-Blank Interrupt     (1=Enable) (Read/Write)
-        if (stat & (1 << 5)) {
-          write_io8(IF, _if | INTERRUPTS_LCDSTAT);
-        }
-        wasted_cycles = cpu_step(204 + wasted_cycles);
-        
-        // Clear background to background color 0
-        uint8_t color = get_palette_color(BGP, 0);
-        memset(&gameboy_framebuffer[ly * GAMEBOY_SCREEN_WIDTH], u2_to_u8(color), GAMEBOY_SCREEN_WIDTH);
-        
-        // Draw background sprites
-        draw_sprites_line(gameboy_framebuffer, GAMEBOY_SCREEN_WIDTH, GAMEBOY_SCREEN_HEIGHT, 0, ly, ly, true);
-        
-        // Draw background
-        uint8_t lcdc = read_io8(LCDC);
-       
-        //  Bit 4 - BG & Window Tile Data Select   (0=8800-97FF, 1=8000-8FFF)
-        bool bg_tiles = !(lcdc & (1 << 4));
-        
-        //  Bit 3 - BG Tile Map Display Select     (0=9800-9BFF, 1=9C00-9FFF)
-        uint16_t map_address = (lcdc & (1 << 3)) ? 0x9C00 : 0x9800;
-        
-        uint8_t scx = read_io8(SCX);
-        uint8_t scy = read_io8(SCY);
-        draw_background_line(gameboy_framebuffer, GAMEBOY_SCREEN_WIDTH, GAMEBOY_SCREEN_HEIGHT, 0, ly, map_address, bg_tiles, scx, ly + scy);
-        
-        // Draw foreground sprites
-        draw_sprites_line(gameboy_framebuffer, GAMEBOY_SCREEN_WIDTH, GAMEBOY_SCREEN_HEIGHT, 0, ly, ly, false);
-        
-        //FIXME: 
-        //  Bit 6 - Window Tile Map Display Select (0=9800-9BFF, 1=9C00-9FFF)
-        //  Bit 5 - Window Display Enable          (0=Off, 1=On)
-        
-    } else {
-  
-        // Mode 1
-        write_io8(STAT, stat | 1);
-        
-        // Trigger vblank interrupt at start of first invisible line (line 144)
-        if (ly == 144) {
-          write_io8(IF, _if | INTERRUPTS_VBLANK);
-          
-          
-          // Trigger optional LCDSTAT interrupt
-          // Bit 4 - Mode 1 V-Blank Interrupt     (1=Enable) (Read/Write)
-          if (stat & (1 << 4)) {
-            write_io8(IF, _if | INTERRUPTS_LCDSTAT);
-          }
-        }
-        wasted_cycles = cpu_step(456 + wasted_cycles);
+    schedule_event(EVENT_LCD_LINE_END, cycle + 456);
+  }
+}
+
+// What a line is drawn from, recorded by the emulator as mode 3 ends
+typedef struct LcdRegisters {
+  uint8_t ly;
+  uint8_t lcdc;
+  uint8_t scx;
+  uint8_t scy;
+  uint8_t wx;
+  uint8_t wy;
+  bool dma_active; // The DMA transfer owns OAM
+  uint8_t shades[3][4]; // BGP, OBP0 and OBP1, see get_palette_shades()
+  size_t video_version; // Of VRAM and OAM, only with the render thread
+} LcdRegisters;
+
+// Everything which is drawn on one line, fetched from the registers, VRAM and OAM
+typedef struct {
+  int16_t x;
+  uint8_t flags; // OAM attributes
+  uint8_t pixels[8]; // Palette indices, mirrored already
+} LcdLineSprite;
+
+typedef struct {
+  uint8_t ly;
+  uint8_t shades[3][4];
+  uint8_t background[GAMEBOY_SCREEN_WIDTH + 7]; // Palette indices of background and window, see fetch_background_line()
+  unsigned int sprite_count;
+  LcdLineSprite sprites[LINE_SPRITE_COUNT]; // By priority
+} LcdLine;
+
+static void record_lcd_registers(uint8_t ly, LcdRegisters* registers) {
+  registers->ly = ly;
+  registers->lcdc = read_io8(LCDC);
+  registers->scx = read_io8(SCX);
+  registers->scy = read_io8(SCY);
+  registers->wx = read_io8(WX);
+  registers->wy = read_io8(WY);
+  registers->dma_active = gb->dma_active;
+  memcpy(registers->shades, gb->palette_shades, sizeof(registers->shades));
+}
+
+// Doesn't look at the context, so the render thread can run it on its copy of
+// VRAM and OAM. `window_line` is the next line of the window map.
+static void fetch_lcd_line(VideoMemory* video, const LcdRegisters* registers, uint8_t* window_line, LcdLine* line) {
+  uint8_t ly = registers->ly;
+  uint8_t lcdc = registers->lcdc;
+  line->ly = ly;
+  memcpy(line->shades, registers->shades, sizeof(line->shades));
+
+  // Sprites for both sprite layers
+  //  Bit 1 - OBJ (Sprite) Display Enable    (0=Off, 1=On)
+  //  Bit 2 - OBJ (Sprite) Size              (0=8x8, 1=8x16)
+  line->sprite_count = 0;
+  if ((lcdc & (1 << 1)) && !registers->dma_active) {
+    bool tall_sprites = lcdc & (1 << 2);
+    LineSprites sprites;
+    scan_oam_line(video, ly, tall_sprites, &sprites);
+    for(unsigned int i = 0; i < sprites.count; i++) {
+      const uint8_t* sprite = &video->oam_memory[sprites.entries[i] * 4];
+      LcdLineSprite* line_sprite = &line->sprites[line->sprite_count++];
+      line_sprite->x = sprite[1] - 8;
+      line_sprite->flags = sprite[3];
+      memcpy(line_sprite->pixels, get_sprite_row(video, sprite, ly - (sprite[0] - 16), tall_sprites), 8);
     }
+  }
+ 
+  //  Bit 4 - BG & Window Tile Data Select   (0=8800-97FF, 1=8000-8FFF)
+  bool bg_tiles = !(lcdc & (1 << 4));
+
+  // The window covers the background from WX-7 on
+  //  Bit 5 - Window Display Enable          (0=Off, 1=On)
+  //  Bit 6 - Window Tile Map Display Select (0=9800-9BFF, 1=9C00-9FFF)
+  int window_x = GAMEBOY_SCREEN_WIDTH;
+  if ((lcdc & (1 << 5)) && (ly >= registers->wy) && (registers->wx <= 166)) {
+    window_x = registers->wx - 7;
+  }
+  unsigned int background_width = (window_x > 0) ? window_x : 0;
 
+  // Fetch background
+  //  Bit 3 - BG Tile Map Display Select     (0=9800-9BFF, 1=9C00-9FFF)
+  uint16_t map_address = (lcdc & (1 << 3)) ? 0x9C00 : 0x9800;
+  if (background_width > 0) {
+    fetch_background_line(video, line->background, background_width, map_address, bg_tiles, registers->scx, ly + registers->scy);
+  }
+
+  // Fetch window over the end of the background; its lines only count while it is visible
+  if (ly == 0) {
+    *window_line = 0;
+  }
+  if (background_width < GAMEBOY_SCREEN_WIDTH) {
+    uint16_t window_map_address = (lcdc & (1 << 6)) ? 0x9C00 : 0x9800;
+    fetch_background_line(video, &line->background[background_width], GAMEBOY_SCREEN_WIDTH - background_width, window_map_address,
+                          bg_tiles, background_width - window_x, *window_line);
+    (*window_line)++;
   }
-  
 }
 
-static bool fast_mode = false;
-void gameboy_step() {
-  unsigned int frames = fast_mode ? 4 : 1;
+static void compose_lcd_sprites(uint8_t* pixels, const LcdLine* line, bool background) {
+  // Lowest priority first, so sprites with a higher priority are drawn over them
+  for(int i = line->sprite_count - 1; i >= 0; i--) {
+    const LcdLineSprite* sprite = &line->sprites[i];
+
+    // Bit7   OBJ-to-BG Priority (0=OBJ Above BG, 1=OBJ Behind BG color 1-3)
+    // (Used for both BG and Window. BG color 0 is always behind OBJ)
+    bool sprite_background = sprite->flags & (1 << 7);
+    if (sprite_background != background) {
+      continue;
+    }
+
+    // Bit4   Palette number  **Non CGB Mode Only** (0=OBP0, 1=OBP1)
+    uint16_t palette_register = (sprite->flags & (1 << 4)) ? OBP1 : OBP0;
+    compose_sprite_row(pixels, GAMEBOY_SCREEN_WIDTH, sprite->x, sprite->pixels, line->shades[palette_register - BGP]);
+  }
+}
+
+static void compose_lcd_line(const LcdLine* line, uint8_t* framebuffer) {
+  uint8_t* pixels = &framebuffer[line->ly * GAMEBOY_SCREEN_WIDTH];
+
+  // Clear background to background color 0
+  memset(pixels, line->shades[0][0], GAMEBOY_SCREEN_WIDTH);
+
+  // Draw background sprites
+  compose_lcd_sprites(pixels, line, true);
+
+  // Draw background and window, color 0 is transparent
+  compose_pixels(pixels, line->background, GAMEBOY_SCREEN_WIDTH, line->shades[0], true);
+
+  // Draw foreground sprites
+  compose_lcd_sprites(pixels, line, false);
+}
+
+// Render thread
+//
+// With GB_RENDER_THREAD=on, each context draws its lines on a thread of its
+// own. When mode 3 of a line ends, the emulator only records its registers;
+// the render thread fetches tiles and sprites and composes the pixels
+// meanwhile.
+//
+// The render thread draws from a copy of VRAM and OAM. Before a line which
+// follows writes to them, the emulator queues a snapshot of what was written,
+// and the line names the version it is drawn from, ie. the number of
+// snapshots queued so far. Writes to the maps take the slow path for this,
+// see initialize_memory_map().
+//
+// A side which has to wait sleeps on render_lock, after saying so in
+// render_thread_waiting / render_emulator_waiting; the other side only takes
+// the lock to wake it. The render thread is woken for a batch of lines, or
+// when the emulator waits for it. A frame is complete when
+// gameboy_context_step() returns, which only waits for the last lines.
+
+#define LCD_LINE_QUEUE_SIZE 256 // Lines, must be a power of two
+#define LCD_LINE_BATCH 48 // Lines queued before the render thread is woken, a third of a frame
+#define VIDEO_SNAPSHOT_COUNT 4 // Must be a power of two
+
+// What was written to VRAM and OAM since the previous snapshot
+typedef struct VideoSnapshot {
+  uint16_t vram_start; // VRAM offsets which were written, only those are copied
+  uint16_t vram_end;
+  bool oam_changed;
+  uint8_t vram_memory[8 * 1024];
+  uint8_t oam_memory[0xA0];
+} VideoSnapshot;
+
+static bool render_thread_enabled = false;
+
+static void select_render_thread() {
+  const char* mode = getenv("GB_RENDER_THREAD");
+  if (mode == NULL) {
+    return;
+  }
+  if (!strcmp(mode, "off")) {
+    render_thread_enabled = false;
+  } else if (!strcmp(mode, "on")) {
+    render_thread_enabled = true;
+  } else {
+    fprintf(stderr, "Unknown render thread mode '%s'\n", mode);
+    return;
+  }
+  printf("Render thread %s\n", mode);
+}
+
+static void signal_render_condition(GameboyContext* context, pthread_cond_t* condition) {
+  pthread_mutex_lock(&context->render_lock);
+  pthread_cond_signal(condition);
+  pthread_mutex_unlock(&context->render_lock);
+}
+
+static bool has_lcd_line_batch(GameboyContext* context, size_t tail) {
+  size_t head = atomic_load(&context->lcd_lines_head);
+  return (head - tail >= LCD_LINE_BATCH) || ((head != tail) && atomic_load(&context->render_emulator_waiting));
+}
+
+// Blocks the render thread until a line follows `tail`; false once the thread stops and all lines are drawn
+static bool wait_for_lcd_line(GameboyContext* context, size_t tail) {
+  if (atomic_load(&context->lcd_lines_head) != tail) {
+    return true;
+  }
+
+  pthread_mutex_lock(&context->render_lock);
+  atomic_store(&context->render_thread_waiting, true);
+  while(!has_lcd_line_batch(context, tail) && atomic_load(&context->render_thread_running)) {
+    pthread_cond_wait(&context->render_wake, &context->render_lock);
+  }
+  atomic_store(&context->render_thread_waiting, false);
+  pthread_mutex_unlock(&context->render_lock);
+  return atomic_load(&context->lcd_lines_head) != tail;
+}
+
+static void apply_video_snapshot(VideoMemory* video, const VideoSnapshot* snapshot) {
+  unsigned int start = snapshot->vram_start;
+  unsigned int end = snapshot->vram_end;
+  if (start < end) {
+    memcpy(&video->vram_memory[start], &snapshot->vram_memory[start], end - start);
+    decode_tiles(video, start, end);
+  }
+  if (snapshot->oam_changed) {
+    memcpy(video->oam_memory, snapshot->oam_memory, sizeof(video->oam_memory));
+    video->oam_index_valid = false;
+  }
+}
+
+static void* run_render_thread(void* argument) {
+  GameboyContext* context = argument;
+  size_t tail = atomic_load(&context->lcd_lines_tail);
+  while(wait_for_lcd_line(context, tail)) {
+    const LcdRegisters* registers = &context->lcd_lines[tail % LCD_LINE_QUEUE_SIZE];
+
+    // Catch up with VRAM and OAM as they were when the line ended
+    size_t version = atomic_load(&context->video_snapshots_tail);
+    while(version != registers->video_version) {
+      apply_video_snapshot(context->render_video, &context->video_snapshots[version % VIDEO_SNAPSHOT_COUNT]);
+      version++;
+      atomic_store(&context->video_snapshots_tail, version);
+    }
+
+    LcdLine line;
+    fetch_lcd_line(context->render_video, registers, &context->render_window_line, &line);
+    compose_lcd_line(&line, context->framebuffer);
+    tail++;
+    atomic_store(&context->lcd_lines_tail, tail);
+
+    if (atomic_load(&context->render_emulator_waiting)) {
+      signal_render_condition(context, &context->render_done);
+    }
+  }
+  return NULL;
+}
+
+static void start_render_thread() {
+  gb->lcd_lines = malloc(LCD_LINE_QUEUE_SIZE * sizeof(LcdRegisters));
+  gb->video_snapshots = malloc(VIDEO_SNAPSHOT_COUNT * sizeof(VideoSnapshot));
+  gb->render_video = malloc(sizeof(VideoMemory));
+  assert((gb->lcd_lines != NULL) && (gb->video_snapshots != NULL) && (gb->render_video != NULL));
+  atomic_store(&gb->lcd_lines_head, 0);
+  atomic_store(&gb->lcd_lines_tail, 0);
+  atomic_store(&gb->video_snapshots_head, 0);
+  atomic_store(&gb->video_snapshots_tail, 0);
+  atomic_store(&gb->render_thread_running, true);
+  atomic_store(&gb->render_thread_waiting, false);
+  atomic_store(&gb->render_emulator_waiting, false);
+  pthread_mutex_init(&gb->render_lock, NULL);
+  pthread_cond_init(&gb->render_wake, NULL);
+  pthread_cond_init(&gb->render_done, NULL);
+
+  // The copy starts out like VRAM and OAM, later writes go to snapshots
+  memcpy(gb->render_video, &gb->video, sizeof(VideoMemory));
+  gb->render_window_line = gb->lcd_window_line;
+  gb->vram_dirty_start = 0;
+  gb->vram_dirty_end = 0;
+  gb->oam_dirty = false;
+
+  // Writes to the maps have to be seen from now on
+  gb->render_thread_started = true;
+  map_pages(gb->write_pages, 0x9800, 0x0800, NULL);
+
+  int error = pthread_create(&gb->render_thread, NULL, run_render_thread, gb);
+  assert(error == 0);
+}
+
+static void stop_render_thread() {
+  if (!gb->render_thread_started) {
+    return;
+  }
+
+  // Let the render thread drain the queue
+  atomic_store(&gb->render_thread_running, false);
+  signal_render_condition(gb, &gb->render_wake);
+  pthread_join(gb->render_thread, NULL);
+  gb->render_thread_started = false;
+
+  pthread_mutex_destroy(&gb->render_lock);
+  pthread_cond_destroy(&gb->render_wake);
+  pthread_cond_destroy(&gb->render_done);
+  free(gb->lcd_lines);
+  gb->lcd_lines = NULL;
+  free(gb->video_snapshots);
+  gb->video_snapshots = NULL;
+  free(gb->render_video);
+  gb->render_video = NULL;
+}
+
+static bool is_render_thread_within(size_t lines, size_t snapshots) {
+  return (atomic_load(&gb->lcd_lines_head) - atomic_load(&gb->lcd_lines_tail) <= lines) &&
+         (atomic_load(&gb->video_snapshots_head) - atomic_load(&gb->video_snapshots_tail) <= snapshots);
+}
+
+// Blocks the emulator until at most `lines` lines and `snapshots` snapshots are queued
+static void wait_for_render_thread(size_t lines, size_t snapshots) {
+  if (is_render_thread_within(lines, snapshots)) {
+    return;
+  }
+
+  pthread_mutex_lock(&gb->render_lock);
+  atomic_store(&gb->render_emulator_waiting, true);
+  if (atomic_load(&gb->render_thread_waiting)) {
+    pthread_cond_signal(&gb->render_wake);
+  }
+  while(!is_render_thread_within(lines, snapshots)) {
+    pthread_cond_wait(&gb->render_done, &gb->render_lock);
+  }
+  atomic_store(&gb->render_emulator_waiting, false);
+  pthread_mutex_unlock(&gb->render_lock);
+}
+
+// Waits until all queued lines are in the framebuffer
+static void finish_lcd_lines() {
+  if (!gb->render_thread_started) {
+    return;
+  }
+  wait_for_render_thread(0, 0);
+}
+
+// Queues what was written to VRAM and OAM since the last snapshot
+static void take_video_snapshot() {
+  wait_for_render_thread(LCD_LINE_QUEUE_SIZE, VIDEO_SNAPSHOT_COUNT - 1);
+  size_t head = atomic_load_explicit(&gb->video_snapshots_head, memory_order_relaxed);
+  VideoSnapshot* snapshot = &gb->video_snapshots[head % VIDEO_SNAPSHOT_COUNT];
+
+  snapshot->vram_start = gb->vram_dirty_start;
+  snapshot->vram_end = gb->vram_dirty_end;
+  if (gb->vram_dirty_start < gb->vram_dirty_end) {
+    memcpy(&snapshot->vram_memory[gb->vram_dirty_start], &gb->video.vram_memory[gb->vram_dirty_start],
+           gb->vram_dirty_end - gb->vram_dirty_start);
+  }
+  snapshot->oam_changed = gb->oam_dirty;
+  if (gb->oam_dirty) {
+    memcpy(snapshot->oam_memory, gb->video.oam_memory, sizeof(snapshot->oam_memory));
+  }
+  gb->vram_dirty_start = 0;
+  gb->vram_dirty_end = 0;
+  gb->oam_dirty = false;
+
+  atomic_store(&gb->video_snapshots_head, head + 1);
+}
+
+static void draw_lcd_line(uint8_t ly) {
+  if (!gb->render_thread_started) {
+    LcdRegisters registers;
+    LcdLine line;
+    record_lcd_registers(ly, &registers);
+    fetch_lcd_line(&gb->video, &registers, &gb->lcd_window_line, &line);
+    compose_lcd_line(&line, gb->framebuffer);
+    return;
+  }
+
+  if ((gb->vram_dirty_start < gb->vram_dirty_end) || gb->oam_dirty) {
+    take_video_snapshot();
+  }
+
+  // Wait for the render thread if the queue is full
+  wait_for_render_thread(LCD_LINE_QUEUE_SIZE - 1, VIDEO_SNAPSHOT_COUNT);
+  size_t head = atomic_load_explicit(&gb->lcd_lines_head, memory_order_relaxed);
+  LcdRegisters* registers = &gb->lcd_lines[head % LCD_LINE_QUEUE_SIZE];
+  record_lcd_registers(ly, registers);
+  registers->video_version = atomic_load_explicit(&gb->video_snapshots_head, memory_order_relaxed);
+  atomic_store(&gb->lcd_lines_head, head + 1);
+
+  if (atomic_load(&gb->render_thread_waiting) && (head + 1 - atomic_load(&gb->lcd_lines_tail) >= LCD_LINE_BATCH)) {
+    signal_render_condition(gb, &gb->render_wake);
+  }
+}
+
+static void handle_event(const Event* event) {
+  switch(event->type) {
+  case EVENT_LCD_MODE2:
+    start_lcd_line(event->cycle);
+    break;
+
+  case EVENT_LCD_MODE3:
+    set_lcd_mode(3);
+    schedule_event(EVENT_LCD_MODE0, event->cycle + 172);
+    break;
+
+  case EVENT_LCD_MODE0:
+    // The line was transferred during mode 3, so H-Blank writes only show on the next one
+    if ((gb->lcd_ly < 144) && gb->render_frame) {
+      draw_lcd_line(gb->lcd_ly);
+    }
+
+    // Bit 3 - Mode 0 H-Blank Interrupt     (1=Enable) (Read/Write)
+    if (set_lcd_mode(0) & (1 << 3)) {
+      request_interrupts(INTERRUPTS_LCDSTAT);
+    }
+    schedule_event(EVENT_LCD_LINE_END, event->cycle + 204);
+    break;
+
+  case EVENT_LCD_LINE_END:
+    // Continue with the next line right away
+    gb->lcd_ly++;
+    if (gb->lcd_ly == 154) {
+      gb->lcd_ly = 0;
+      gb->frame_done = true;
+    }
+    schedule_event(EVENT_LCD_MODE2, event->cycle);
+    break;
+
+  case EVENT_DMA_END:
+    // Ignore the end of a transfer which was restarted
+    if (gb->dma_active && (event->cycle == gb->dma_end_cycle)) {
+      end_dma();
+    }
+    break;
+
+  default:
+    assert(false);
+    break;
+  }
+}
+
+static void initialize_scheduler() {
+  gb->cycle_counter = 0;
+  gb->event_count = 0;
+  gb->event_sequence = 0;
+  gb->lcd_ly = 0;
+  schedule_event(EVENT_LCD_MODE2, 0);
+}
+
+// Rendering policy
+//
+// Skipped frames run exactly like drawn ones, only draw_lcd_line() isn't
+// called, so the framebuffer keeps the last frame which was drawn.
+// The policy applies to whole frames: the window line counter is only kept
+// by draw_lcd_line() and restarts with each frame.
+
+#define LCD_FRAME_CYCLES (154 * 456)
+#define ADAPTIVE_MAX_SKIPPED_FRAMES 3 // The picture still moves when far behind
+#define ADAPTIVE_RESYNC_SECONDS 0.25 // Pauses and bursts aren't caught up
+
+static GameboyRenderPolicy default_render_policy = GAMEBOY_RENDER_ALL;
+static unsigned int default_render_interval = 1;
+
+static void select_render_policy() {
+  const char* policy = getenv("GB_RENDER");
+  if (policy == NULL) {
+    return;
+  }
+  unsigned int interval = 0;
+  if (!strcmp(policy, "all")) {
+    default_render_policy = GAMEBOY_RENDER_ALL;
+  } else if ((sscanf(policy, "every:%u", &interval) == 1) && (interval > 0)) {
+    default_render_policy = GAMEBOY_RENDER_EVERY;
+    default_render_interval = interval;
+  } else if (!strcmp(policy, "request")) {
+    default_render_policy = GAMEBOY_RENDER_ON_REQUEST;
+  } else if (!strcmp(policy, "none")) {
+    default_render_policy = GAMEBOY_RENDER_NONE;
+  } else if (!strcmp(policy, "adaptive")) {
+    default_render_policy = GAMEBOY_RENDER_ADAPTIVE;
+  } else {
+    fprintf(stderr, "Unknown render policy '%s'\n", policy);
+    return;
+  }
+  printf("Using %s render policy\n", policy);
+}
+
+// More than a frame late compared to emulated time
+static bool is_behind_realtime() {
+  double now = get_monotonic_time();
+  double emulated = (double)(gb->cycle_counter - gb->realtime_start_cycle) / RTC_CYCLES_PER_SECOND;
+  double late = (now - gb->realtime_start) - emulated;
+  if ((gb->realtime_start == 0.0) || (late > ADAPTIVE_RESYNC_SECONDS) || (late < -ADAPTIVE_RESYNC_SECONDS)) {
+    gb->realtime_start = now;
+    gb->realtime_start_cycle = gb->cycle_counter;
+    return false;
+  }
+  return late > (double)LCD_FRAME_CYCLES / RTC_CYCLES_PER_SECOND;
+}
+
+// Decides whether the next frame which is shown gets drawn
+static bool should_render_frame() {
+  bool render;
+  switch(gb->render_policy) {
+  case GAMEBOY_RENDER_EVERY:
+    render = (gb->render_skipped + 1 >= gb->render_interval);
+    break;
+  case GAMEBOY_RENDER_ON_REQUEST:
+    render = gb->render_requested;
+    gb->render_requested = false;
+    break;
+  case GAMEBOY_RENDER_NONE:
+    render = false;
+    break;
+  case GAMEBOY_RENDER_ADAPTIVE:
+    render = (gb->render_skipped >= ADAPTIVE_MAX_SKIPPED_FRAMES) || !is_behind_realtime();
+    break;
+  default:
+    render = true;
+    break;
+  }
+  gb->render_skipped = render ? 0 : (gb->render_skipped + 1);
+  return render;
+}
+
+static void gameboy_step_once() {
+
+  // Run events until the last line of the frame is done
+  gb->frame_done = false;
+  while(!gb->frame_done) {
+    run_next_event();
+  }
+}
+
+void gameboy_context_step(GameboyContext* context) {
+  gb = context;
+  unsigned int frames = gb->fast_mode ? 4 : 1;
   while(frames--) {
+    // Fast mode only shows the last of its frames
+    gb->render_frame = (frames == 0) && should_render_frame();
     gameboy_step_once();
+    update_save();
+  }
+  finish_lcd_lines();
+}
+
+void gameboy_context_render_policy(GameboyContext* context, GameboyRenderPolicy policy, unsigned int interval) {
+  assert((policy != GAMEBOY_RENDER_EVERY) || (interval > 0));
+  context->render_policy = policy;
+  context->render_interval = interval;
+  context->render_skipped = 0;
+  context->realtime_start = 0.0;
+}
+
+void gameboy_context_request_frame(GameboyContext* context) {
+  context->render_requested = true;
+}
+
+void gameboy_context_input(GameboyContext* context, const GameboyInput* input) {
+  context->input = *input;
+}
+
+const uint8_t* gameboy_context_framebuffer(GameboyContext* context) {
+  return context->framebuffer;
+}
+
+uint64_t gameboy_context_cycles(GameboyContext* context) {
+  return context->cycle_counter;
+}
+
+void gameboy_context_destroy(GameboyContext* context) {
+#if JIT
+  if (context->jit_code != NULL) {
+    munmap(context->jit_code, JIT_CODE_SIZE);
+  }
+#endif
+  gb = context;
+#if DEBUG
+  if (context->trace_enabled) {
+    stop_trace();
   }
+#endif
+  stop_render_thread();
+  finish_save();
+  unload_rom();
+  free(context);
+  gb = NULL;
+}
+
+size_t gameboy_context_size() {
+  return sizeof(GameboyContext);
+}
+
+void gameboy_step() {
+  gameboy_context_input(gameboy, &gameboy_input);
+  gameboy_context_step(gameboy);
+  memcpy(gameboy_framebuffer, gameboy->framebuffer, sizeof(gameboy_framebuffer));
 }
 
 
 
 void gameboy_notify_exit() {
+  gb = gameboy;
+
+  printf("Context: %zu bytes + %zu bytes ROM\n", gameboy_context_size(), gb->cartridge_rom_size);
+  printf("HALT: %lu cycles skipped\n", gb->halt_skipped_cycles);
+  print_idle_loop_statistics();
+
+#if DEBUG
+  // Flush the trace
+  stop_trace();
+#endif
+
+  if (cpu_engine == CPU_ENGINE_CACHED) {
+    print_decoded_block_statistics();
+#if JIT
+    print_jit_statistics();
+#endif
+  }
 
-  //FIXME
+  // Write back battery-backed RAM
+  finish_save();
 }
 
 
@@ -2457,7 +5762,7 @@ static void disassemble() {
     uint8_t opcode = read_memory8(address);
 
     // run the CPU instruction
-    InstructionHandler* handler = cpu_decode(opcode);
+    const InstructionHandler* handler = cpu_decode(opcode);
     assert(handler != NULL);
 
     // Read rest of instruction
@@ -2558,7 +5863,7 @@ static void dump_background_map(uint16_t map_address, bool bg_tiles, const char*
     
   // Loop over all 32x32 tiles to assemble a graphic
   for(unsigned int y = 0; y < 32 * 8; y++) {
-    draw_background_line(image, 32*8, 32*8, 0, y, map_address, bg_tiles, 0, y);
+    draw_background_line(&image[y * 32*8], 32*8, map_address, bg_tiles, 0, y);
   }
     
   // Export image to file
@@ -2589,7 +5894,9 @@ static void dump_sprites(bool background) {
       continue;
     }
 #endif
-    draw_sprites_line(&image[8], 256 + 8, 256 + 16, 8, y, y + 16, background);
+    LineSprites sprites;
+    scan_oam_line(&gb->video, y + 16, read_io8(LCDC) & (1 << 2), &sprites);
+    draw_sprites_line(&image[8], 256 + 8, 8, y, y + 16, &sprites, background);
   }
     
   // Export image to file
@@ -2600,10 +5907,76 @@ static void dump_sprites(bool background) {
 }
 
 static void take_screenshot() {
-  export_image("screenshot.pgm", gameboy_framebuffer, GAMEBOY_SCREEN_WIDTH, GAMEBOY_SCREEN_HEIGHT);
+  export_image("screenshot.pgm", gb->framebuffer, GAMEBOY_SCREEN_WIDTH, GAMEBOY_SCREEN_HEIGHT);
+}
+
+// Runs every pixel kernel on the same pseudo-random tile data and compares
+// the speed and output against the scalar kernels
+void gameboy_benchmark_pixel_kernels() {
+  const unsigned int iterations = 1000;
+  const size_t rows = TILE_COUNT * 8;
+  static uint8_t planes[TILE_COUNT * 8 * 2];
+  static uint8_t pixels[ARRAY_SIZE(pixel_kernels)][TILE_COUNT * 8 * 8];
+  static uint8_t flipped_pixels[ARRAY_SIZE(pixel_kernels)][TILE_COUNT * 8 * 8];
+  static uint8_t image[ARRAY_SIZE(pixel_kernels)][TILE_COUNT * 8 * 8];
+  const uint8_t shades[4] = { u2_to_u8(3), u2_to_u8(2), u2_to_u8(1), u2_to_u8(0) };
+
+  uint32_t seed = 0x12345678;
+  for(size_t i = 0; i < sizeof(planes); i++) {
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    planes[i] = seed & 0xFF;
+  }
+
+  double scalar_times[3];
+  for(unsigned int k = 0; k < ARRAY_SIZE(pixel_kernels); k++) {
+    const PixelKernels* kernels = &pixel_kernels[k];
+    if (!is_pixel_kernel_supported(kernels)) {
+      printf("%-6s  not supported by this CPU\n", kernels->name);
+      continue;
+    }
+
+    // Whole rows of tiles, then tile rows one by one like draw_tile_line()
+    double times[3];
+    double start = get_monotonic_time();
+    for(unsigned int i = 0; i < iterations; i++) {
+      kernels->decode_tile_rows(planes, pixels[k], flipped_pixels[k], rows);
+    }
+    times[0] = get_monotonic_time() - start;
+
+    memset(image[k], 0x55, sizeof(image[k]));
+    start = get_monotonic_time();
+    for(unsigned int i = 0; i < iterations; i++) {
+      kernels->compose_pixels(image[k], pixels[k], rows * 8, shades, true);
+    }
+    times[1] = get_monotonic_time() - start;
+
+    start = get_monotonic_time();
+    for(unsigned int i = 0; i < iterations; i++) {
+      for(size_t row = 0; row < rows; row++) {
+        kernels->compose_pixels(&image[k][row * 8], &flipped_pixels[k][row * 8], 8, shades, true);
+      }
+    }
+    times[2] = get_monotonic_time() - start;
+
+    if (k == 0) {
+      memcpy(scalar_times, times, sizeof(times));
+    }
+    bool identical = !memcmp(pixels[k], pixels[0], sizeof(pixels[k])) &&
+                     !memcmp(flipped_pixels[k], flipped_pixels[0], sizeof(flipped_pixels[k])) &&
+                     !memcmp(image[k], image[0], sizeof(image[k]));
+    printf("%-6s  decode %6.2f ns/row (%4.1fx)  compose %6.3f ns/pixel (%4.1fx), by tile row %6.3f ns/pixel (%4.1fx)%s\n",
+           kernels->name,
+           times[0] * 1e9 / (iterations * rows), scalar_times[0] / times[0],
+           times[1] * 1e9 / (iterations * rows * 8), scalar_times[1] / times[1],
+           times[2] * 1e9 / (iterations * rows * 8), scalar_times[2] / times[2],
+           identical ? "" : "  OUTPUT DIFFERS");
+  }
 }
 
 void gameboy_debug_hotkey(unsigned int f) {
+  gb = gameboy;
   switch(f) {
   case 1:
     printf("Dumping tiles 0x8000!\n");
@@ -2629,9 +6002,29 @@ void gameboy_debug_hotkey(unsigned int f) {
     printf("Dumping foreground sprites!\n");
     dump_sprites(false);
     break;
+  case 7:
+    print_idle_loop_statistics();
+    print_decoded_block_statistics();
+#if JIT
+    print_jit_statistics();
+#endif
+    break;
+#if DEBUG
+  case 8:
+    if (trace_context != NULL) {
+      stop_trace();
+    } else {
+      start_trace(get_trace_path());
+    }
+    break;
+#endif
   case 9:
-    fast_mode = !fast_mode;
-    printf("%s mode!\n", fast_mode ? "Fast" : "Normal");
+    gb->fast_mode = !gb->fast_mode;
+    printf("%s mode!\n", gb->fast_mode ? "Fast" : "Normal");
+    break;
+  case 10:
+    printf("Benchmarking pixel kernels!\n");
+    gameboy_benchmark_pixel_kernels();
     break;
   case 12:
     printf("Taking screenshot!\n");
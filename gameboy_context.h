@@ -0,0 +1,48 @@
+#ifndef GAMEBOY_CONTEXT_H
+#define GAMEBOY_CONTEXT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "gameboy.h"
+
+// Reentrant API: each context is an independent Game Boy.
+// A context must only be used by one thread at a time.
+typedef struct GameboyContext GameboyContext;
+
+// Flags for gameboy_context_init()
+#define GAMEBOY_CONTEXT_NO_SAVE (1 << 0) // Don't load or write the savegame, the clock doesn't catch up with the host
+
+// Returns NULL on failure
+GameboyContext* gameboy_context_init(const char* rom_file_path, unsigned int flags);
+void gameboy_context_step(GameboyContext* context);
+
+// Frames which aren't drawn are still emulated in full, including LY/STAT
+// timing and interrupts; the framebuffer keeps the last frame drawn.
+// The default can be set with GB_RENDER=all|every:<n>|request|none|adaptive.
+typedef enum {
+  GAMEBOY_RENDER_ALL,
+  GAMEBOY_RENDER_EVERY,      // Every `interval`-th frame
+  GAMEBOY_RENDER_ON_REQUEST, // Only after gameboy_context_request_frame()
+  GAMEBOY_RENDER_NONE,
+  GAMEBOY_RENDER_ADAPTIVE,   // Skips frames while running behind real time
+} GameboyRenderPolicy;
+void gameboy_context_render_policy(GameboyContext* context, GameboyRenderPolicy policy, unsigned int interval);
+// Draws the next frame stepped
+void gameboy_context_request_frame(GameboyContext* context);
+
+void gameboy_context_input(GameboyContext* context, const GameboyInput* input);
+const uint8_t* gameboy_context_framebuffer(GameboyContext* context);
+// Time since power-on, in 4.194304 MHz clock cycles (T-cycles), 70224 per frame
+uint64_t gameboy_context_cycles(GameboyContext* context);
+void gameboy_context_destroy(GameboyContext* context);
+
+// Memory used by one context, excluding the ROM
+size_t gameboy_context_size();
+
+// Times the scalar and SIMD tile decoding and drawing kernels against each
+// other and prints the results; needs no context
+void gameboy_benchmark_pixel_kernels();
+
+#endif
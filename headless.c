@@ -0,0 +1,120 @@
+// gb-headless: runs a ROM as fast as possible, without SDL
+//
+//   gb-headless [--input <script>] [--output <pgm-path>]
+//               [--every <frames> <pgm-prefix>] <rom-file-path> <frames>
+//   gb-headless --bench-kernels
+//
+// --input replays a button script (see input_script.h).
+// --output writes the final framebuffer.
+// --every writes every n-th frame to <pgm-prefix><frame>.pgm.
+// --bench-kernels only runs the pixel kernel benchmark, like F10 in gb-emu.
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include "gameboy.h"
+#include "gameboy_context.h"
+#include "input_script.h"
+
+static bool write_framebuffer(const char* path) {
+  FILE* f = fopen(path, "wb");
+  if (f == NULL) {
+    fprintf(stderr, "Could not open '%s' for writing\n", path);
+    return false;
+  }
+
+  // Binary graymap with the raw framebuffer intensities
+  fprintf(f, "P5\n%d %d\n255\n", GAMEBOY_SCREEN_WIDTH, GAMEBOY_SCREEN_HEIGHT);
+  fwrite(gameboy_framebuffer, 1, sizeof(gameboy_framebuffer), f);
+  fclose(f);
+  return true;
+}
+
+static double now_seconds() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1000000000.0;
+}
+
+int main(int argc, char* argv[]) {
+
+  // Benchmark without a ROM
+  if ((argc == 2) && !strcmp(argv[1], "--bench-kernels")) {
+    gameboy_benchmark_pixel_kernels();
+    return 0;
+  }
+
+  // Check for arguments
+  const char* input_script_path = NULL;
+  const char* output_path = NULL;
+  unsigned int every = 0;
+  const char* every_prefix = NULL;
+  int argi = 1;
+  while((argi < argc) && (argv[argi][0] == '-')) {
+    if (!strcmp(argv[argi], "--input") && (argi + 1 < argc)) {
+      input_script_path = argv[argi + 1];
+      argi += 2;
+    } else if (!strcmp(argv[argi], "--output") && (argi + 1 < argc)) {
+      output_path = argv[argi + 1];
+      argi += 2;
+    } else if (!strcmp(argv[argi], "--every") && (argi + 2 < argc)) {
+      every = strtoul(argv[argi + 1], NULL, 0);
+      every_prefix = argv[argi + 2];
+      argi += 3;
+    } else {
+      break;
+    }
+  }
+  if (argc - argi != 2) {
+    assert(argc >= 1);
+    fprintf(stderr, "Usage: %s [--input <script>] [--output <pgm-path>] [--every <frames> <pgm-prefix>] <rom-file-path> <frames>\n", argv[0]);
+    fprintf(stderr, "       %s --bench-kernels\n", argv[0]);
+    return 1;
+  }
+  const char* rom_file_path = argv[argi + 0];
+  unsigned int frames = strtoul(argv[argi + 1], NULL, 0);
+
+  InputScript script = { 0 };
+  if ((input_script_path != NULL) && !input_script_load(&script, input_script_path)) {
+    return 1;
+  }
+
+  // Call initialization
+  bool success = gameboy_init(rom_file_path);
+  if (!success) {
+    return 1;
+  }
+
+  // Mainloop, without any throttling
+  double start = now_seconds();
+  size_t cursor = 0;
+  for(unsigned int frame = 0; frame < frames; frame++) {
+    gameboy_input = input_script_input(&script, &cursor, frame);
+    gameboy_step();
+
+    if ((every > 0) && ((frame + 1) % every == 0)) {
+      char path[4096];
+      snprintf(path, sizeof(path), "%s%06u.pgm", every_prefix, frame + 1);
+      if (!write_framebuffer(path)) {
+        return 1;
+      }
+    }
+  }
+  double elapsed = now_seconds() - start;
+  printf("Emulated %u frames in %.3f s (%.1f frames/s)\n", frames, elapsed, frames / elapsed);
+
+  if ((output_path != NULL) && !write_framebuffer(output_path)) {
+    return 1;
+  }
+
+  // Inform the virtual gameboy that we are going to exit
+  gameboy_notify_exit();
+
+  input_script_free(&script);
+  return 0;
+}
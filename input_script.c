@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "input_script.h"
+
+static bool press_button(GameboyInput* input, const char* name) {
+  if (!strcmp(name, "start")) { input->start = true; return true; }
+  if (!strcmp(name, "select")) { input->select = true; return true; }
+  if (!strcmp(name, "a")) { input->a = true; return true; }
+  if (!strcmp(name, "b")) { input->b = true; return true; }
+  if (!strcmp(name, "up")) { input->up = true; return true; }
+  if (!strcmp(name, "down")) { input->down = true; return true; }
+  if (!strcmp(name, "left")) { input->left = true; return true; }
+  if (!strcmp(name, "right")) { input->right = true; return true; }
+  return false;
+}
+
+bool input_script_load(InputScript* script, const char* path) {
+  script->entries = NULL;
+  script->count = 0;
+
+  FILE* f = fopen(path, "r");
+  if (f == NULL) {
+    fprintf(stderr, "Could not open input script '%s'\n", path);
+    return false;
+  }
+
+  size_t capacity = 0;
+  unsigned int line_number = 0;
+  char line[256];
+  while(fgets(line, sizeof(line), f) != NULL) {
+    line_number++;
+
+    // Strip comments
+    char* comment = strchr(line, '#');
+    if (comment != NULL) {
+      *comment = '\0';
+    }
+
+    const char* separators = " \t\r\n";
+    char* saveptr;
+    char* token = strtok_r(line, separators, &saveptr);
+    if (token == NULL) {
+      continue;
+    }
+
+    InputScriptEntry entry;
+    memset(&entry, 0x00, sizeof(entry));
+    char* end;
+    entry.frame = strtoul(token, &end, 0);
+    bool valid = (*end == '\0');
+    if (valid && (script->count > 0)) {
+      valid = (entry.frame >= script->entries[script->count - 1].frame);
+    }
+    while(valid && ((token = strtok_r(NULL, separators, &saveptr)) != NULL)) {
+      valid = press_button(&entry.input, token);
+    }
+    if (!valid) {
+      fprintf(stderr, "%s:%u: Expected increasing frame number followed by buttons\n", path, line_number);
+      fclose(f);
+      input_script_free(script);
+      return false;
+    }
+
+    if (script->count == capacity) {
+      capacity = capacity ? capacity * 2 : 64;
+      script->entries = realloc(script->entries, capacity * sizeof(InputScriptEntry));
+      assert(script->entries != NULL);
+    }
+    script->entries[script->count++] = entry;
+  }
+
+  fclose(f);
+  return true;
+}
+
+void input_script_free(InputScript* script) {
+  free(script->entries);
+  script->entries = NULL;
+  script->count = 0;
+}
+
+GameboyInput input_script_input(const InputScript* script, size_t* cursor, unsigned int frame) {
+  while((*cursor < script->count) && (script->entries[*cursor].frame <= frame)) {
+    (*cursor)++;
+  }
+
+  // Nothing is pressed before the first entry
+  if (*cursor == 0) {
+    GameboyInput input;
+    memset(&input, 0x00, sizeof(input));
+    return input;
+  }
+  return script->entries[*cursor - 1].input;
+}
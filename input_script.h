@@ -0,0 +1,37 @@
+#ifndef INPUT_SCRIPT_H
+#define INPUT_SCRIPT_H
+
+#include <stddef.h>
+#include <stdbool.h>
+
+#include "gameboy.h"
+
+// Button presses for headless runs, one change per line:
+//
+//   # frame buttons...
+//   60 start
+//   62
+//   120 a right
+//
+// The buttons are held from the given frame until the next line.
+// A line without buttons releases all of them.
+
+typedef struct {
+  unsigned int frame;
+  GameboyInput input;
+} InputScriptEntry;
+
+typedef struct {
+  InputScriptEntry* entries;
+  size_t count;
+} InputScript;
+
+// Returns false (and prints why) if the file can't be read or parsed
+bool input_script_load(InputScript* script, const char* path);
+void input_script_free(InputScript* script);
+
+// Input for `frame`; frames must be asked for in increasing order,
+// `cursor` starts at 0 and keeps track of the position in the script
+GameboyInput input_script_input(const InputScript* script, size_t* cursor, unsigned int frame);
+
+#endif
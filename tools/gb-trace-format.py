@@ -0,0 +1,77 @@
+#!/usr/bin/env python3
+
+# Converts a binary trace (F8 or GB_TRACE=<path>) to the text format which
+# mgba-parser.py understands:
+#
+#   A: 01 F: B0 B: 00 C: 13 D: 00 E: D8 H: 01 L: 4D SP: FFFE PC: 00:0100 | 00: nop
+
+import struct
+
+MAGIC = b'GBTRACE1'
+
+# See TraceRecord in gameboy.c
+INSTRUCTION = struct.Struct('<QHHH8B3sB6x')
+DISASSEMBLY = struct.Struct('<3sB32s')
+
+
+def instruction_key(code, length):
+  return code[0:length]
+
+
+def read_trace(f):
+  if f.read(len(MAGIC)) != MAGIC:
+    raise ValueError('Not a trace file')
+
+  disassembly = {}
+  while True:
+    tag = f.read(1)
+    if tag == b'':
+      break
+
+    # Disassembly of an instruction, which is sent before its first use
+    if tag == b'M':
+      code, length, text = DISASSEMBLY.unpack(f.read(DISASSEMBLY.size))
+      disassembly[instruction_key(code, length)] = text.partition(b'\0')[0].decode('ascii')
+
+    # Executed instruction
+    elif tag == b'I':
+      cycles, sp, pc, bank, a, f_, b, c, d, e, h, l, code, length = INSTRUCTION.unpack(f.read(INSTRUCTION.size))
+      key = instruction_key(code, length)
+      yield {
+        'cycles': cycles,
+        'a': a, 'f': f_, 'b': b, 'c': c, 'd': d, 'e': e, 'h': h, 'l': l,
+        'sp': sp, 'pc': pc, 'bank': bank,
+        'bytes': key,
+        'mnemonic': disassembly[key]
+      }
+
+    else:
+      raise ValueError('Unknown record %r' % tag)
+
+
+def format_instruction(i):
+  return ('A: %02X F: %02X B: %02X C: %02X D: %02X E: %02X H: %02X L: %02X SP: %04X PC: %02X:%04X | %s: %s' %
+          (i['a'], i['f'], i['b'], i['c'], i['d'], i['e'], i['h'], i['l'],
+           i['sp'], i['bank'], i['pc'], i['bytes'].hex().upper(), i['mnemonic']))
+
+
+if __name__ == '__main__':
+
+  import sys
+
+  if len(sys.argv) < 2:
+    print('%s [--cycles] <trace-path>' % sys.argv[0])
+    sys.exit(1)
+
+  cycles = '--cycles' in sys.argv[1:]
+  paths = [path for path in sys.argv[1:] if path != '--cycles']
+
+  for path in paths:
+    with open(path, 'rb') as f:
+      for instruction in read_trace(f):
+        line = format_instruction(instruction)
+        if cycles:
+          line = '%d %s' % (instruction['cycles'], line)
+        print(line)
+
+  sys.exit(0)